@@ -0,0 +1,357 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * bench runs every section of inspector against fake procfs trees made by
+ * genprocfs and reports how long each one takes, how many syscalls it makes
+ * and how much memory it needs, for trees of different sizes.
+ */
+
+/* Most runs of one section that are timed */
+#define MAX_RUNS 100
+
+/* Sections that are benchmarked, one inspector option each */
+static const char *sections[] = { "-s", "-r", "-t", "-l" };
+#define NUM_SECTIONS (sizeof(sections) / sizeof(sections[0]))
+
+/* Settings of the benchmark, set by the command line options */
+struct bench_opts {
+    const char *inspector;
+    const char *generator;
+    const char *treeDir;
+    int runs;
+    int cpus;
+    int threads;
+    const char *jobs;
+};
+
+/* Result of one run of inspector */
+struct run_result {
+    double wallMs;
+    double cpuMs;
+    long maxRssKB;
+};
+
+/* msSince func returns the milliseconds since a CLOCK_MONOTONIC time */
+double msSince(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* run func runs a command with stdout sent to /dev/null and waits for it
+ * Parameters:
+ * - NULL terminated argument list, argv[0] is the program
+ * - pointer to run_result struct that will be filled, or NULL
+ *
+ * Returns the exit status of the command, -1 if it could not run
+ * */
+int run(char *argv[], struct run_result *result) {
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        if (devNull != -1) {
+            dup2(devNull, STDOUT_FILENO);
+            close(devNull);
+        }
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        return -1;
+    }
+
+    if (result != NULL) {
+        result->wallMs = msSince(&start);
+        result->cpuMs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0
+                + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+        result->maxRssKB = usage.ru_maxrss;
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* inPath func checks if a program can be found in PATH */
+bool inPath(const char *program) {
+    const char *path = getenv("PATH");
+    if (path == NULL) {
+        return false;
+    }
+
+    char candidate[PATH_MAX];
+    while (*path != '\0') {
+        size_t len = strcspn(path, ":");
+        snprintf(candidate, sizeof(candidate), "%.*s/%s", (int) len, path, program);
+        if (access(candidate, X_OK) == 0) {
+            return true;
+        }
+        path += len;
+        if (*path == ':') {
+            path++;
+        }
+    }
+
+    return false;
+}
+
+/* countSyscalls func runs a command under strace -c and returns the total
+ * number of syscalls it made, or -1 if that is not possible */
+long countSyscalls(char *argv[], const char *outFile) {
+
+    char *straceArgv[32] = { "strace", "-f", "-c", "-o", (char *) outFile };
+    int argc = 5;
+    for (int i = 0; argv[i] != NULL && argc < 31; i++) {
+        straceArgv[argc++] = argv[i];
+    }
+    straceArgv[argc] = NULL;
+
+    if (run(straceArgv, NULL) != 0) {
+        return -1;
+    }
+
+    FILE *file = fopen(outFile, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    // the summary ends with "100.00 <seconds> <usecs/call> <calls> [errors] total"
+    long calls = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strstr(line, " total") != NULL) {
+            double percent;
+            double seconds;
+            long usecs;
+            if (sscanf(line, "%lf %lf %ld %ld", &percent, &seconds, &usecs, &calls) != 4) {
+                calls = -1;
+            }
+        }
+    }
+    fclose(file);
+    unlink(outFile);
+
+    return calls;
+}
+
+/* saveCpuSample func writes the cpu lines of the tree's stat as the saved
+ * sample of inspector -d, one second old, so -r does not wait for a second
+ * sample and only the collection itself is measured */
+void saveCpuSample(const char *tree, const char *runDir) {
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/stat", tree);
+    FILE *stat = fopen(path, "r");
+    snprintf(path, sizeof(path), "%s/inspector-cpu.state", runDir);
+    FILE *state = fopen(path, "w");
+    if (stat == NULL || state == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    fprintf(state, "time %lld %ld\n", (long long) now.tv_sec - 1, now.tv_nsec);
+
+    char line[4096];
+    bool cpuLine = false;
+    while (fgets(line, sizeof(line), stat) != NULL) {
+        // lines longer than the buffer come in pieces, only the start counts
+        bool start = !cpuLine || line[0] == 'c';
+        if (start) {
+            cpuLine = strncmp(line, "cpu", 3) == 0;
+        }
+        if (cpuLine) {
+            fputs(line, state);
+        }
+        cpuLine = cpuLine && strchr(line, '\n') == NULL;
+    }
+
+    fclose(stat);
+    fclose(state);
+}
+
+/* compareDoubles func is used to sort the wall times */
+int compareDoubles(const void *a, const void *b) {
+    double d1 = *(const double *) a;
+    double d2 = *(const double *) b;
+    return (d1 > d2) - (d1 < d2);
+}
+
+/* benchTree func generates (if needed) and benchmarks one tree */
+void benchTree(struct bench_opts *opts, int pids, bool strace) {
+
+    char tree[PATH_MAX];
+    char runDir[PATH_MAX + 8];
+    snprintf(tree, sizeof(tree), "%s/%dp-%dc-%dt", opts->treeDir, pids, opts->cpus, opts->threads);
+    snprintf(runDir, sizeof(runDir), "%s.run", tree);
+
+    struct stat treeStat;
+    char statPath[PATH_MAX + 8];
+    snprintf(statPath, sizeof(statPath), "%s/stat", tree);
+    if (stat(statPath, &treeStat) == -1) {
+        char pidsArg[16];
+        char cpusArg[16];
+        char threadsArg[16];
+        snprintf(pidsArg, sizeof(pidsArg), "%d", pids);
+        snprintf(cpusArg, sizeof(cpusArg), "%d", opts->cpus);
+        snprintf(threadsArg, sizeof(threadsArg), "%d", opts->threads);
+        char *genArgv[] = { (char *) opts->generator, "-n", pidsArg, "-c", cpusArg,
+                "-t", threadsArg, tree, NULL };
+
+        fprintf(stderr, "Generating %s\n", tree);
+        struct run_result gen;
+        if (run(genArgv, &gen) != 0) {
+            fprintf(stderr, "Could not generate %s\n", tree);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Generated in %.0f ms\n", gen.wallMs);
+    }
+    mkdir(runDir, 0755);
+
+    for (size_t s = 0; s < NUM_SECTIONS; s++) {
+        char *argv[12] = { (char *) opts->inspector, "-p", tree, (char *) sections[s], "-d", runDir };
+        int argc = 6;
+        if (opts->jobs != NULL) {
+            argv[argc++] = "-j";
+            argv[argc++] = (char *) opts->jobs;
+        }
+        argv[argc] = NULL;
+
+        double wall[MAX_RUNS];
+        double cpu = 0;
+        long maxRss = 0;
+        for (int r = 0; r < opts->runs; r++) {
+            saveCpuSample(tree, runDir);
+            struct run_result result;
+            if (run(argv, &result) != 0) {
+                fprintf(stderr, "%s %s failed\n", opts->inspector, sections[s]);
+                exit(EXIT_FAILURE);
+            }
+            wall[r] = result.wallMs;
+            cpu += result.cpuMs;
+            if (result.maxRssKB > maxRss) {
+                maxRss = result.maxRssKB;
+            }
+        }
+        qsort(wall, opts->runs, sizeof(double), compareDoubles);
+
+        long syscalls = -1;
+        if (strace) {
+            char outFile[PATH_MAX + 24];
+            snprintf(outFile, sizeof(outFile), "%s/strace.out", runDir);
+            saveCpuSample(tree, runDir);
+            syscalls = countSyscalls(argv, outFile);
+        }
+
+        char syscallsStr[24] = "-";
+        if (syscalls >= 0) {
+            snprintf(syscallsStr, sizeof(syscallsStr), "%ld", syscalls);
+        }
+        printf("%9d | %7s | %10.2f | %10.2f | %10.2f | %10ld | %10s\n", pids, sections[s],
+                wall[opts->runs / 2], wall[0], cpu / opts->runs, maxRss, syscallsStr);
+        fflush(stdout);
+    }
+}
+
+void print_usage(char *argv[]) {
+    printf("Usage: %s [-c cpus] [-g genprocfs] [-i inspector] [-j threads] [-o tree_dir] [-r runs] [-t threads] pids...\n",
+            argv[0]);
+    printf("\n");
+    printf("Runs each section of inspector against generated procfs trees with the given numbers of processes.\n\n");
+    printf("Options:\n"
+                   "    * -c cpus         Number of cpus in the trees (default: 8)\n"
+                   "    * -g genprocfs    Path of the generator (default: ./bench/genprocfs)\n"
+                   "    * -i inspector    Path of inspector (default: ./inspector)\n"
+                   "    * -j threads      Passed to inspector -j\n"
+                   "    * -o tree_dir     Where the trees are generated and kept (default: /tmp/inspector-bench)\n"
+                   "    * -r runs         Timed runs per section (default: 5)\n"
+                   "    * -t threads      Threads per process in the trees (default: 1)\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+
+    struct bench_opts opts = { "./inspector", "./bench/genprocfs", "/tmp/inspector-bench", 5, 8, 1, NULL };
+
+    int c;
+    while ((c = getopt(argc, argv, "c:g:hi:j:o:r:t:")) != -1) {
+        switch (c) {
+            case 'c':
+                opts.cpus = atoi(optarg);
+                break;
+            case 'g':
+                opts.generator = optarg;
+                break;
+            case 'i':
+                opts.inspector = optarg;
+                break;
+            case 'j':
+                opts.jobs = optarg;
+                break;
+            case 'o':
+                opts.treeDir = optarg;
+                break;
+            case 'r':
+                opts.runs = atoi(optarg);
+                break;
+            case 't':
+                opts.threads = atoi(optarg);
+                break;
+            case 'h':
+                print_usage(argv);
+                return 0;
+            default:
+                print_usage(argv);
+                return 1;
+        }
+    }
+
+    if (optind == argc || opts.runs < 1 || opts.runs > MAX_RUNS) {
+        print_usage(argv);
+        return 1;
+    }
+
+    if (mkdir(opts.treeDir, 0755) == -1 && errno != EEXIST) {
+        perror(opts.treeDir);
+        return 1;
+    }
+
+    bool strace = inPath("strace");
+    if (!strace) {
+        fprintf(stderr, "strace not found, syscalls are not counted\n");
+    }
+
+    printf("%9s | %7s | %10s | %10s | %10s | %10s | %10s\n",
+            "Processes", "Section", "Median ms", "Min ms", "CPU ms", "Max RSS KB", "Syscalls");
+    printf("----------+---------+------------+------------+------------+------------+-----------\n");
+
+    for (int i = optind; i < argc; i++) {
+        benchTree(&opts, atoi(argv[i]), strace);
+    }
+
+    return 0;
+}
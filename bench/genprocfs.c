@@ -0,0 +1,383 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/**
+ * genprocfs creates a fake procfs tree that inspector can read with -p. All
+ * the numbers come from a seeded generator, so the same options always give
+ * the same tree.
+ */
+
+/* Task names used for the fake processes, some of them on purpose contain
+ * spaces and brackets like real ones do. A comm can be anything a program
+ * sets, "a) b (c" makes the stat line look like it ends early */
+static const char *taskNames[] = {
+    "systemd", "kthreadd", "kworker/0:1-events", "(sd-pam)", "tmux: server",
+    "java", "postgres", "nginx", "sshd", "bash", "containerd-shim",
+    "a name longer than twenty five bytes", "python3", "Web Content", "a) b (c",
+};
+#define NUM_TASK_NAMES (sizeof(taskNames) / sizeof(taskNames[0]))
+
+static const char states[] = "SSSSSRIDZT";
+
+/* Sizes of the tree, set by the command line options */
+struct gen_opts {
+    int pids;
+    int threads;
+    int cpus;
+    int irqs;
+    int cpuinfoKB;
+    int uids;
+    unsigned int seed;
+};
+
+/* Buffer the content of each file is built in before it is written */
+struct out_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static unsigned long long rngState;
+
+/* rnd func returns the next number of a 64 bit LCG */
+unsigned long long rnd() {
+    rngState = rngState * 6364136223846793005ULL + 1442695040888963407ULL;
+    return rngState >> 17;
+}
+
+/* put func appends printf formatted text to an out_buf */
+__attribute__((format(printf, 2, 3)))
+void put(struct out_buf *buf, const char *fmt, ...) {
+    while (true) {
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+
+        if (buf->len + len < buf->cap) {
+            buf->len += len;
+            return;
+        }
+        buf->cap = (buf->cap + len) * 2;
+        buf->data = realloc(buf->data, buf->cap);
+        if (buf->data == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* writeAt func writes an out_buf to a file relative to a directory and
+ * empties the buffer */
+void writeAt(int dirFd, const char *name, struct out_buf *buf) {
+    int fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    if (write(fd, buf->data, buf->len) != (ssize_t) buf->len) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    buf->len = 0;
+}
+
+/* makeDirAt func creates a directory (if it is not there) and opens it */
+int makeDirAt(int dirFd, const char *name) {
+    if (mkdirat(dirFd, name, 0755) == -1 && errno != EEXIST) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/* genSystem func creates the system wide files */
+void genSystem(int root, struct gen_opts *opts, struct out_buf *buf) {
+
+    int sys = makeDirAt(root, "sys");
+    int kernel = makeDirAt(sys, "kernel");
+    put(buf, "fakehost\n");
+    writeAt(kernel, "hostname", buf);
+    put(buf, "6.1.0-fake\n");
+    writeAt(kernel, "osrelease", buf);
+    close(kernel);
+    close(sys);
+
+    put(buf, "%llu.%02llu %llu.%02llu\n", 100000 + rnd() % 1000000, rnd() % 100,
+            rnd() % 10000000, rnd() % 100);
+    writeAt(root, "uptime", buf);
+
+    put(buf, "%.2f %.2f %.2f %d/%d %d\n", (rnd() % 800) / 100.0, (rnd() % 800) / 100.0,
+            (rnd() % 800) / 100.0, 1 + (int) (rnd() % 8), opts->pids * opts->threads, opts->pids);
+    writeAt(root, "loadavg", buf);
+
+    unsigned long long memTotal = 16ULL * 1024 * 1024 * (1 + opts->cpus / 8);
+    put(buf, "MemTotal:       %llu kB\n", memTotal);
+    put(buf, "MemFree:        %llu kB\n", memTotal / 4);
+    put(buf, "MemAvailable:   %llu kB\n", memTotal / 2);
+    put(buf, "Buffers:        %llu kB\n", memTotal / 64);
+    put(buf, "Cached:         %llu kB\n", memTotal / 8);
+    put(buf, "SwapCached:     0 kB\n");
+    put(buf, "Active:         %llu kB\n", memTotal / 3);
+    put(buf, "Inactive:       %llu kB\n", memTotal / 5);
+    put(buf, "SwapTotal:      0 kB\n");
+    put(buf, "SwapFree:       0 kB\n");
+    writeAt(root, "meminfo", buf);
+
+    // stat: aggregate and per cpu lines, then the wide intr line
+    unsigned long long total[10] = { 0 };
+    struct out_buf cpuLines = { NULL, 0, 0 };
+    for (int cpu = 0; cpu < opts->cpus; cpu++) {
+        put(&cpuLines, "cpu%d", cpu);
+        for (int i = 0; i < 10; i++) {
+            unsigned long long value = i >= 8 ? 0 : rnd() % (i == 3 ? 100000000 : 5000000);
+            total[i] += value;
+            put(&cpuLines, " %llu", value);
+        }
+        put(&cpuLines, "\n");
+    }
+    put(buf, "cpu ");
+    for (int i = 0; i < 10; i++) {
+        put(buf, " %llu", total[i]);
+    }
+    put(buf, "\n");
+    if (cpuLines.len > 0) {
+        put(buf, "%.*s", (int) cpuLines.len, cpuLines.data);
+    }
+    free(cpuLines.data);
+
+    unsigned long long intrTotal = 0;
+    struct out_buf intr = { NULL, 0, 0 };
+    for (int i = 0; i < opts->irqs; i++) {
+        unsigned long long value = rnd() % 4 == 0 ? rnd() % 10000000 : 0;
+        intrTotal += value;
+        put(&intr, " %llu", value);
+    }
+    put(buf, "intr %llu%.*s\n", intrTotal, (int) intr.len, intr.data ? intr.data : "");
+    free(intr.data);
+    put(buf, "ctxt %llu\n", rnd() % 10000000000ULL);
+    put(buf, "btime %llu\n", 1700000000 + rnd() % 10000000);
+    put(buf, "processes %llu\n", opts->pids + rnd() % 10000000);
+    put(buf, "procs_running %d\n", 1 + (int) (rnd() % (opts->cpus + 1)));
+    put(buf, "procs_blocked %d\n", (int) (rnd() % 3));
+    put(buf, "softirq %llu 0 0 0 0 0 0 0 0 0 0\n", rnd() % 10000000);
+    writeAt(root, "stat", buf);
+
+    // cpuinfo: one block per cpu, the flags line is padded so the file
+    // reaches the requested size
+    size_t padding = 0;
+    if (opts->cpuinfoKB > 0 && opts->cpus > 0) {
+        size_t target = (size_t) opts->cpuinfoKB * 1024 / opts->cpus;
+        padding = target > 400 ? target - 400 : 0;
+    }
+    for (int cpu = 0; cpu < opts->cpus; cpu++) {
+        put(buf, "processor\t: %d\n", cpu);
+        put(buf, "vendor_id\t: GenuineFake\n");
+        put(buf, "cpu family\t: 6\n");
+        put(buf, "model\t\t: 85\n");
+        put(buf, "model name\t: Fake(R) Xeon(R) CPU @ 2.00GHz\n");
+        put(buf, "stepping\t: 7\n");
+        put(buf, "cpu MHz\t\t: 2000.000\n");
+        put(buf, "cache size\t: 39424 KB\n");
+        put(buf, "physical id\t: %d\n", cpu / 64);
+        put(buf, "core id\t\t: %d\n", cpu % 64);
+        put(buf, "flags\t\t: fpu vme de pse tsc msr pae mce cx8 apic sep mtrr");
+        for (size_t i = 0; i + 8 < padding; i += 8) {
+            put(buf, " flag%03d", (int) (i / 8) % 1000);
+        }
+        put(buf, "\n");
+        put(buf, "bogomips\t: 4000.00\n\n");
+    }
+    writeAt(root, "cpuinfo", buf);
+
+}
+
+/* genStat func builds the stat line of a process or thread */
+void genStat(struct out_buf *buf, int pid, const char *name, char state, int threads,
+        unsigned long long startTime) {
+    unsigned long long vsize = (rnd() % 4096 + 1) * 1024 * 1024;
+    unsigned long long rss = vsize / 4096 / (1 + rnd() % 8);
+
+    put(buf, "%d (%s) %c %d %d %d 0 -1 4194560 %llu 0 %llu 0 %llu %llu 0 0 20 0 %d 0 %llu %llu %llu "
+            "18446744073709551615 1 1 0 0 0 0 0 4096 0 0 0 17 %d 0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+            pid, name, state, pid > 1 ? 1 : 0, pid, pid,
+            rnd() % 100000, rnd() % 1000, rnd() % 100000, rnd() % 50000,
+            threads, startTime, vsize, rss, (int) (rnd() % 64));
+}
+
+/* genProcess func creates /[pid] with its stat, status, cmdline, io,
+ * statm, smaps_rollup, task and fd directories */
+void genProcess(int root, int pid, struct gen_opts *opts, struct out_buf *buf) {
+
+    char pidName[16];
+    snprintf(pidName, sizeof(pidName), "%d", pid);
+    int pidFd = makeDirAt(root, pidName);
+
+    const char *name = taskNames[rnd() % NUM_TASK_NAMES];
+    char state = states[rnd() % (sizeof(states) - 1)];
+    unsigned long long startTime = rnd() % 10000000;
+    int uid = opts->uids > 1 ? (int) (pid % opts->uids) * 1000 : (int) getuid();
+
+    genStat(buf, pid, name, state, opts->threads, startTime);
+    writeAt(pidFd, "stat", buf);
+
+    put(buf, "Name:\t%.15s\nUmask:\t0022\nState:\t%c\nTgid:\t%d\nNgid:\t0\nPid:\t%d\nPPid:\t%d\n"
+            "Uid:\t%d\t%d\t%d\t%d\nGid:\t%d\t%d\t%d\t%d\nFDSize:\t64\n"
+            "VmPeak:\t%8llu kB\nVmSize:\t%8llu kB\nVmRSS:\t%8llu kB\nThreads:\t%d\n",
+            name, state, pid, pid, pid > 1 ? 1 : 0, uid, uid, uid, uid, uid, uid, uid, uid,
+            rnd() % 10000000, rnd() % 10000000, rnd() % 1000000, opts->threads);
+    writeAt(pidFd, "status", buf);
+
+    // cmdline is NUL separated
+    put(buf, "/usr/bin/%s", name);
+    buf->len++;
+    put(buf, "--config=/etc/%d.conf", pid);
+    buf->len++;
+    writeAt(pidFd, "cmdline", buf);
+
+    put(buf, "rchar: %llu\nwchar: %llu\nsyscr: %llu\nsyscw: %llu\nread_bytes: %llu\n"
+            "write_bytes: %llu\ncancelled_write_bytes: 0\n",
+            rnd() % 1000000000, rnd() % 1000000000, rnd() % 100000, rnd() % 100000,
+            rnd() % 100000000, rnd() % 100000000);
+    writeAt(pidFd, "io", buf);
+
+    put(buf, "%llu %llu %llu 1 0 %llu 0\n", rnd() % 100000, rnd() % 10000, rnd() % 1000,
+            rnd() % 10000);
+    writeAt(pidFd, "statm", buf);
+
+    put(buf, "00400000-7fffffffffff ---p 00000000 00:00 0                          [rollup]\n"
+            "Rss:             %llu kB\nPss:             %llu kB\nShared_Clean:    0 kB\n"
+            "Private_Dirty:   %llu kB\nSwap:            0 kB\n",
+            rnd() % 1000000, rnd() % 1000000, rnd() % 100000);
+    writeAt(pidFd, "smaps_rollup", buf);
+
+    int taskFd = makeDirAt(pidFd, "task");
+    for (int i = 0; i < opts->threads; i++) {
+        int tid = i == 0 ? pid : opts->pids + 1 + (pid - 1) * opts->threads + i;
+        char tidName[16];
+        snprintf(tidName, sizeof(tidName), "%d", tid);
+        int tidFd = makeDirAt(taskFd, tidName);
+        genStat(buf, tid, name, state, opts->threads, startTime);
+        writeAt(tidFd, "stat", buf);
+        close(tidFd);
+    }
+    close(taskFd);
+
+    int fdDir = makeDirAt(pidFd, "fd");
+    int numFds = 3 + (int) (rnd() % 16);
+    for (int i = 0; i < numFds; i++) {
+        char fdName[16];
+        snprintf(fdName, sizeof(fdName), "%d", i);
+        if (symlinkat("/dev/null", fdDir, fdName) == -1 && errno != EEXIST) {
+            perror("symlinkat");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fdDir);
+
+    // real /proc/[pid] directories belong to the owner of the process
+    if (geteuid() == 0 && opts->uids > 1) {
+        if (fchownat(root, pidName, uid, uid, AT_SYMLINK_NOFOLLOW) == -1) {
+            perror("fchownat");
+        }
+    }
+
+    close(pidFd);
+}
+
+void print_usage(char *argv[]) {
+    printf("Usage: %s [-c cpus] [-i irqs] [-k cpuinfo_kb] [-n pids] [-s seed] [-t threads] [-u uids] dir\n",
+            argv[0]);
+    printf("\n");
+    printf("Creates a fake procfs tree in dir for inspector -p dir.\n\n");
+    printf("Options:\n"
+                   "    * -c cpus         Number of cpus (default: 8)\n"
+                   "    * -i irqs         Number of counters on the intr line (default: 256)\n"
+                   "    * -k cpuinfo_kb   Pad cpuinfo to about this size (default: no padding)\n"
+                   "    * -n pids         Number of processes (default: 100)\n"
+                   "    * -s seed         Seed of the number generator (default: 1)\n"
+                   "    * -t threads      Threads per process (default: 1)\n"
+                   "    * -u uids         Number of different owners, needs root (default: 1)\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+
+    struct gen_opts opts = { 100, 1, 8, 256, 0, 1, 1 };
+
+    int c;
+    while ((c = getopt(argc, argv, "c:hi:k:n:s:t:u:")) != -1) {
+        switch (c) {
+            case 'c':
+                opts.cpus = atoi(optarg);
+                break;
+            case 'i':
+                opts.irqs = atoi(optarg);
+                break;
+            case 'k':
+                opts.cpuinfoKB = atoi(optarg);
+                break;
+            case 'n':
+                opts.pids = atoi(optarg);
+                break;
+            case 's':
+                opts.seed = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                opts.threads = atoi(optarg);
+                break;
+            case 'u':
+                opts.uids = atoi(optarg);
+                break;
+            case 'h':
+                print_usage(argv);
+                return 0;
+            default:
+                print_usage(argv);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || opts.pids < 0 || opts.threads < 1 || opts.cpus < 1
+            || opts.irqs < 0 || opts.uids < 1) {
+        print_usage(argv);
+        return 1;
+    }
+
+    rngState = opts.seed;
+
+    if (mkdir(argv[optind], 0755) == -1 && errno != EEXIST) {
+        perror(argv[optind]);
+        return 1;
+    }
+    int root = open(argv[optind], O_RDONLY | O_DIRECTORY);
+    if (root == -1) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    struct out_buf buf = { NULL, 0, 0 };
+    genSystem(root, &opts, &buf);
+    for (int pid = 1; pid <= opts.pids; pid++) {
+        genProcess(root, pid, &opts, &buf);
+    }
+
+    free(buf.data);
+    close(root);
+
+    return 0;
+}
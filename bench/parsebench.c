@@ -0,0 +1,497 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libinspector.h"
+
+/**
+ * parsebench times the procfs parsers of libinspector against the ways they
+ * used to work, on text generated in memory: a /proc/stat with many cpus and
+ * interrupts, and a set of /proc/[pid]/stat lines. Every way has to give the
+ * same numbers, or the benchmark stops.
+ */
+
+/* Settings of the benchmark, set by the command line options */
+struct parse_opts {
+    int cpus;
+    int interrupts;
+    int lines;
+    int runs;
+};
+
+/* Numbers of a /proc/[pid]/stat line the task list uses */
+struct stat_fields {
+    char state;
+    unsigned long long utime;
+    unsigned long long stime;
+    int threads;
+    unsigned long long startTime;
+    unsigned long long vsize;
+    unsigned long long rss;
+};
+
+/* Names of the generated processes, with the spaces and brackets comm can have */
+static const char *names[] = { "bash", "kworker/0:1-events", "Web Content", "(sd-pam)", "a) b" };
+#define NUM_NAMES (sizeof(names) / sizeof(names[0]))
+
+/* Generated text the parsers run on */
+struct parse_input {
+    char *stat;
+    size_t statLen;
+    char **lines;
+    int numLines;
+};
+
+/* msSince func returns the milliseconds since a CLOCK_MONOTONIC time */
+double msSince(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* appendf func appends formatted text to a growing buffer */
+void appendf(struct read_buf *buf, const char *fmt, unsigned long long a, unsigned long long b) {
+    char text[128];
+    int len = snprintf(text, sizeof(text), fmt, a, b);
+    growBuf(buf, buf->len + len + 1);
+    memcpy(buf->data + buf->len, text, len + 1);
+    buf->len += len;
+}
+
+/* makeInput func generates the /proc/stat and the stat lines */
+void makeInput(const struct parse_opts *opts, struct parse_input *input) {
+
+    srand(1);
+    struct read_buf buf = { NULL, 0, 0 };
+    for (int cpu = -1; cpu < opts->cpus; cpu++) {
+        if (cpu == -1) {
+            appendf(&buf, "cpu ", 0, 0);
+        } else {
+            appendf(&buf, "cpu%llu", cpu, 0);
+        }
+        for (int i = 0; i < 10; i++) {
+            appendf(&buf, " %llu", (unsigned long long) rand() * (cpu == -1 ? 997 : 13) % 100000000000ULL, 0);
+        }
+        appendf(&buf, "\n", 0, 0);
+    }
+    appendf(&buf, "intr %llu", (unsigned long long) rand() * 4099, 0);
+    for (int i = 0; i < opts->interrupts; i++) {
+        appendf(&buf, " %llu", i % 3 == 0 ? 0 : (unsigned long long) rand() % 1000000, 0);
+    }
+    appendf(&buf, "\nctxt %llu\nbtime %llu\n", (unsigned long long) rand() * 7919, 1700000000);
+    appendf(&buf, "processes %llu\nprocs_running %llu\n", (unsigned long long) rand(), 3);
+    appendf(&buf, "procs_blocked %llu\nsoftirq %llu 0 1 2 3 4 5 6 7 8 9\n", 0, (unsigned long long) rand());
+    input->stat = buf.data;
+    input->statLen = buf.len;
+
+    input->numLines = opts->lines;
+    input->lines = malloc(opts->lines * sizeof(char *));
+    for (int i = 0; i < opts->lines; i++) {
+        buf = (struct read_buf) { NULL, 0, 0 };
+        appendf(&buf, "%llu (", i + 1, 0);
+        growBuf(&buf, buf.len + 32);
+        buf.len += sprintf(buf.data + buf.len, "%s", names[i % NUM_NAMES]);
+        appendf(&buf, ") S %llu %llu", 1, i + 1);
+        for (int field = 6; field <= 52; field++) {
+            appendf(&buf, " %llu", field == 20 ? 1 + rand() % 64 : (unsigned long long) rand() * (field % 7), 0);
+        }
+        appendf(&buf, "\n", 0, 0);
+        input->lines[i] = buf.data;
+    }
+}
+
+/* tokenStat func parses /proc/stat the way it was first done: every token
+ * of the file goes through next_token() and strtoull() */
+void tokenStat(const char *text, size_t len, struct stat_snapshot *stat, char *copy) {
+    // next_token() cuts the text up, so it works on a copy
+    memcpy(copy, text, len + 1);
+    stat->numCpus = 0;
+
+    char *next_tok = copy;
+    char *curr_tok;
+    while ((curr_tok = next_token(&next_tok, " \n")) != NULL) {
+        if (strncmp(curr_tok, "cpu", 3) == 0) {
+            struct cpu_times *times = &stat->total;
+            if (curr_tok[3] != '\0') {
+                if (stat->numCpus == stat->cpusCap) {
+                    stat->cpusCap = stat->cpusCap ? stat->cpusCap * 2 : 16;
+                    stat->cpus = realloc(stat->cpus, stat->cpusCap * sizeof(struct cpu_times));
+                    stat->cpuIds = realloc(stat->cpuIds, stat->cpusCap * sizeof(int));
+                }
+                stat->cpuIds[stat->numCpus] = (int) strtol(curr_tok + 3, NULL, 10);
+                times = &stat->cpus[stat->numCpus++];
+            }
+            for (int i = 0; i < CPU_FIELDS; i++) {
+                times->field[i] = strtoull(next_token(&next_tok, " \n"), NULL, 10);
+            }
+        } else if (strcmp(curr_tok, "intr") == 0) {
+            stat->intr = strtoull(next_token(&next_tok, " \n"), NULL, 10);
+        } else if (strcmp(curr_tok, "ctxt") == 0) {
+            stat->ctxt = strtoull(next_token(&next_tok, " \n"), NULL, 10);
+        } else if (strcmp(curr_tok, "processes") == 0) {
+            stat->processes = strtoull(next_token(&next_tok, " \n"), NULL, 10);
+        } else if (strcmp(curr_tok, "procs_running") == 0) {
+            stat->procsRunning = strtoull(next_token(&next_tok, " \n"), NULL, 10);
+        } else if (strcmp(curr_tok, "procs_blocked") == 0) {
+            stat->procsBlocked = strtoull(next_token(&next_tok, " \n"), NULL, 10);
+        } else {
+            // the per-interrupt counters and everything else
+            strtoull(curr_tok, NULL, 10);
+        }
+    }
+}
+
+/* strtoullStat func parses /proc/stat like parseStat() did before
+ * skipLine() and parseUInt(): strtoull() for the numbers and strchr() to
+ * skip the rest of a line */
+void strtoullStat(const char *text, struct stat_snapshot *stat) {
+    const char *line = text;
+    stat->numCpus = 0;
+
+    while (*line != '\0') {
+        char *end;
+        if (strncmp(line, "cpu", 3) == 0) {
+            struct cpu_times *times = &stat->total;
+            const char *pos = line + 3;
+            if (*pos != ' ') {
+                int id = (int) strtol(pos, &end, 10);
+                pos = end;
+                if (stat->numCpus == stat->cpusCap) {
+                    stat->cpusCap = stat->cpusCap ? stat->cpusCap * 2 : 16;
+                    stat->cpus = realloc(stat->cpus, stat->cpusCap * sizeof(struct cpu_times));
+                    stat->cpuIds = realloc(stat->cpuIds, stat->cpusCap * sizeof(int));
+                }
+                stat->cpuIds[stat->numCpus] = id;
+                times = &stat->cpus[stat->numCpus++];
+            }
+            for (int i = 0; i < CPU_FIELDS; i++) {
+                times->field[i] = strtoull(pos, &end, 10);
+                pos = end;
+            }
+        } else if (strncmp(line, "intr ", 5) == 0) {
+            stat->intr = strtoull(line + 5, NULL, 10);
+        } else if (strncmp(line, "ctxt ", 5) == 0) {
+            stat->ctxt = strtoull(line + 5, NULL, 10);
+        } else if (strncmp(line, "processes ", 10) == 0) {
+            stat->processes = strtoull(line + 10, NULL, 10);
+        } else if (strncmp(line, "procs_running ", 14) == 0) {
+            stat->procsRunning = strtoull(line + 14, NULL, 10);
+        } else if (strncmp(line, "procs_blocked ", 14) == 0) {
+            stat->procsBlocked = strtoull(line + 14, NULL, 10);
+        }
+        end = strchr(line, '\n');
+        if (end == NULL) {
+            break;
+        }
+        line = end + 1;
+    }
+}
+
+/* strtoullFields func gets the numbers of a stat line like the task list did
+ * before parsePidStat(): strrchr() for the name, then strchr() from field to
+ * field */
+bool strtoullFields(const char *statLine, struct stat_fields *fields) {
+    memset(fields, 0, sizeof(*fields));
+    const char *field = strrchr(statLine, ')');
+    if (field == NULL || *++field != ' ') {
+        return false;
+    }
+    fields->state = field[1];
+    for (int i = 3; i <= 24; i++) {
+        if (field == NULL) {
+            return false;
+        }
+        const char *value = field + 1;
+        switch (i) {
+            case 14:
+                fields->utime = strtoull(value, NULL, 10);
+                break;
+            case 15:
+                fields->stime = strtoull(value, NULL, 10);
+                break;
+            case 20:
+                fields->threads = (int) strtol(value, NULL, 10);
+                break;
+            case 22:
+                fields->startTime = strtoull(value, NULL, 10);
+                break;
+            case 23:
+                fields->vsize = strtoull(value, NULL, 10);
+                break;
+            case 24:
+                fields->rss = strtoull(value, NULL, 10);
+                break;
+        }
+        field = strchr(value, ' ');
+    }
+    return true;
+}
+
+/* sameStat func checks that two parses of /proc/stat agree */
+bool sameStat(const struct stat_snapshot *a, const struct stat_snapshot *b) {
+    return a->numCpus == b->numCpus
+            && memcmp(&a->total, &b->total, sizeof(a->total)) == 0
+            && memcmp(a->cpus, b->cpus, a->numCpus * sizeof(struct cpu_times)) == 0
+            && memcmp(a->cpuIds, b->cpuIds, a->numCpus * sizeof(int)) == 0
+            && a->intr == b->intr && a->ctxt == b->ctxt && a->processes == b->processes
+            && a->procsRunning == b->procsRunning && a->procsBlocked == b->procsBlocked;
+}
+
+/* printRow func prints the time of one way of parsing */
+void printRow(const char *input, const char *method, double ms, int calls, double mb) {
+    printf("%-14s | %-22s | %12.1f | %10.1f\n", input, method, ms * 1e6 / calls, mb / (ms / 1000));
+}
+
+/* benchStat func times the three ways of parsing /proc/stat */
+void benchStat(const struct parse_opts *opts, const struct parse_input *input) {
+
+    struct stat_snapshot expected = { 0 };
+    struct stat_snapshot stat = { 0 };
+    char *copy = malloc(input->statLen + 1);
+    double mb = (double) input->statLen * opts->runs / 1e6;
+
+    parseStat(input->stat, input->statLen, &expected);
+    tokenStat(input->stat, input->statLen, &stat, copy);
+    bool same = sameStat(&expected, &stat);
+    strtoullStat(input->stat, &stat);
+    if (!same || !sameStat(&expected, &stat)) {
+        fprintf(stderr, "The /proc/stat parsers do not agree\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < opts->runs; r++) {
+        tokenStat(input->stat, input->statLen, &stat, copy);
+    }
+    printRow("/proc/stat", "next_token + strtoull", msSince(&start), opts->runs, mb);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < opts->runs; r++) {
+        strtoullStat(input->stat, &stat);
+    }
+    printRow("/proc/stat", "strchr + strtoull", msSince(&start), opts->runs, mb);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < opts->runs; r++) {
+        parseStat(input->stat, input->statLen, &stat);
+    }
+    printRow("/proc/stat", "parseStat", msSince(&start), opts->runs, mb);
+
+    free(copy);
+    free(expected.cpus);
+    free(stat.cpus);
+}
+
+/* tokenFields func walks a stat line with next_token(), the way collectTask()
+ * reads the task name */
+void tokenFields(const char *statLine, struct stat_fields *fields, char *copy) {
+    strcpy(copy, statLine);
+    memset(fields, 0, sizeof(*fields));
+
+    char *next_tok = copy;
+    char *curr_tok;
+    int i = 0;
+    while ((curr_tok = next_token(&next_tok, " ()")) != NULL && ++i <= 24) {
+        switch (i) {
+            case 3:
+                fields->state = curr_tok[0];
+                break;
+            case 14:
+                fields->utime = strtoull(curr_tok, NULL, 10);
+                break;
+            case 15:
+                fields->stime = strtoull(curr_tok, NULL, 10);
+                break;
+            case 20:
+                fields->threads = (int) strtol(curr_tok, NULL, 10);
+                break;
+            case 22:
+                fields->startTime = strtoull(curr_tok, NULL, 10);
+                break;
+            case 23:
+                fields->vsize = strtoull(curr_tok, NULL, 10);
+                break;
+            case 24:
+                fields->rss = strtoull(curr_tok, NULL, 10);
+                break;
+        }
+    }
+}
+
+/* pidStatFields func gets the numbers of a stat line with parsePidStat() */
+bool pidStatFields(const char *statLine, size_t len, struct stat_fields *fields) {
+    struct pid_stat stat;
+    if (!parsePidStat(statLine, len, &stat)) {
+        return false;
+    }
+    fields->state = stat.state;
+    fields->utime = pidStatField(&stat, PS_UTIME);
+    fields->stime = pidStatField(&stat, PS_STIME);
+    fields->threads = (int) pidStatField(&stat, PS_THREADS);
+    fields->startTime = pidStatField(&stat, PS_START_TIME);
+    fields->vsize = pidStatField(&stat, PS_VSIZE);
+    fields->rss = pidStatField(&stat, PS_RSS);
+    return true;
+}
+
+/* benchFields func times the ways of getting the numbers of stat lines */
+void benchFields(const struct parse_opts *opts, const struct parse_input *input) {
+
+    size_t bytes = 0;
+    size_t *lens = malloc(input->numLines * sizeof(size_t));
+    for (int i = 0; i < input->numLines; i++) {
+        struct stat_fields expected;
+        struct stat_fields fields;
+        struct pid_stat stat;
+        lens[i] = strlen(input->lines[i]);
+        bytes += lens[i];
+        memset(&expected, 0, sizeof(expected));
+        if (!pidStatFields(input->lines[i], lens[i], &expected) || !strtoullFields(input->lines[i], &fields)
+                || memcmp(&expected, &fields, sizeof(fields)) != 0
+                || !parsePidStat(input->lines[i], lens[i], &stat)
+                || stat.commLen != strlen(names[i % NUM_NAMES])
+                || memcmp(stat.comm, names[i % NUM_NAMES], stat.commLen) != 0) {
+            fprintf(stderr, "The stat line parsers do not agree on: %s", input->lines[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char copy[4096];
+    struct stat_fields fields;
+    int calls = opts->runs * input->numLines;
+    double mb = (double) bytes * opts->runs / 1e6;
+    unsigned long long sum = 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < opts->runs; r++) {
+        for (int i = 0; i < input->numLines; i++) {
+            // names with spaces or brackets shift the fields, it is only timed
+            tokenFields(input->lines[i], &fields, copy);
+            sum += fields.rss;
+        }
+    }
+    printRow("[pid]/stat", "next_token + strtoull", msSince(&start), calls, mb);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < opts->runs; r++) {
+        for (int i = 0; i < input->numLines; i++) {
+            strtoullFields(input->lines[i], &fields);
+            sum += fields.rss;
+        }
+    }
+    printRow("[pid]/stat", "strchr + strtoull", msSince(&start), calls, mb);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < opts->runs; r++) {
+        for (int i = 0; i < input->numLines; i++) {
+            pidStatFields(input->lines[i], lens[i], &fields);
+            sum += fields.rss;
+        }
+    }
+    printRow("[pid]/stat", "parsePidStat", msSince(&start), calls, mb);
+
+    free(lens);
+
+    // keeps the loops from being optimised away
+    if (sum == 42) {
+        printf("\n");
+    }
+}
+
+/* checkParseUInt func compares parseUInt() with strtoull() on numbers of
+ * every length, at every distance from the end of the text */
+void checkParseUInt() {
+    char text[64];
+    for (int digits = 1; digits <= 20; digits++) {
+        for (int tail = 0; tail < 10; tail++) {
+            int len = 0;
+            for (int i = 0; i < digits; i++) {
+                text[len++] = (char) ('1' + (i * 7 + digits) % 9);
+            }
+            // 20 digits do not fit, stop at 19 so strtoull() does not saturate
+            if (digits == 20) {
+                len--;
+            }
+            for (int i = 0; i < tail; i++) {
+                text[len++] = i % 2 ? ' ' : 'x';
+            }
+            text[len] = '\0';
+            const char *pos = text;
+            unsigned long long value = parseUInt(&pos, text + len);
+            char *end;
+            if (value != strtoull(text, &end, 10) || pos != end) {
+                fprintf(stderr, "parseUInt() is wrong on \"%s\"\n", text);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+void print_usage(char *argv[]) {
+    printf("Usage: %s [-c cpus] [-i interrupts] [-n lines] [-r runs]\n", argv[0]);
+    printf("\n");
+    printf("Times the procfs parsers of libinspector against next_token() and strtoull().\n\n");
+    printf("Options:\n"
+                   "    * -c cpus         Number of cpu lines in /proc/stat (default: 64)\n"
+                   "    * -i interrupts   Counters on the intr line (default: 4096)\n"
+                   "    * -n lines        Number of /proc/[pid]/stat lines (default: 1000)\n"
+                   "    * -r runs         Times every parser runs over the input (default: 1000)\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+
+    struct parse_opts opts = { 64, 4096, 1000, 1000 };
+
+    int c;
+    while ((c = getopt(argc, argv, "c:hi:n:r:")) != -1) {
+        switch (c) {
+            case 'c':
+                opts.cpus = atoi(optarg);
+                break;
+            case 'i':
+                opts.interrupts = atoi(optarg);
+                break;
+            case 'n':
+                opts.lines = atoi(optarg);
+                break;
+            case 'r':
+                opts.runs = atoi(optarg);
+                break;
+            case 'h':
+                print_usage(argv);
+                return 0;
+            default:
+                print_usage(argv);
+                return 1;
+        }
+    }
+
+    if (opts.cpus < 0 || opts.interrupts < 0 || opts.lines < 1 || opts.runs < 1) {
+        print_usage(argv);
+        return 1;
+    }
+
+    checkParseUInt();
+
+    struct parse_input input;
+    makeInput(&opts, &input);
+
+    printf("%-14s | %-22s | %12s | %10s\n", "Input", "Parser", "ns per call", "MB/s");
+    printf("---------------+------------------------+--------------+-----------\n");
+    benchStat(&opts, &input);
+    benchFields(&opts, &input);
+
+    free(input.stat);
+    for (int i = 0; i < input.numLines; i++) {
+        free(input.lines[i]);
+    }
+    free(input.lines);
+
+    return 0;
+}
@@ -1,42 +1,224 @@
 #include <ctype.h>
-#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
 #include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
-#include <dirent.h>
 
-/* Preprocessor Directives */
-#ifndef DEBUG
-#define DEBUG 0
-#endif
-/**
- * Logging functionality. Set DEBUG to 1 to enable logging, 0 to disable.
- */
-#define LOG(fmt, ...) \
-    do { if (DEBUG) fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, \
-            __LINE__, __func__, __VA_ARGS__); } while (0)
+#include "inspector.h"
+#include "libinspector.h"
 
+/* Output formats, -o */
+enum output_format {
+    OUT_TEXT,
+    OUT_JSON,
+    OUT_METRICS
+};
 
-/* Function prototypes */
-void print_usage(char *argv[]);
-char *next_token(char **str_ptr, const char *delim);
-void systemInformation();
-void hardwareInformation();
-void cpuModel(char *cpuModel);
-void loadAver(char *loadAverage);
-void cpuUsage(long int *result);
-void memoryUsage(char *userPercentage);
-void taskList();
-void taskSummary();
-void readFile(char *filepath, char *buf);
+/* Output is collected in this buffer and written out in big pieces at the
+ * end of every sample. The out* helpers only append, so the buffer grows to
+ * the size of a sample; the loops that can render far more than that (the
+ * JSON task list and the history query) flush it themselves once it holds
+ * OUT_FLUSH_SZ bytes */
+#define OUT_FLUSH_SZ 65536
+
+static struct read_buf out;
+
+/* Entry of the sample being captured, with its path for sorting */
+struct pending_entry {
+    struct archive_entry entry;
+    char *path;
+};
+
+/* One slot of the hash table of the bodies already in the archive */
+struct body_slot {
+    bool used;
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t len;
+};
+
+/* Archive being written by --capture, 'end' is where the next data goes */
+struct archive_writer {
+    int fd;
+    uint64_t end;
+    struct pending_entry *entries;
+    size_t numEntries;
+    size_t entriesCap;
+    struct archive_sample *samples;
+    size_t numSamples;
+    size_t samplesCap;
+    struct body_slot *bodies;
+    size_t numBodies;
+    size_t bodiesCap;
+    int64_t sampleReal;
+    int64_t sampleBoot;
+};
+
+/* Set by SIGINT and SIGTERM while capturing, the capture stops after the
+ * sample it is taking. --serve also uses it to stop its server thread, so it
+ * is a lock free atomic: safe to set from the handler and to read from
+ * another thread, which a volatile sig_atomic_t is not */
+static atomic_int stopRequested = 0;
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "stopRequested is set by a signal handler");
+
+/* Magic and version at the start of a history file */
+#define HISTORY_MAGIC "INSPHIS1"
+
+#define HISTORY_VERSION 1
+
+/* Slots of the tiers of a new history file: raw samples, 1 minute rollups
+ * (a day) and 1 hour rollups (90 days). The file never grows */
+#define HISTORY_RAW_SLOTS 4096
+
+#define HISTORY_MINUTE_SLOTS 1440
+
+#define HISTORY_HOUR_SLOTS 2160
+
+/* Values kept in the history for every sample */
+enum history_metric {
+    HM_LOAD1,
+    HM_LOAD5,
+    HM_LOAD15,
+    HM_USER,
+    HM_NICE,
+    HM_SYSTEM,
+    HM_IOWAIT,
+    HM_IRQ,
+    HM_SOFTIRQ,
+    HM_STEAL,
+    HM_BUSY,
+    HM_MEMORY,
+    HM_CTXT_RATE,
+    HM_INTR_RATE,
+    HM_FORK_RATE,
+    HM_COUNT
+};
+
+/* JSON keys of the history metrics, in enum history_metric order */
+static const char *historyKeys[HM_COUNT] = {
+    "load1", "load5", "load15", "user", "nice", "system", "iowait", "irq", "softirq", "steal",
+    "busy", "memory", "ctxt_rate", "intr_rate", "fork_rate"
+};
+
+/* Tiers of a history file, from the finest to the coarsest */
+enum history_tier {
+    TIER_RAW,
+    TIER_MINUTE,
+    TIER_HOUR,
+    TIERS
+};
+
+static const char *tierNames[TIERS] = { "raw", "minute", "hour" };
+
+/* One raw sample of the history, 'time' is in ms since the epoch */
+struct history_sample {
+    int64_t time;
+    float value[HM_COUNT];
+    uint32_t pad;
+};
+
+/* One rollup of the history: the samples whose time falls in
+ * [start, start + span) */
+struct history_rollup {
+    int64_t start;
+    uint32_t count;
+    float min[HM_COUNT];
+    float max[HM_COUNT];
+    float sum[HM_COUNT];
+};
+
+/* Where a tier is in the history file. 'written' counts every slot ever
+ * started, the slot of the n-th is n % slots. For rollups the last one
+ * started is still being filled */
+struct history_tier_info {
+    uint64_t offset;
+    uint64_t written;
+    uint32_t slots;
+    uint32_t slotSize;
+    int64_t spanMs;
+};
+
+/* Start of a history file */
+struct history_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t metrics;
+    struct history_tier_info tiers[TIERS];
+};
+
+/* A mapped history file */
+struct history {
+    char *map;
+    size_t size;
+    struct history_header *header;
+};
+
+/* A rendered sample the server hands out. It is never changed once it is
+ * published, and the last of the sampler and the clients still sending it
+ * frees it */
+struct snapshot {
+    atomic_int refs;
+    size_t len;
+    char data[];
+};
+
+/* Most clients the server talks to at once, the rest wait in the listen queue */
+#define MAX_CLIENTS 256
+
+/* Seconds a client has to send its request and read the response */
+#define CLIENT_TIMEOUT 10
+
+/* Longest request the server reads, only the request line is used */
+#define REQUEST_SZ 4096
+
+/* Seconds between samples of --serve without -w */
+#define SERVE_INTERVAL 5
+
+/* A connection to the server */
+struct client {
+    int fd;
+    time_t since;
+    char request[REQUEST_SZ];
+    size_t requestLen;
+    char header[256];
+    size_t headerLen;
+    struct snapshot *snapshot;
+    size_t sent;
+};
+
+/* Listening socket and connections of the server thread */
+struct server {
+    int listenFd;
+    struct client *clients;
+    size_t numClients;
+};
+
+/* Snapshot of the latest sample, the lock is only held to swap it or take a
+ * reference */
+static struct snapshot *latestSnapshot = NULL;
+
+static pthread_mutex_t snapshotLock = PTHREAD_MUTEX_INITIALIZER;
 
 /* This struct is a collection of booleans that controls whether or not the
  * various sections of the output are enabled. */
@@ -45,19 +227,339 @@ struct view_opts {
     bool system;
     bool task_list;
     bool task_summary;
+    bool per_cpu;
+};
+
+/* Columns the task list can be sorted by, --sort */
+enum sort_key {
+    SORT_PID,
+    SORT_STATE,
+    SORT_NAME,
+    SORT_USER,
+    SORT_TASKS,
+    SORT_CPU,
+    SORT_RSS,
+    SORT_VSZ,
+    SORT_KEYS
+};
+
+static const char *sortKeyNames[SORT_KEYS] = {
+    "pid",
+    "state",
+    "name",
+    "user",
+    "tasks",
+    "cpu",
+    "rss",
+    "vsz",
+};
+
+/* What each sort column needs read about the processes */
+static const unsigned sortKeySources[SORT_KEYS] = {
+    TS_DIR,
+    TS_STAT,
+    TS_STAT,
+    TS_OWNER,
+    TS_STAT,
+    TS_STAT,
+    TS_STAT,
+    TS_STAT,
+};
+
+/* Columns the task list can show, -O. OpenMetrics labels and families
+ * follow this order */
+enum task_column {
+    COL_PID,
+    COL_PPID,
+    COL_COMM,
+    COL_USER,
+    COL_UID,
+    COL_STATE,
+    COL_THREADS,
+    COL_CPU,
+    COL_RSS,
+    COL_VSZ,
+    COL_SWAP,
+    COL_PSS,
+    COL_READ,
+    COL_WRITE,
+    COL_FDS,
+    COL_CMDLINE,
+    COL_COUNT
+};
+
+/* Most columns -O takes, a column can be repeated */
+#define MAX_COLUMNS 32
+
+/* How a column is shown and what it needs read. Columns without a metric
+ * are OpenMetrics labels; numbers in kB are scaled to bytes there */
+struct column_info {
+    const char *name;
+    const char *header;
+    int width;
+    const char *jsonKey;
+    int decimals;
+    unsigned sources;
+    const char *metric;
+    const char *metricType;
+    double metricScale;
+    const char *help;
+};
+
+static const struct column_info columns[COL_COUNT] = {
+    { "pid", "PID", 5, "pid", 0, TS_DIR, NULL, NULL, 0, NULL },
+    { "ppid", "PPID", 5, "ppid", 0, TS_STAT, NULL, NULL, 0, NULL },
+    { "comm", "Task Name", 25, "name", 0, TS_STAT, NULL, NULL, 0, NULL },
+    { "user", "User", 15, "user", 0, TS_OWNER, NULL, NULL, 0, NULL },
+    { "uid", "UID", 5, "uid", 0, TS_OWNER, NULL, NULL, 0, NULL },
+    { "state", "State", 12, "state", 0, TS_STAT, NULL, NULL, 0, NULL },
+    { "threads", "Tasks", 5, "tasks", 0, TS_STAT, "inspector_task_threads", "gauge", 1,
+            "Number of tasks (threads) of the process." },
+    { "cpu", "%CPU", 5, "cpu", 1, TS_STAT, "inspector_task_cpu_percent", "gauge", 1,
+            "Share of one cpu the process used." },
+    { "rss", "RSS KB", 9, "rss_kb", 0, TS_STAT, "inspector_task_resident_bytes", "gauge", 1024,
+            "Resident set size of the process." },
+    { "vsz", "VSZ KB", 10, "vsz_kb", 0, TS_STAT, "inspector_task_virtual_bytes", "gauge", 1024,
+            "Virtual memory size of the process." },
+    { "swap", "Swap KB", 9, "swap_kb", 0, TS_STATUS, "inspector_task_swap_bytes", "gauge", 1024,
+            "Swapped out memory of the process." },
+    { "pss", "PSS KB", 9, "pss_kb", 0, TS_SMAPS, "inspector_task_proportional_bytes", "gauge", 1024,
+            "Proportional set size of the process, shared pages divided between their users." },
+    { "read", "Read KB", 10, "read_kb", 0, TS_IO, "inspector_task_read_bytes", "counter", 1024,
+            "Bytes the process read from storage." },
+    { "write", "Write KB", 10, "write_kb", 0, TS_IO, "inspector_task_written_bytes", "counter", 1024,
+            "Bytes the process wrote to storage." },
+    { "fds", "FDs", 5, "fds", 0, TS_FD, "inspector_task_open_files", "gauge", 1,
+            "Number of open file descriptors of the process." },
+    { "cmdline", "Command", 0, "cmdline", 0, TS_CMDLINE, NULL, NULL, 0, NULL },
+};
+
+/* Columns shown without -O, the task list as it always was */
+static const enum task_column defaultColumns[] = {
+    COL_PID, COL_STATE, COL_COMM, COL_USER, COL_THREADS, COL_CPU, COL_RSS, COL_VSZ
+};
+
+/* Parts of a sample --stats reports on. The read of /proc/stat is shared by
+ * the sections, so it gets its own row (with the 1 second wait, if any) */
+enum stats_section {
+    SS_STAT,
+    SS_SYSTEM,
+    SS_HARDWARE,
+    SS_PER_CPU,
+    SS_TASK_SUMMARY,
+    SS_TASK_LIST,
+    SS_COUNT
+};
+
+static const char *statsNames[SS_COUNT] = {
+    "/proc/stat",
+    "systemInformation",
+    "hardwareInformation",
+    "perCpuUsage",
+    "taskSummary",
+    "taskList",
+};
+
+/* What one part of the samples cost, added up over the whole run */
+struct section_stats {
+    unsigned long runs;
+    double wallMs;
+    double cpuMs;
+    struct io_stats io;
+};
+
+static struct section_stats sectionStats[SS_COUNT];
+
+/* Clocks at the start of a part of the sample, see statsStart() */
+struct stats_timer {
+    struct timespec wall;
+    struct timespec cpu;
 };
 
+/* Long options without a short form, numbered after all the characters */
+enum long_option {
+    OPT_SORT = 256,
+    OPT_TOP,
+    OPT_PID,
+    OPT_STATE,
+    OPT_CAPTURE,
+    OPT_REPLAY,
+    OPT_HISTORY,
+    OPT_QUERY,
+    OPT_SERVE,
+    OPT_STATS
+};
+
+/* Settings that control how the sections are collected */
+struct run_opts {
+    /* Number of threads used to collect the task list */
+    int numThreads;
+
+    /* Seconds between refreshes in watch mode, 0 to print once and exit */
+    double watchInterval;
+
+    /* Directory where the last cpu sample is kept between runs, or NULL */
+    const char *runtimeDir;
+
+    /* Human readable text, or one JSON object per line */
+    enum output_format format;
+
+    /* Column the task list is sorted by */
+    enum sort_key sortKey;
+
+    /* Number of tasks shown, the first ones in sort order. 0 shows all */
+    size_t top;
+
+    /* Processes the task list shows */
+    struct task_filter filter;
+
+    /* History every sample is added to, or NULL */
+    struct history *history;
+
+    /* Time and count the syscalls of every section, --stats */
+    bool stats;
+
+    /* Columns of the task list, -O */
+    enum task_column columns[MAX_COLUMNS];
+    size_t numColumns;
+};
+
+/* Function prototypes */
+void print_usage(char *argv[]);
+void systemInformation(const struct system_info *info);
+void systemJson(const struct system_info *info, double time);
+void systemMetrics(const struct system_info *info);
+void hardwareInformation(const struct hardware_info *info);
+void hardwareJson(const struct hardware_info *info, double time);
+void hardwareMetrics(const struct hardware_info *info);
+void memoryUsage(float memTotal, float active);
+void perCpuUsage(const float *matrix, const int *cpuIds, int numCpus);
+void perCpuJson(const float *matrix, const int *cpuIds, int numCpus, double time);
+void perCpuMetrics(const float *matrix, const int *cpuIds, int numCpus);
+void taskSummary(const struct task_counts *counts);
+void taskSummaryJson(const struct task_counts *counts, double time);
+void taskSummaryMetrics(const struct task_counts *counts);
+uint64_t archiveWrite(struct archive_writer *archive, const void *data, size_t len);
+void archiveAlign(struct archive_writer *archive);
+uint64_t archiveBody(struct archive_writer *archive, const char *data, size_t len);
+void archiveAdd(struct archive_writer *archive, enum entry_kind kind, const char *path,
+        const char *body, size_t len, uid_t uid);
+int comparePending(const void *a, const void *b);
+void archiveEndSample(struct archive_writer *archive);
+void archiveStartSample(struct archive_writer *archive);
+bool historyOpen(const char *path, bool record, struct history *history);
+void *historySlot(const struct history *history, enum history_tier tier, uint64_t n);
+void historyValues(float *values, const struct stat_snapshot *stat, const struct stat_snapshot *previous);
+float counterRate(unsigned long long now, unsigned long long before, double age);
+void historyAppend(struct history *history, int64_t time, const float *values);
+int64_t slotStart(const struct history *history, enum history_tier tier, uint64_t n);
+uint64_t historyFirst(const struct history *history, enum history_tier tier, int64_t time);
+bool parseAgo(const char *str, const char *end, int64_t *ms);
+bool parseRange(const char *range, int64_t *fromAgo, int64_t *toAgo);
+void outTime(int64_t time);
+void historyQuery(const struct history *history, int64_t fromAgo, int64_t toAgo, enum output_format format);
+void outFlush();
+void outBytes(const char *str, size_t len);
+void outStr(const char *str);
+int formatUInt(char *dst, unsigned long long value);
+int formatFixed(char *dst, double value, int decimals);
+void outPadded(const char *str, size_t len, int width);
+void outPrintable(const char *str, size_t len, int width);
+void outUInt(unsigned long long value);
+void outInt(long long value, int width);
+void outFixed(double value, int decimals, int width);
+void outBar(float percentage);
+void outJsonStr(const char *str);
+void jsonBegin(const char *section, double time);
+void jsonKey(const char *key);
+void jsonEnd();
+void metricFamily(const char *name, const char *type, const char *help);
+void outLabelStr(const char *str);
+void outMetric(double value, int decimals);
+void snapshotPublish(const char *data, size_t len);
+struct snapshot *snapshotAcquire();
+void snapshotRelease(struct snapshot *snapshot);
+int listenOn(const char *address);
+void clientRespond(struct client *client);
+bool clientRead(struct client *client);
+bool clientWrite(struct client *client);
+void *serverThread(void *arg);
+void renderSections(struct view_opts *options, struct run_opts *run);
+void printSections(struct view_opts *options, struct run_opts *run);
+void serve(struct view_opts *options, struct run_opts *run, const char *address);
+bool anySection(const struct view_opts *options);
+void watch(struct view_opts *options, struct run_opts *run);
+bool sleepUntilNext(struct timespec *next, double interval);
+void requestStop(int signal);
+void captureSample(struct archive_writer *archive, struct read_buf *buf, unsigned sources);
+void capture(const char *path, struct run_opts *run);
+void replay(struct view_opts *options, struct run_opts *run);
+bool replayNext();
+bool parsePidList(const char *list, struct task_filter *filter);
+bool parseUser(const char *user, struct task_filter *filter);
+int compareTasks(const void *a, const void *b);
+void siftDown(size_t *heap, size_t count, size_t i, const struct task_info *tasks);
+void sortTasks(struct task_pool *pool, enum sort_key key, size_t top);
+bool parseColumns(const char *list, struct run_opts *run);
+unsigned taskSources(const struct run_opts *run);
+bool taskValue(const struct task_info *task, enum task_column column, const char **str, double *number);
+void taskList(const struct task_pool *pool, const struct run_opts *run);
+void taskListJson(const struct task_pool *pool, const struct run_opts *run, double time);
+void taskListMetrics(const struct task_pool *pool, const struct run_opts *run);
+void statsStart(const struct run_opts *run, struct stats_timer *timer);
+void statsStop(const struct run_opts *run, const struct stats_timer *timer, enum stats_section section);
+void printStats();
+
 void print_usage(char *argv[]) {
-    printf("Usage: %s [-ahlrst] [-p procfs_dir]\n" , argv[0]);
+    printf("Usage: %s [-achlrst] [-d runtime_dir] [-j threads] [-n pattern] [-o format] [-O columns]\n"
+           "       [-p procfs_dir] [-u user] [-w interval] [--pid pids] [--sort column] [--state states] [--top N]\n"
+           "       [--capture file | --replay file] [--history file [--query range]]\n"
+           "       [--serve address] [--stats]\n" , argv[0]);
     printf("\n");
     printf("Options:\n"
                    "    * -a              Display all (equivalent to -lrst, default)\n"
+                   "    * -c              Per-CPU Usage\n"
+                   "    * -d runtime_dir  Keep the last cpu sample in runtime_dir, so the cpu usage\n"
+                   "                      can be calculated without waiting 1 second\n"
                    "    * -h              Help/usage information\n"
+                   "    * -j threads      Number of threads collecting the task list (default: 1)\n"
                    "    * -l              Task List\n"
+                   "    * -n pattern      Only list the tasks whose name matches the pattern (like \"nginx*\")\n"
+                   "    * -o format       Output format: text (default), json (one JSON object per\n"
+                   "                      line for each section and each task of every sample) or\n"
+                   "                      openmetrics\n"
+                   "    * -O columns      Columns of the task list, comma separated (default:\n"
+                   "                      pid,state,comm,user,threads,cpu,rss,vsz). Also ppid, uid,\n"
+                   "                      swap, pss, read, write, fds and cmdline (always last); only\n"
+                   "                      the files the columns need are read\n"
                    "    * -p procfs_dir   Change the expected procfs mount point (default: /proc)\n"
                    "    * -r              Hardware Information\n"
                    "    * -s              System Information\n"
-                   "    * -t              Task Information\n");
+                   "    * -t              Task Information\n"
+                   "    * -u user         Only list the tasks of a user (name or uid)\n"
+                   "    * -w interval     Watch mode, refresh every interval seconds\n"
+                   "    * --sort column   Sort the task list by pid (default), state, name, user, or\n"
+                   "                      by tasks, cpu, rss, vsz (largest first)\n"
+                   "    * --pid pids      Only list the tasks with these pids (like 1,200,300)\n"
+                   "    * --state states  Only list the tasks in these states, as letters of\n"
+                   "                      /proc/[pid]/stat (like RD for running and disk sleep)\n"
+                   "    * --top N         Only show the first N tasks of the task list (every task is\n"
+                   "                      still read and held, only the sorting and printing shrink)\n"
+                   "    * --capture file  Save samples of the proc files to file instead of printing:\n"
+                   "                      two 1 second apart, or with -w one every interval until\n"
+                   "                      interrupted\n"
+                   "    * --replay file   Print the selected sections for the samples of a captured\n"
+                   "                      file instead of reading proc\n"
+                   "    * --history file  Add every sample to a fixed size history file (with -w for\n"
+                   "                      a recorder; without section options nothing is printed)\n"
+                   "    * --query range   Print the history between two times ago, like 10m (the last\n"
+                   "                      10 minutes) or 2h,1h, from raw samples or 1 minute / 1 hour\n"
+                   "                      rollups depending on how far back it goes\n"
+                   "    * --serve address Serve the selected sections as OpenMetrics over HTTP on a\n"
+                   "                      unix socket (a path) or [host:]port (127.0.0.1 by default),\n"
+                   "                      sampled every -w interval seconds (default: 5)\n"
+                   "    * --stats         When done, print the time, cpu time, bytes read and\n"
+                   "                      syscalls of each section to stderr\n");
     printf("\n");
 }
 
@@ -72,22 +574,124 @@ int main(int argc, char *argv[]){
     /* Set to true if we are using a non-default proc location */
     bool alt_proc = false;
 
-    struct view_opts all_on = { true, true, true, true };
-    struct view_opts options = { false, false, false, false };
+    /* Archive written by --capture or read by --replay */
+    const char *capturePath = NULL;
+    const char *replayPath = NULL;
+
+    /* History file of --history, and the range of --query in ms ago */
+    const char *historyPath = NULL;
+    struct history history;
+    bool query = false;
+
+    /* Socket path or [host:]port of --serve */
+    const char *serveAddress = NULL;
+    int64_t fromAgo = 0;
+    int64_t toAgo = 0;
+
+    struct run_opts run = { 1, 0, NULL, OUT_TEXT, SORT_PID, 0, { NULL, 0, false, 0, NULL, NULL }, NULL, false,
+            { COL_PID }, 0 };
+
+    static const struct option longOptions[] = {
+        { "sort", required_argument, NULL, OPT_SORT },
+        { "top", required_argument, NULL, OPT_TOP },
+        { "pid", required_argument, NULL, OPT_PID },
+        { "state", required_argument, NULL, OPT_STATE },
+        { "capture", required_argument, NULL, OPT_CAPTURE },
+        { "replay", required_argument, NULL, OPT_REPLAY },
+        { "history", required_argument, NULL, OPT_HISTORY },
+        { "query", required_argument, NULL, OPT_QUERY },
+        { "serve", required_argument, NULL, OPT_SERVE },
+        { "stats", no_argument, NULL, OPT_STATS },
+        { NULL, 0, NULL, 0 }
+    };
+
+    struct view_opts all_on = { true, true, true, true, false };
+    struct view_opts options = { false, false, false, false, false };
 
     int c;
     opterr = 0;
-    while ((c = getopt(argc, argv, "ahlp:rst")) != -1) {
+    while ((c = getopt_long(argc, argv, "acd:hj:ln:o:O:p:rstu:w:", longOptions, NULL)) != -1) {
         switch (c) {
             case 'a':
                 options = all_on;
                 break;
+            case 'c':
+                options.per_cpu = true;
+                break;
+            case 'd':
+                run.runtimeDir = optarg;
+                break;
             case 'h':
                 print_usage(argv);
                 return 0;
+            case 'j':
+                run.numThreads = (int) strtol(optarg, NULL, 10);
+                if (run.numThreads < 1) {
+                    fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                    return 1;
+                }
+                break;
             case 'l':
                 options.task_list = true;
                 break;
+            case 'n':
+                run.filter.namePattern = optarg;
+                break;
+            case 'u':
+                if (!parseUser(optarg, &run.filter)) {
+                    fprintf(stderr, "Unknown user: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_PID:
+                if (!parsePidList(optarg, &run.filter)) {
+                    fprintf(stderr, "Invalid pid list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_STATE:
+                run.filter.states = optarg;
+                break;
+            case OPT_CAPTURE:
+                capturePath = optarg;
+                break;
+            case OPT_REPLAY:
+                replayPath = optarg;
+                break;
+            case OPT_HISTORY:
+                historyPath = optarg;
+                break;
+            case OPT_QUERY:
+                if (!parseRange(optarg, &fromAgo, &toAgo)) {
+                    fprintf(stderr, "Invalid time range: %s\n", optarg);
+                    return 1;
+                }
+                query = true;
+                break;
+            case OPT_SERVE:
+                serveAddress = optarg;
+                break;
+            case OPT_STATS:
+                run.stats = true;
+                break;
+            case 'o':
+                if (strcmp(optarg, "text") == 0) {
+                    run.format = OUT_TEXT;
+                } else if (strcmp(optarg, "json") == 0) {
+                    run.format = OUT_JSON;
+                } else if (strcmp(optarg, "openmetrics") == 0) {
+                    run.format = OUT_METRICS;
+                } else {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'O':
+                if (!parseColumns(optarg, &run)) {
+                    fprintf(stderr, "Invalid columns: %s\n", optarg);
+                    return 1;
+                }
+                break;
             case 'p':
                 procfs_loc = optarg;
                 alt_proc = true;
@@ -101,8 +705,41 @@ int main(int argc, char *argv[]){
             case 't':
                 options.task_summary = true;
                 break;
+            case 'w':
+                run.watchInterval = strtod(optarg, NULL);
+                if (run.watchInterval <= 0) {
+                    fprintf(stderr, "Invalid watch interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_SORT:
+                run.sortKey = SORT_KEYS;
+                for (int i = 0; i < SORT_KEYS; i++) {
+                    if (strcmp(optarg, sortKeyNames[i]) == 0) {
+                        run.sortKey = i;
+                    }
+                }
+                if (run.sortKey == SORT_KEYS) {
+                    fprintf(stderr, "Unknown sort column: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_TOP: {
+                long top = strtol(optarg, NULL, 10);
+                if (top < 1) {
+                    fprintf(stderr, "Invalid number of tasks: %s\n", optarg);
+                    return 1;
+                }
+                run.top = top;
+                break;
+            }
             case '?':
-                if (optopt == 'p') {
+                if (optopt >= OPT_SORT) {
+                    fprintf(stderr, "Option %s requires an argument.\n", argv[optind - 1]);
+                } else if (optopt == 0) {
+                    fprintf(stderr, "Unknown option `%s'.\n", argv[optind - 1]);
+                } else if (optopt == 'p' || optopt == 'j' || optopt == 'w' || optopt == 'd'
+                        || optopt == 'o' || optopt == 'O' || optopt == 'n' || optopt == 'u') {
                     fprintf(stderr,
                             "Option -%c requires an argument.\n", optopt);
                 } else if (isprint(optopt)) {
@@ -118,416 +755,1791 @@ int main(int argc, char *argv[]){
         }
     }
 
+    if (run.numColumns == 0) {
+        run.numColumns = sizeof(defaultColumns) / sizeof(defaultColumns[0]);
+        memcpy(run.columns, defaultColumns, sizeof(defaultColumns));
+    }
+
     if (alt_proc == true) {
         LOG("Using alternative proc directory: %s\n", procfs_loc);
+    }
 
-        // change current working directory
-        chdir(procfs_loc);
-
-        /* Remove two arguments from the count: one for -p, one for the
-         * directory passed in: */
-        argc = argc - 2;
+    if (capturePath != NULL && replayPath != NULL) {
+        fprintf(stderr, "--capture and --replay cannot be used together\n");
+        return 1;
+    }
 
-    } else {
+    if (serveAddress != NULL && (capturePath != NULL || replayPath != NULL || query)) {
+        fprintf(stderr, "--serve cannot be used with --capture, --replay or --query\n");
+        return 1;
+    }
 
-        // if not using alternative directory, then just go to /proc
-        chdir(procfs_loc);
+    if (query) {
+        // a query only reads the history file
+        if (historyPath == NULL) {
+            fprintf(stderr, "--query needs --history file\n");
+            return 1;
+        }
+        if (!historyOpen(historyPath, false, &history)) {
+            return 1;
+        }
+        growBuf(&out, OUT_FLUSH_SZ);
+        historyQuery(&history, fromAgo, toAgo, run.format);
+        munmap(history.map, history.size);
+        freeBuf(&out);
+        return 0;
     }
 
-    if (argc <= 1) {
-        /* No args (or -p only). Enable all options: */
-        options = all_on;
+    if (historyPath != NULL && capturePath == NULL) {
+        if (!historyOpen(historyPath, true, &history)) {
+            return 1;
+        }
+        run.history = &history;
     }
 
-    if (options.system) {
-        systemInformation();
+    struct inspector *inspector = NULL;
+    if (replayPath != NULL) {
+        // the replay reads nothing but the archive, and the saved cpu sample
+        // of -d belongs to the live system
+        if (!archiveMap(replayPath, &replayArchive)) {
+            return 1;
+        }
+        replaying = true;
+        run.runtimeDir = NULL;
+    } else {
+        // everything in proc is opened relative to the proc directory
+        inspector = inspector_open(procfs_loc);
+        if (inspector == NULL) {
+            perror("open");
+            return 1;
+        }
     }
 
-    if (options.hardware) {
-        hardwareInformation();
+    if (!anySection(&options) && run.history == NULL) {
+        /* No sections selected (no args, or only -p/-j). Enable all options: */
+        options = all_on;
     }
 
-    if (options.task_summary) {
-        taskSummary();
+    // every frame is rendered into this buffer, it is kept between refreshes
+    growBuf(&out, OUT_FLUSH_SZ);
+
+    if (capturePath != NULL) {
+        capture(capturePath, &run);
+    } else if (serveAddress != NULL) {
+        run.format = OUT_METRICS;
+        serve(&options, &run, serveAddress);
+    } else if (replaying) {
+        replay(&options, &run);
+    } else if (run.watchInterval > 0) {
+        watch(&options, &run);
+    } else {
+        printSections(&options, &run);
     }
 
-    if (options.task_list) {
-        taskList();
+    if (run.stats) {
+        printStats();
     }
 
+    if (replaying) {
+        closeProcFiles();
+        freePids();
+        munmap((void *) replayArchive.map, replayArchive.size);
+    } else {
+        inspector_close(inspector);
+    }
+    freeBuf(&out);
+    free(run.filter.pids);
+    if (run.history != NULL) {
+        munmap(history.map, history.size);
+    }
 
-    LOG("Options selected: %s%s%s%s\n",
+    LOG("Options selected: %s%s%s%s%s\n",
         options.hardware ? "hardware " : "",
         options.system ? "system " : "",
         options.task_list ? "task_list " : "",
-        options.task_summary ? "task_summary" : "");
-
-
+        options.task_summary ? "task_summary " : "",
+        options.per_cpu ? "per_cpu" : "");
 
     return 0;
 }
 
-/* readFile func reads file to char array
+/* renderSections func collects all the sections that were selected and
+ * renders them into the output buffer
  * Parameters:
- * - path to file
- * - pointer to char array to which file will be written
+ * - pointer to the selected options
+ * - pointer to the run settings
  *
  * */
-void readFile(char *filepath, char *buf) {
-
-    int fd = open(filepath, O_RDONLY);
-    if (fd == -1) {
-        perror("open");
-        exit(EXIT_FAILURE);
+void renderSections(struct view_opts *options, struct run_opts *run) {
+
+    // /proc/stat is read once per sample and shared by the sections. The
+    // snapshot of the previous sample (in watch mode) is kept for cpu usage
+    static struct stat_snapshot samples[2];
+    static int current = 0;
+    static bool havePrevious = false;
+    struct stat_snapshot *stat = &samples[current];
+    struct stat_snapshot *previous = havePrevious ? &samples[!current] : NULL;
+    bool needCpu = options->hardware || options->per_cpu || run->history != NULL;
+    struct stats_timer timer;
+
+    forgetPids();
+    statsStart(run, &timer);
+    if (needCpu || options->task_summary) {
+        readStat(stat);
     }
 
-    ssize_t read_sz;
-    read_sz = read(fd, buf, 100000);
-
-    close(fd);
+    if (needCpu) {
+        // without a recent sample from this run, try the one saved by the last run
+        static struct stat_snapshot saved;
+        if (previous == NULL || !usableSample(previous, stat)) {
+            previous = NULL;
+            if (run->runtimeDir != NULL && loadCpuState(run->runtimeDir, &saved)
+                    && usableSample(&saved, stat)) {
+                previous = &saved;
+            }
+        }
 
-    if (read_sz == -1) {
-        perror("read");
-        exit(EXIT_FAILURE);
+        // no earlier sample at all: this one becomes the earlier one, and
+        // the current one is taken after 1 second (or is the next sample of
+        // the replayed archive, if there is one)
+        if (previous == NULL) {
+            current = !current;
+            previous = stat;
+            stat = &samples[current];
+            if (!replaying) {
+                sleep(1);
+                readStat(stat);
+            } else if (replayNext()) {
+                readStat(stat);
+            } else {
+                stat = previous;
+            }
+        }
+    }
+    statsStop(run, &timer, SS_STAT);
+
+    // every JSON object of the sample carries the same wall clock time
+    bool json = run->format == OUT_JSON;
+    struct timespec now;
+    sampleClock(CLOCK_REALTIME, &now);
+    double time = now.tv_sec + now.tv_nsec / 1e9;
+
+    if (options->system) {
+        statsStart(run, &timer);
+        struct system_info info;
+        readSystem(&info);
+        if (json) {
+            systemJson(&info, time);
+        } else if (run->format == OUT_METRICS) {
+            systemMetrics(&info);
+        } else {
+            systemInformation(&info);
+        }
+        statsStop(run, &timer, SS_SYSTEM);
     }
 
-};
-
-/* systemInformation func that grabs files from /proc,
- * gets the needed info about system and prints this information
- *
- * */
-void systemInformation() {
-
-    // hostname
-    char hostnameFile[100000];
-    readFile("sys/kernel/hostname", hostnameFile);
-    char *next_tok_hostname = hostnameFile;
-    // take first word from file in /proc/sys/kernel/hostname
-    char *hostname = next_token(&next_tok_hostname, "\n");
-
-    //linux version
-    char versionFile[100000];
-    readFile("sys/kernel/osrelease", versionFile);
-    char *next_tok_version = versionFile;
-    // take first word from file in /proc/sys/kernel/osrelease
-    char *version = next_token(&next_tok_version, "\n");
-
-    //uptime
-    char uptimeFile[100000];
-    readFile("uptime", uptimeFile);
-    char *next_tok_uptime = uptimeFile;
-    // take first long int in /uptime file
-    long int uptime = strtol(next_token(&next_tok_uptime, " "), NULL, 10);
-
-    //now we need to convert seconds to years, days, mins and secs
-    long int year = uptime / (24*3600*365);
-    uptime = uptime % (24*3600*365);
-
-    long int day = uptime / (24 * 3600);
-    uptime = uptime % (24 * 3600);
-
-    long int hour = uptime / 3600;
-    uptime %= 3600;
-
-    long int minutes = uptime / 60 ;
-    uptime %= 60;
+    if (options->hardware) {
+        statsStart(run, &timer);
+        struct hardware_info info;
+        readHardware(&info, stat, previous);
+        if (json) {
+            hardwareJson(&info, time);
+        } else if (run->format == OUT_METRICS) {
+            hardwareMetrics(&info);
+        } else {
+            hardwareInformation(&info);
+        }
+        statsStop(run, &timer, SS_HARDWARE);
+    }
 
-    long int seconds = uptime;
+    if (options->per_cpu) {
+        statsStart(run, &timer);
+        int numCpus;
+        const int *cpuIds;
+        const float *matrix = cpuBreakdown(stat, previous, &numCpus, &cpuIds);
+        if (json) {
+            perCpuJson(matrix, cpuIds, numCpus, time);
+        } else if (run->format == OUT_METRICS) {
+            perCpuMetrics(matrix, cpuIds, numCpus);
+        } else {
+            perCpuUsage(matrix, cpuIds, numCpus);
+        }
+        statsStop(run, &timer, SS_PER_CPU);
+    }
 
-    //allocate memory for char array that will hold uptime info that is needed
-    //to be printed
-    char *resultUptime = malloc(200 * sizeof(char));
-    strcpy(resultUptime, "Uptime: ");
-    // variable for casting long int to char array
-    char castToChar[20];
+    if (run->history != NULL) {
+        float values[HM_COUNT];
+        historyValues(values, stat, previous);
+        historyAppend(run->history, (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000, values);
+    }
 
-    // print years, days and hours ONLY if they are larger that 0
-    if (year > 0) {
-        sprintf(castToChar, "%ld", year);
-        strcat(resultUptime, castToChar);
-        strcat(resultUptime, " years, ");
+    if (needCpu) {
+        if (run->runtimeDir != NULL) {
+            saveCpuState(run->runtimeDir, stat);
+        }
+        current = !current;
+        havePrevious = true;
     }
-    if (day > 0) {
-        sprintf(castToChar, "%ld", day);
-        strcat(resultUptime, castToChar);
-        strcat(resultUptime, " days, ");
+
+    if (options->task_summary) {
+        statsStart(run, &timer);
+        struct task_counts counts;
+        countTasks(&counts, stat);
+        if (json) {
+            taskSummaryJson(&counts, time);
+        } else if (run->format == OUT_METRICS) {
+            taskSummaryMetrics(&counts);
+        } else {
+            taskSummary(&counts);
+        }
+        statsStop(run, &timer, SS_TASK_SUMMARY);
     }
-    if (hour > 0) {
-        sprintf(castToChar, "%ld", hour);
-        strcat(resultUptime, castToChar);
-        strcat(resultUptime, " hours, ");
+
+    if (options->task_list) {
+        statsStart(run, &timer);
+        struct task_pool pool;
+        collectTasks(&pool, run->numThreads, &run->filter, taskSources(run));
+        sortTasks(&pool, run->sortKey, run->top);
+        if (json) {
+            taskListJson(&pool, run, time);
+        } else if (run->format == OUT_METRICS) {
+            taskListMetrics(&pool, run);
+        } else {
+            taskList(&pool, run);
+        }
+        freeTasks(&pool);
+        statsStop(run, &timer, SS_TASK_LIST);
     }
 
-    //print minutes and seconds even if they are equal to 0
-    sprintf(castToChar, "%ld", minutes);
-    strcat(resultUptime, castToChar);
-    strcat(resultUptime, " minutes, ");
-    sprintf(castToChar, "%ld", seconds);
-    strcat(resultUptime, castToChar);
-    strcat(resultUptime, " seconds");
+    if (run->format == OUT_METRICS) {
+        outStr("# EOF\n");
+    }
 
-    printf("System Information\n");
-    printf("------------------\n");
-    printf("Hostname: %s\n", hostname);
-    printf("Kernel Version: %s\n", version);
-    printf("%s\n\n", resultUptime);
+}
 
-    //free
-    free(resultUptime);
+/* printSections func prints all the sections that were selected
+ * Parameters:
+ * - pointer to the selected options
+ * - pointer to the run settings
+ *
+ * */
+void printSections(struct view_opts *options, struct run_opts *run) {
+    renderSections(options, run);
+    outFlush();
 
 }
 
-/* hardwareInformation func that grabs files from /proc,
- * gets the needed info about hardware and prints this information
+/* statsStart func starts timing a part of the sample, and drops whatever
+ * was counted since the last part
+ * Parameters:
+ * - pointer to the run settings, nothing is done without --stats
+ * - pointer to stats_timer struct that will be filled
  *
  * */
-void hardwareInformation() {
-
-    //allocate memory for char array that will hold cpu model info and pass it to cpuModel func
-    char *modelCpu = malloc(25 *sizeof(char));
-    cpuModel(modelCpu);
+void statsStart(const struct run_opts *run, struct stats_timer *timer) {
+    if (!run->stats) {
+        return;
+    }
+    struct io_stats dropped;
+    takeIoStats(&dropped);
+    clock_gettime(CLOCK_MONOTONIC, &timer->wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &timer->cpu);
+}
 
-    // get num of processing units
-    char cpuInfoFile[100000];
-    readFile("stat", cpuInfoFile);
-    char *next_tok = cpuInfoFile;
-    char *curr_tok;
-    int numOfCPUs = 0;
+/* statsStop func adds the time and the counters since statsStart() to a
+ * part of the sample. The cpu time is the whole process, so it includes the
+ * worker threads of the task list
+ * Parameters:
+ * - pointer to the run settings, nothing is done without --stats
+ * - the timer given to statsStart()
+ * - the part of the sample
+ *
+ * */
+void statsStop(const struct run_opts *run, const struct stats_timer *timer, enum stats_section section) {
+    if (!run->stats) {
+        return;
+    }
+    struct timespec wall;
+    struct timespec cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+    struct section_stats *stats = &sectionStats[section];
+    struct io_stats io;
+    takeIoStats(&io);
+    stats->runs++;
+    stats->wallMs += (wall.tv_sec - timer->wall.tv_sec) * 1000.0
+            + (wall.tv_nsec - timer->wall.tv_nsec) / 1e6;
+    stats->cpuMs += (cpu.tv_sec - timer->cpu.tv_sec) * 1000.0
+            + (cpu.tv_nsec - timer->cpu.tv_nsec) / 1e6;
+    stats->io.opens += io.opens;
+    stats->io.reads += io.reads;
+    stats->io.bytesRead += io.bytesRead;
+    stats->io.getdents += io.getdents;
+    stats->io.stats += io.stats;
+    stats->io.userLookups += io.userLookups;
+    stats->io.passwdLookups += io.passwdLookups;
+}
 
-    while ((curr_tok = next_token(&next_tok, " :\n\0,?!")) != NULL) {
-        //increase numOfCpus with each "cpu" word in /stat file
-        if (strncmp(curr_tok, "cpu", 3) == 0) {
-            numOfCPUs++;
+/* printStats func prints what each part of the samples cost over the whole
+ * run to stderr, so it does not mix with the output of the sections
+ *
+ * */
+void printStats() {
+    fprintf(stderr, "%-19s %6s %10s %10s %12s %8s %8s %8s %8s %8s %8s\n", "Section", "Runs",
+            "Wall ms", "CPU ms", "Bytes read", "Opens", "Reads", "Getdents", "Stats", "Users", "Passwd");
+    for (int i = 0; i < SS_COUNT; i++) {
+        const struct section_stats *stats = &sectionStats[i];
+        if (stats->runs == 0) {
+            continue;
         }
+        fprintf(stderr, "%-19s %6lu %10.2f %10.2f %12llu %8llu %8llu %8llu %8llu %8llu %8llu\n",
+                statsNames[i], stats->runs, stats->wallMs, stats->cpuMs, stats->io.bytesRead,
+                stats->io.opens, stats->io.reads, stats->io.getdents, stats->io.stats,
+                stats->io.userLookups, stats->io.passwdLookups);
+    }
+}
+
+/* snapshotPublish func makes a copy of a rendered sample the latest snapshot.
+ * The one it replaces stays alive until its last client is done with it
+ * Parameters:
+ * - the sample and its length
+ *
+ * */
+void snapshotPublish(const char *data, size_t len) {
+    struct snapshot *snapshot = malloc(sizeof(struct snapshot) + len);
+    atomic_init(&snapshot->refs, 1);
+    snapshot->len = len;
+    memcpy(snapshot->data, data, len);
+
+    pthread_mutex_lock(&snapshotLock);
+    struct snapshot *old = latestSnapshot;
+    latestSnapshot = snapshot;
+    pthread_mutex_unlock(&snapshotLock);
+
+    snapshotRelease(old);
+}
 
+/* snapshotAcquire func takes a reference to the latest snapshot
+ *
+ * Returns the snapshot, or NULL if nothing was published yet
+ * */
+struct snapshot *snapshotAcquire() {
+    pthread_mutex_lock(&snapshotLock);
+    struct snapshot *snapshot = latestSnapshot;
+    if (snapshot != NULL) {
+        atomic_fetch_add(&snapshot->refs, 1);
     }
-    // decrease numOfCpus by 1 because first "cpu" in stat is general cpu
-    numOfCPUs--;
+    pthread_mutex_unlock(&snapshotLock);
+    return snapshot;
+}
 
-    //allocate memory for load avg char array and pass it to func loadAver
-    char *loadAvg = malloc(100 *sizeof(char));
-    loadAver(loadAvg);
+/* snapshotRelease func drops a reference to a snapshot, the last one frees it */
+void snapshotRelease(struct snapshot *snapshot) {
+    if (snapshot != NULL && atomic_fetch_sub(&snapshot->refs, 1) == 1) {
+        free(snapshot);
+    }
+}
 
-    //allocate memory for memory usage char array and pass it to func memoryUsage
-    char *usageMem = malloc(100 * sizeof(char));
-    memoryUsage(usageMem);
+/* listenOn func opens the listening socket of the server
+ * Parameters:
+ * - a path (with a '/') for a unix domain socket, or [host:]port for TCP,
+ *   the host is 127.0.0.1 by default
+ *
+ * Returns the socket, or -1 (with a message) on error
+ * */
+int listenOn(const char *address) {
 
-    //get array containing total and idle then sleep for 1 sec and get total and idle time again
-    long int *time1 = malloc(2* sizeof(long int));
-    cpuUsage(time1);
-    sleep(1);
-    long int *time2 = malloc(2* sizeof(long int));
-    cpuUsage(time2);
-    float usageCpu;
+    int fd = -1;
 
-    //if they are equal then 0
-    if (time1[0] == time2[0] && time1[1] == time2[1]) {
+    if (strchr(address, '/') != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "%s: path too long for a socket\n", address);
+            return -1;
+        }
+        strcpy(addr.sun_path, address);
 
-        usageCpu = 0;
+        // a socket left behind by an earlier run is replaced, nothing else is
+        struct stat pathStat;
+        if (lstat(address, &pathStat) == 0 && S_ISSOCK(pathStat.st_mode)) {
+            unlink(address);
+        }
 
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+            perror(address);
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
     } else {
+        char host[256] = "127.0.0.1";
+        const char *port = strrchr(address, ':');
+        if (port != NULL) {
+            snprintf(host, sizeof(host), "%.*s", (int) (port - address), address);
+            port++;
+        } else {
+            port = address;
+        }
 
-        // calculate cpu usage by formula usage = 1 - ((idle2 - idle1) / (total2 - total1))
-        long int total = time2[0] - time1[0];
-        long int idle = time2[1] - time1[1];
-
-        float idlePercent = idle/total;
-        usageCpu = 1 - idlePercent;
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        struct addrinfo *addrs;
+        int result = getaddrinfo(host, port, &hints, &addrs);
+        if (result != 0) {
+            fprintf(stderr, "%s: %s\n", address, gai_strerror(result));
+            return -1;
+        }
 
+        for (struct addrinfo *addr = addrs; addr != NULL && fd == -1; addr = addr->ai_next) {
+            fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd == -1) {
+                continue;
+            }
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addrs);
+        if (fd == -1) {
+            perror(address);
+            return -1;
+        }
     }
 
-    //allocate memory for char array containing nicely formatted info about cpu usage
-    char *printUsageCpu = malloc(50 * sizeof(char));
-    char castToChar[20];
-
-    strcpy(printUsageCpu, "CPU Usage: [");
-
-    // for making right percantage of # and -
-    int hashtags = (int)usageCpu/5;
-    int dashes = 20 - hashtags;
-
-    for (int i = 0; i < hashtags; i++) {
-        strcat(printUsageCpu,"#");
+    if (listen(fd, 128) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
     }
-    for (int i = 0; i < dashes; i++) {
-        strcat(printUsageCpu,"-");
-    }
-
-    strcat(printUsageCpu, "] ");
-    sprintf(castToChar, "%0.1f", usageCpu);
-    strcat(printUsageCpu, castToChar);
-    strcat(printUsageCpu, "%");
-
-    printf("Hardware Information\n");
-    printf("--------------------\n");
-    printf("CPU Model: %s\n", modelCpu);
-    printf("Processing Units: %d\n", numOfCPUs);
-    printf("Load Average (1/5/15 min): %s\n", loadAvg);
-    printf("%s\n", printUsageCpu);
-    printf("%s\n\n", usageMem);
-
-    // free all allocated memory
-    free(modelCpu);
-    free(loadAvg);
-    free(usageMem);
-    free(printUsageCpu);
-    free(time1);
-    free(time2);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
+    return fd;
 }
 
-/* cpuModel func that grabs info from cpuinfo file in proc and writes it to char array
+/* clientRespond func answers the request of a client once it is complete:
+ * GET (or HEAD) of / or /metrics gets the latest snapshot, anything else an
+ * error. Every response ends the connection
  * Parameters:
- * - pointer to char array to which cpu model will be written
+ * - the client
  *
  * */
-void cpuModel(char *cpuModel) {
-    char cpuFile[100000];
-    readFile("cpuinfo", cpuFile);
-    char *next_tok = cpuFile;
-    char *curr_tok;
-    bool modelNameFound = false;
-    int countOfWords = 0;
-
-    while ((curr_tok = next_token(&next_tok, " ,?!:\t\n")) != NULL) {
-        // cpu model name is after the word "name" and before word "stepping"
-        if (modelNameFound) {
-            // count the words to put whitespaces
-            countOfWords++;
-            // if "stepping" is reached, then break
-            if(strcmp(curr_tok, "stepping") == 0) {
-                break;
-            }
-            if (countOfWords > 1) {
-                strcat(cpuModel, " ");
-            }
-            strcat(cpuModel, curr_tok);
+void clientRespond(struct client *client) {
+
+    const char *request = client->request;
+    bool head = strncmp(request, "HEAD ", 5) == 0;
+    const char *path = head ? request + 5 : strncmp(request, "GET ", 4) == 0 ? request + 4 : NULL;
+    size_t pathLen = path != NULL ? strcspn(path, " ?\r\n") : 0;
+
+    const char *status = "200 OK";
+    if (path == NULL) {
+        status = "405 Method Not Allowed";
+    } else if (!(pathLen == 1 && path[0] == '/') && !(pathLen == 8 && strncmp(path, "/metrics", 8) == 0)) {
+        status = "404 Not Found";
+    } else if ((client->snapshot = snapshotAcquire()) == NULL) {
+        status = "503 Service Unavailable";
+    }
 
-        }
-        if (strcmp(curr_tok, "name") == 0) {
-            modelNameFound = true;
-        }
+    if (client->snapshot == NULL) {
+        client->headerLen = snprintf(client->header, sizeof(client->header),
+                "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+        return;
+    }
 
+    client->headerLen = snprintf(client->header, sizeof(client->header),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n", client->snapshot->len);
+    if (head) {
+        snapshotRelease(client->snapshot);
+        client->snapshot = NULL;
     }
 }
 
-/* loadAver func that grabs info from loadavg file in proc and writes it to char array
+/* clientRead func reads the request of a client
  * Parameters:
- * - pointer to char array to which load average will be written
+ * - the client
  *
+ * Returns false if the connection is to be closed
  * */
-void loadAver(char *loadAverage) {
-    char loadAvgFile[100000];
-    readFile("loadavg", loadAvgFile);
-    char *next_tok = loadAvgFile;
-    char *curr_tok;
-    int count = 0;
-
-    while ((curr_tok = next_token(&next_tok, " \0")) != NULL) {
-
-        // only first three tokens in loadavg file are needed
-        if (count >= 3) {
-            break;
-        } else {
-            if (count >= 1) {
-                strcat(loadAverage, " ");
-            }
-            strcat(loadAverage, curr_tok);
-            count++;
-        }
+bool clientRead(struct client *client) {
 
+    ssize_t read_sz = recv(client->fd, client->request + client->requestLen,
+            REQUEST_SZ - 1 - client->requestLen, 0);
+    if (read_sz == -1) {
+        return errno == EAGAIN || errno == EINTR;
     }
+    if (read_sz == 0) {
+        return false;
+    }
+    client->requestLen += read_sz;
+    client->request[client->requestLen] = '\0';
+
+    if (strstr(client->request, "\r\n\r\n") != NULL || strstr(client->request, "\n\n") != NULL) {
+        clientRespond(client);
+    } else if (client->requestLen == REQUEST_SZ - 1) {
+        client->headerLen = snprintf(client->header, sizeof(client->header),
+                "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+
+    return true;
 }
 
-/* cpuUsage func that grabs info from stat file in proc and writes it to long int array
+/* clientWrite func sends as much of the response as the socket takes
  * Parameters:
- * - pointer to long int array to which total and idle will be written
+ * - the client
  *
+ * Returns false when the response is sent or the connection is gone
  * */
-void cpuUsage(long int *result) {
-    char cpuInfoFile[100000];
-    readFile("stat", cpuInfoFile);
-    char *next_tok = cpuInfoFile;
-    char *curr_tok;
+bool clientWrite(struct client *client) {
+
+    struct iovec iov[2];
     int count = 0;
-    // get all the fields
-    long int user = 0;
-    long int nice = 0;
-    long int system = 0;
-    long int idle = 0;
-    long int iowait = 0;
-    long int irq = 0;
-    long int softirq = 0;
-    long int steal = 0;
-    long int guest = 0;
-    long int guestnice = 0;
-
-    while ((curr_tok = next_token(&next_tok, " :\n\0,?!")) != NULL) {
-        if (count == 0) {
-            count++;
-        } else {
-            if (count == 12) {
+    if (client->sent < client->headerLen) {
+        iov[count].iov_base = client->header + client->sent;
+        iov[count++].iov_len = client->headerLen - client->sent;
+    }
+    size_t bodySent = client->sent > client->headerLen ? client->sent - client->headerLen : 0;
+    if (client->snapshot != NULL && bodySent < client->snapshot->len) {
+        iov[count].iov_base = client->snapshot->data + bodySent;
+        iov[count++].iov_len = client->snapshot->len - bodySent;
+    }
+    if (count == 0) {
+        return false;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t write_sz = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+    if (write_sz == -1) {
+        return errno == EAGAIN || errno == EINTR;
+    }
+    client->sent += write_sz;
+
+    return client->sent < client->headerLen + (client->snapshot != NULL ? client->snapshot->len : 0);
+}
+
+/* serverThread func is the body of the thread that serves the snapshots. It
+ * never reads proc: every client gets a reference to the latest snapshot,
+ * all of them are handled with one poll() loop
+ * */
+void *serverThread(void *arg) {
+    struct server *server = arg;
+    struct pollfd *fds = malloc((MAX_CLIENTS + 1) * sizeof(struct pollfd));
+
+    while (!atomic_load(&stopRequested)) {
+        // new connections are only taken when there is room for them
+        size_t numFds = 0;
+        if (server->numClients < MAX_CLIENTS) {
+            fds[numFds++] = (struct pollfd) { server->listenFd, POLLIN, 0 };
+        }
+        for (size_t i = 0; i < server->numClients; i++) {
+            struct client *client = &server->clients[i];
+            fds[numFds++] = (struct pollfd) { client->fd, client->headerLen ? POLLOUT : POLLIN, 0 };
+        }
+
+        if (poll(fds, numFds, 1000) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        size_t first = server->numClients < MAX_CLIENTS ? 1 : 0;
+        size_t kept = 0;
+        for (size_t i = 0; i < server->numClients; i++) {
+            struct client *client = &server->clients[i];
+            short events = fds[first + i].revents;
+            bool open = now.tv_sec - client->since < CLIENT_TIMEOUT;
+            if (open && (events & (POLLERR | POLLHUP | POLLNVAL)) && !(events & POLLIN)) {
+                open = false;
+            } else if (open && (events & POLLIN)) {
+                open = clientRead(client);
+            } else if (open && (events & POLLOUT)) {
+                open = clientWrite(client);
+            }
+
+            if (!open) {
+                close(client->fd);
+                snapshotRelease(client->snapshot);
+                continue;
+            }
+            server->clients[kept++] = *client;
+        }
+        server->numClients = kept;
+
+        if (first && (fds[0].revents & POLLIN)) {
+            while (server->numClients < MAX_CLIENTS) {
+                int fd = accept(server->listenFd, NULL, NULL);
+                if (fd == -1) {
+                    break;
+                }
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                struct client *client = &server->clients[server->numClients++];
+                client->fd = fd;
+                client->since = now.tv_sec;
+                client->requestLen = 0;
+                client->request[0] = '\0';
+                client->headerLen = 0;
+                client->snapshot = NULL;
+                client->sent = 0;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < server->numClients; i++) {
+        close(server->clients[i].fd);
+        snapshotRelease(server->clients[i].snapshot);
+    }
+    server->numClients = 0;
+    free(fds);
+
+    return NULL;
+}
+
+/* serve func samples the selected sections every interval seconds and
+ * publishes each sample as an OpenMetrics snapshot, that a server thread
+ * hands out to any number of clients. It runs until SIGINT or SIGTERM
+ * Parameters:
+ * - pointer to the selected options
+ * - pointer to the run settings
+ * - address to listen on, see listenOn()
+ *
+ * */
+void serve(struct view_opts *options, struct run_opts *run, const char *address) {
+
+    struct server server;
+    server.listenFd = listenOn(address);
+    if (server.listenFd == -1) {
+        exit(EXIT_FAILURE);
+    }
+    server.clients = malloc(MAX_CLIENTS * sizeof(struct client));
+    server.numClients = 0;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // the signals go to the sampler, which wakes up from its sleep
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serverThread, &server) != 0) {
+        fprintf(stderr, "Could not start the server thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    double interval = run->watchInterval > 0 ? run->watchInterval : SERVE_INTERVAL;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (!atomic_load(&stopRequested)) {
+        renderSections(options, run);
+        snapshotPublish(out.data, out.len);
+        out.len = 0;
+        if (!sleepUntilNext(&next, interval)) {
+            break;
+        }
+    }
+
+    atomic_store(&stopRequested, 1);
+    pthread_join(thread, NULL);
+    close(server.listenFd);
+    if (strchr(address, '/') != NULL) {
+        unlink(address);
+    }
+    free(server.clients);
+    snapshotRelease(latestSnapshot);
+    latestSnapshot = NULL;
+}
+
+/* anySection func checks if any section is selected, with --history and no
+ * section options the samples are only recorded */
+bool anySection(const struct view_opts *options) {
+    return options->hardware || options->system || options->task_list
+            || options->task_summary || options->per_cpu;
+}
+
+/* watch func keeps printing the selected sections every interval seconds until
+ * the program is killed (or, with --stats, interrupted). The system wide files
+ * stay open between refreshes.
+ * Parameters:
+ * - pointer to the selected options
+ * - pointer to the run settings, watchInterval is the seconds between refreshes
+ *
+ * */
+void watch(struct view_opts *options, struct run_opts *run) {
+
+    double interval = run->watchInterval;
+
+    // JSON lines are for other programs, the screen is only cleared for people
+    bool terminal = isatty(STDOUT_FILENO) && run->format == OUT_TEXT && anySection(options);
+
+    // the stats are printed when watching ends, so it has to end normally
+    if (run->stats) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = requestStop;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+    }
+
+    // keep refreshes on a fixed schedule no matter how long printing takes
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (true) {
+        if (terminal) {
+            // clear the screen and move the cursor to the top left corner
+            outStr("\033[H\033[2J");
+        }
+        printSections(options, run);
+        if (!sleepUntilNext(&next, interval)) {
+            break;
+        }
+    }
+
+}
+
+/* requestStop func is the SIGINT and SIGTERM handler of the capture */
+void requestStop(int signal) {
+    (void) signal;
+    atomic_store(&stopRequested, 1);
+}
+
+/* captureSample func takes one sample of everything the sections can read:
+ * the system wide files, and the owner and the stat file of every process,
+ * with the other files (and the fd count) the columns of -O need
+ * Parameters:
+ * - the archive
+ * - buffer the files of the processes are read into
+ * - what is captured of every process, task_source bits
+ *
+ * */
+void captureSample(struct archive_writer *archive, struct read_buf *buf, unsigned sources) {
+
+    archiveStartSample(archive);
+    forgetPids();
+
+    for (int i = 0; i < PF_COUNT; i++) {
+        char *text = readFile(i);
+        archiveAdd(archive, ENTRY_FILE, procFileNames[i], text, procBufs[i].len, 0);
+    }
+
+    int *pids;
+    size_t count = listPids(&pids, NULL);
+    for (size_t i = 0; i < count; i++) {
+        struct pid_dir dir;
+        if (!openPidDir(pids[i], &dir)) {
+            continue;
+        }
+        uid_t uid;
+        const char *statLine = NULL;
+        size_t statLen;
+        if (pidDirOwner(&dir, &uid)) {
+            statLine = readPidFile(&dir, "stat", buf, &statLen);
+        }
+        if (statLine == NULL) {
+            closePidDir(&dir);
+            continue;
+        }
+
+        char path[64];
+        snprintf(path, sizeof(path), "%s/stat", dir.name);
+        archiveAdd(archive, ENTRY_DIR, dir.name, NULL, 0, uid);
+        archiveAdd(archive, ENTRY_FILE, path, statLine, statLen, 0);
+
+        for (int f = 0; f < PID_SOURCE_FILES; f++) {
+            const char *text;
+            size_t len;
+            if ((sources & pidSourceFiles[f].source)
+                    && (text = readPidFile(&dir, pidSourceFiles[f].file, buf, &len)) != NULL) {
+                snprintf(path, sizeof(path), "%s/%s", dir.name, pidSourceFiles[f].file);
+                archiveAdd(archive, ENTRY_FILE, path, text, len, 0);
+            }
+        }
+        int fds;
+        if ((sources & TS_FD) && (fds = countPidDir(&dir, "fd")) >= 0) {
+            char count[16];
+            int len = snprintf(count, sizeof(count), "%d", fds);
+            snprintf(path, sizeof(path), "%s/fd", dir.name);
+            archiveAdd(archive, ENTRY_COUNT, path, count, len, 0);
+        }
+        closePidDir(&dir);
+    }
+    free(pids);
+
+    archiveEndSample(archive);
+}
+
+/* capture func writes samples of proc to an archive that can be replayed
+ * later. Without -w it takes two samples 1 second apart (enough for the cpu
+ * usage), with -w interval it keeps going until it gets SIGINT or SIGTERM,
+ * which end it after the sample being taken. The table of the samples and
+ * the trailer are rewritten in place after every sample, so the archive is
+ * complete between samples; a capture that dies while it writes one is lost
+ * Parameters:
+ * - path of the archive
+ * - pointer to the run settings
+ *
+ * */
+void capture(const char *path, struct run_opts *run) {
+
+    struct archive_writer archive;
+    memset(&archive, 0, sizeof(archive));
+    archive.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (archive.fd == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t version = ARCHIVE_VERSION;
+    archiveWrite(&archive, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC) - 1);
+    archiveWrite(&archive, &version, sizeof(version));
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    double interval = run->watchInterval > 0 ? run->watchInterval : 1;
+    struct read_buf buf = { NULL, 0, 0 };
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (int samples = 1; ; samples++) {
+        captureSample(&archive, &buf, taskSources(run));
+        LOG("Sample %d: %zu bytes\n", samples, (size_t) archive.end);
+        if ((run->watchInterval == 0 && samples == 2) || atomic_load(&stopRequested) || !sleepUntilNext(&next, interval)) {
+            break;
+        }
+    }
+
+    freeBuf(&buf);
+    free(archive.entries);
+    free(archive.samples);
+    free(archive.bodies);
+    close(archive.fd);
+}
+
+/* replay func prints the selected sections for every sample of the archive
+ * that is mapped, as fast as it can. A sample used as the earlier one of the
+ * cpu usage is not printed by itself
+ * Parameters:
+ * - pointer to the selected options
+ * - pointer to the run settings
+ *
+ * */
+void replay(struct view_opts *options, struct run_opts *run) {
+    do {
+        printSections(options, run);
+    } while (replayNext());
+}
+
+/* replayNext func moves the replay to the next sample of the archive
+ *
+ * Returns false if there are no more samples
+ * */
+bool replayNext() {
+    if (replayArchive.current + 1 >= replayArchive.numSamples) {
+        return false;
+    }
+    replayArchive.current++;
+    return true;
+}
+
+/* sleepUntilNext func moves a CLOCK_MONOTONIC time one interval forward and
+ * sleeps until then
+ * Parameters:
+ * - the time, updated
+ * - seconds of the interval, fractions allowed
+ *
+ * Returns false if stopping was requested, before or during the sleep
+ * */
+bool sleepUntilNext(struct timespec *next, double interval) {
+
+    long int nsec = (long int) ((interval - (long int) interval) * 1000000000);
+    next->tv_sec += (time_t) interval;
+    next->tv_nsec += nsec;
+    if (next->tv_nsec >= 1000000000) {
+        next->tv_sec++;
+        next->tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR) {
+        if (atomic_load(&stopRequested)) {
+            return false;
+        }
+    }
+
+    // the request may also have come in while the sample was taken
+    return !atomic_load(&stopRequested);
+}
+
+/* archiveWrite func appends bytes to the archive being captured
+ * Parameters:
+ * - the archive
+ * - the bytes and their number
+ *
+ * Returns the offset they were written at
+ * */
+uint64_t archiveWrite(struct archive_writer *archive, const void *data, size_t len) {
+
+    uint64_t offset = archive->end;
+    size_t written = 0;
+    while (written < len) {
+        ssize_t write_sz = pwrite(archive->fd, (const char *) data + written, len - written,
+                offset + written);
+        if (write_sz == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        written += write_sz;
+    }
+    archive->end += len;
+
+    return offset;
+}
+
+/* archiveAlign func pads the archive so the next write starts at a multiple
+ * of 8, the entry and sample tables are used straight from the mapping */
+void archiveAlign(struct archive_writer *archive) {
+    static const char zeros[8] = { 0 };
+    if (archive->end % 8 != 0) {
+        archiveWrite(archive, zeros, 8 - archive->end % 8);
+    }
+}
+
+/* archiveBody func stores a file body (or a path) in the archive followed by
+ * a NUL, so it can be parsed in place when replayed. Bodies are only stored
+ * once: a body that is already in the archive (most files do not change
+ * between samples) is found by its hash and compared to the stored copy
+ * Parameters:
+ * - the archive
+ * - the body and its length
+ *
+ * Returns the offset of the body
+ * */
+uint64_t archiveBody(struct archive_writer *archive, const char *data, size_t len) {
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ull;
+    }
+
+    // the table is at most half full
+    if (archive->numBodies * 2 >= archive->bodiesCap) {
+        size_t capacity = archive->bodiesCap ? archive->bodiesCap * 2 : 1024;
+        struct body_slot *bodies = calloc(capacity, sizeof(struct body_slot));
+        for (size_t i = 0; i < archive->bodiesCap; i++) {
+            struct body_slot *slot = &archive->bodies[i];
+            if (slot->used) {
+                size_t j = slot->hash & (capacity - 1);
+                while (bodies[j].used) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                bodies[j] = *slot;
+            }
+        }
+        free(archive->bodies);
+        archive->bodies = bodies;
+        archive->bodiesCap = capacity;
+    }
+
+    size_t mask = archive->bodiesCap - 1;
+    size_t i = hash & mask;
+    char stored[READ_CHUNK_SZ];
+    for (; archive->bodies[i].used; i = (i + 1) & mask) {
+        struct body_slot *slot = &archive->bodies[i];
+        if (slot->hash != hash || slot->len != len) {
+            continue;
+        }
+        // the same hash is almost surely the same body, but make sure
+        size_t same = 0;
+        while (same < len) {
+            size_t piece = len - same < sizeof(stored) ? len - same : sizeof(stored);
+            if (pread(archive->fd, stored, piece, slot->offset + same) != (ssize_t) piece
+                    || memcmp(stored, data + same, piece) != 0) {
                 break;
             }
-            if (count == 1) {
-                user = strtol(curr_tok, NULL, 10);
-            } else if (count == 2) {
-                nice = strtol(curr_tok, NULL, 10);
-            } else if (count == 3) {
-                system = strtol(curr_tok, NULL, 10);
-            } else if (count == 4) {
-                idle = strtol(curr_tok, NULL, 10);
-            } else if (count == 5) {
-                iowait = strtol(curr_tok, NULL, 10);
-            } else if (count == 6) {
-                irq = strtol(curr_tok, NULL, 10);
-            } else if (count == 7) {
-                softirq = strtol(curr_tok, NULL, 10);
-            } else if (count == 8) {
-                steal = strtol(curr_tok, NULL, 10);
-            } else if (count == 9) {
-                guest = strtol(curr_tok, NULL, 10);
-            } else if (count == 10) {
-                guestnice = strtol(curr_tok, NULL, 10);
+            same += piece;
+        }
+        if (same == len) {
+            return slot->offset;
+        }
+    }
+
+    uint64_t offset = archiveWrite(archive, data, len);
+    archiveWrite(archive, "", 1);
+
+    archive->bodies[i] = (struct body_slot) { true, hash, offset, len };
+    archive->numBodies++;
+
+    return offset;
+}
+
+/* archiveAdd func adds a file or a directory to the sample being captured
+ * Parameters:
+ * - the archive
+ * - kind of the entry
+ * - path relative to the proc directory
+ * - body of a file (or the count of a counted directory) and its length,
+ *   NULL for a directory
+ * - owner of a directory
+ *
+ * */
+void archiveAdd(struct archive_writer *archive, enum entry_kind kind, const char *path,
+        const char *body, size_t len, uid_t uid) {
+
+    if (archive->numEntries == archive->entriesCap) {
+        archive->entriesCap = archive->entriesCap ? archive->entriesCap * 2 : 1024;
+        archive->entries = realloc(archive->entries, archive->entriesCap * sizeof(struct pending_entry));
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+
+    struct pending_entry *pending = &archive->entries[archive->numEntries++];
+    memset(&pending->entry, 0, sizeof(pending->entry));
+    pending->path = strdup(path);
+    pending->entry.pathLen = (uint32_t) strlen(path);
+    pending->entry.path = archiveBody(archive, path, pending->entry.pathLen);
+    pending->entry.kind = kind;
+    pending->entry.uid = (uint32_t) uid;
+    pending->entry.time = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    if (body != NULL) {
+        pending->entry.body = archiveBody(archive, body, len);
+        pending->entry.bodyLen = len;
+    }
+}
+
+/* compares two pending_entry structs by path, used to sort a sample */
+int comparePending(const void *a, const void *b) {
+    const struct pending_entry *e1 = a;
+    const struct pending_entry *e2 = b;
+    return strcmp(e1->path, e2->path);
+}
+
+/* archiveEndSample func writes the entries of the sample being captured,
+ * sorted by path, and then the sample table and the trailer. The archive is
+ * complete (and can be replayed) after every sample
+ * Parameters:
+ * - the archive
+ *
+ * */
+void archiveEndSample(struct archive_writer *archive) {
+
+    qsort(archive->entries, archive->numEntries, sizeof(struct pending_entry), comparePending);
+
+    archiveAlign(archive);
+    struct archive_sample sample = { archive->sampleReal, archive->sampleBoot, archive->end, 0 };
+    for (size_t i = 0; i < archive->numEntries; i++) {
+        // a file read twice in one sample is kept once
+        if (i > 0 && strcmp(archive->entries[i].path, archive->entries[i - 1].path) == 0) {
+            continue;
+        }
+        archiveWrite(archive, &archive->entries[i].entry, sizeof(struct archive_entry));
+        sample.numEntries++;
+    }
+    for (size_t i = 0; i < archive->numEntries; i++) {
+        free(archive->entries[i].path);
+    }
+    archive->numEntries = 0;
+
+    if (archive->numSamples == archive->samplesCap) {
+        archive->samplesCap = archive->samplesCap ? archive->samplesCap * 2 : 64;
+        archive->samples = realloc(archive->samples, archive->samplesCap * sizeof(struct archive_sample));
+    }
+    archive->samples[archive->numSamples++] = sample;
+
+    // the table and the trailer are overwritten by the next sample
+    uint64_t end = archive->end;
+    struct archive_trailer trailer = { 0, archive->numSamples, ARCHIVE_MAGIC };
+    trailer.samples = archiveWrite(archive, archive->samples, archive->numSamples * sizeof(struct archive_sample));
+    archiveWrite(archive, &trailer, sizeof(trailer));
+    if (ftruncate(archive->fd, archive->end) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    archive->end = end;
+}
+
+/* archiveStartSample func starts the next sample of the archive being
+ * captured, 'time' of the sample is now */
+void archiveStartSample(struct archive_writer *archive) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    archive->sampleReal = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    archive->sampleBoot = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* outFlush func writes everything in the output buffer to stdout
+ *
+ * */
+void outFlush() {
+
+    size_t written = 0;
+    while (written < out.len) {
+        ssize_t write_sz = write(STDOUT_FILENO, out.data + written, out.len - written);
+        if (write_sz == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            count++;
+            perror("write");
+            exit(EXIT_FAILURE);
         }
+        written += write_sz;
     }
 
-    
+    out.len = 0;
+}
+
+/* outBytes func appends bytes to the output buffer
+ * Parameters:
+ * - the bytes and their number
+ *
+ * */
+void outBytes(const char *str, size_t len) {
+    growBuf(&out, out.len + len);
+    memcpy(out.data + out.len, str, len);
+    out.len += len;
+}
+
+/* outStr func appends a NUL terminated string to the output buffer */
+void outStr(const char *str) {
+    outBytes(str, strlen(str));
+}
+
+/* formatUInt func writes the digits of an unsigned integer, without going
+ * through printf
+ * Parameters:
+ * - pointer to char array of at least 20 bytes, not NUL terminated
+ * - the number
+ *
+ * Returns the number of digits
+ * */
+int formatUInt(char *dst, unsigned long long value) {
+    char digits[20];
+    char *start = digits + sizeof(digits);
 
-    // calculate total
-    long int total = user + nice + system + idle + iowait + irq + softirq + steal + guest + guestnice;
+    do {
+        *--start = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    int len = (int) (digits + sizeof(digits) - start);
+    memcpy(dst, start, len);
+
+    return len;
+}
+
+/* formatFixed func writes a number with a fixed number of decimals, the same
+ * way as "%.*f". Halfway cases go to the even digit like printf does; that
+ * is exact for float values with up to 2 decimals, which is what the text
+ * output uses
+ * Parameters:
+ * - pointer to char array of at least 32 bytes, not NUL terminated
+ * - the number
+ * - number of decimals, 0 to 9
+ *
+ * Returns the number of bytes written, or -1 if the number is not finite
+ * or too big
+ * */
+int formatFixed(char *dst, double value, int decimals) {
+
+    if (!isfinite(value)) {
+        return -1;
+    }
+
+    unsigned long long scale = 1;
+    for (int i = 0; i < decimals; i++) {
+        scale *= 10;
+    }
+
+    // round once, so 0.96 with 1 decimal becomes "1.0" and not "0.10"
+    double scaled = (value < 0 ? -value : value) * scale;
+    if (scaled >= 1e18) {
+        return -1;
+    }
+    unsigned long long fixed = (unsigned long long) scaled;
+    double rest = scaled - fixed;
+    if (rest > 0.5 || (rest == 0.5 && (fixed & 1))) {
+        fixed++;
+    }
+
+    int len = 0;
+    if (value < 0) {
+        dst[len++] = '-';
+    }
+    len += formatUInt(dst + len, fixed / scale);
+
+    if (decimals > 0) {
+        unsigned long long fraction = fixed % scale;
+        dst[len] = '.';
+        for (int i = decimals; i > 0; i--) {
+            dst[len + i] = (char) ('0' + fraction % 10);
+            fraction /= 10;
+        }
+        len += decimals + 1;
+    }
+
+    return len;
+}
+
+/* outPadded func appends bytes right aligned in a field, like "%*s"
+ * Parameters:
+ * - the bytes and their number
+ * - width of the field, nothing is cut if they are longer
+ *
+ * */
+void outPadded(const char *str, size_t len, int width) {
+    static const char spaces[] = "                                ";
+
+    while (width > (int) len) {
+        size_t pad = width - len;
+        if (pad > sizeof(spaces) - 1) {
+            pad = sizeof(spaces) - 1;
+        }
+        outBytes(spaces, pad);
+        width -= (int) pad;
+    }
+    outBytes(str, len);
+}
+
+/* outPrintable func appends bytes right aligned in a field like outPadded(),
+ * with the control characters (a newline in a cmdline, say) replaced by '?'
+ * like ps does, so they can not break the lines of the text output
+ * Parameters:
+ * - the bytes and their number
+ * - width of the field
+ *
+ * */
+void outPrintable(const char *str, size_t len, int width) {
+    outPadded("", 0, width - (int) len);
+
+    // copy the runs of printable bytes in one go
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if (c >= 0x20 && c != 0x7f) {
+            continue;
+        }
+        outBytes(str + start, i - start);
+        outBytes("?", 1);
+        start = i + 1;
+    }
+    outBytes(str + start, len - start);
+}
+
+/* outUInt func appends an unsigned integer to the output buffer */
+void outUInt(unsigned long long value) {
+    char digits[20];
+    outBytes(digits, formatUInt(digits, value));
+}
+
+/* outInt func appends a signed integer to the output buffer, right aligned
+ * in a field of 'width' characters (0 for none)
+ * Parameters:
+ * - the number
+ * - width of the field
+ *
+ * */
+void outInt(long long value, int width) {
+    char digits[21];
+    int len = 0;
+    if (value < 0) {
+        digits[len++] = '-';
+    }
+    len += formatUInt(digits + len, value < 0 ? -(unsigned long long) value : (unsigned long long) value);
+    outPadded(digits, len, width);
+}
+
+/* outFixed func appends a number with a fixed number of decimals, right
+ * aligned in a field of 'width' characters (0 for none), like "%*.*f".
+ * Values that are not finite have no JSON form and are written as null
+ * Parameters:
+ * - the number
+ * - number of decimals, 0 to 9
+ * - width of the field
+ *
+ * */
+void outFixed(double value, int decimals, int width) {
+    char number[32];
+    int len = formatFixed(number, value, decimals);
+    if (len == -1) {
+        outPadded("null", 4, width);
+    } else {
+        outPadded(number, len, width);
+    }
+}
+
+/* outBar func appends a bar of 20 characters, one '#' for every 5 percent
+ * and '-' for the rest
+ * Parameters:
+ * - the percentage
+ *
+ * */
+void outBar(float percentage) {
+    static const char bars[] = "####################--------------------";
+
+    int hashtags = (int) percentage / 5;
+    if (hashtags < 0) {
+        hashtags = 0;
+    } else if (hashtags > 20) {
+        hashtags = 20;
+    }
+    outBytes(bars + 20 - hashtags, 20);
+}
+
+/* outJsonStr func appends a string as a quoted JSON string, escaping quotes,
+ * backslashes and control characters
+ * Parameters:
+ * - the string
+ *
+ * */
+void outJsonStr(const char *str) {
+    static const char hex[] = "0123456789abcdef";
+
+    outBytes("\"", 1);
+
+    // copy the runs of characters that need no escaping in one go
+    const char *start = str;
+    for (; *str != '\0'; str++) {
+        unsigned char c = *str;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        outBytes(start, str - start);
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char) c };
+            outBytes(escaped, 2);
+        } else {
+            char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            outBytes(escaped, 6);
+        }
+        start = str + 1;
+    }
+    outBytes(start, str - start);
+
+    outBytes("\"", 1);
+}
+
+/* jsonBegin func starts the JSON object of one section of a sample
+ * Parameters:
+ * - name of the section
+ * - time of the sample, seconds since the epoch
+ *
+ * */
+void jsonBegin(const char *section, double time) {
+    outStr("{\"section\":");
+    outJsonStr(section);
+    outStr(",\"time\":");
+    outFixed(time, 3, 0);
+}
+
+/* jsonKey func starts the next member of the current JSON object, the value
+ * has to be appended after it */
+void jsonKey(const char *key) {
+    outStr(",\"");
+    outStr(key);
+    outStr("\":");
+}
+
+/* jsonEnd func ends the current JSON object and its line */
+void jsonEnd() {
+    outStr("}\n");
+}
 
-    //write total and idle as elements of array
-    result[0] = total;
-    result[1] = idle;
+/* metricFamily func starts a metric family of the OpenMetrics output
+ * Parameters:
+ * - name of the family
+ * - its type: gauge, counter or info
+ * - one line of help
+ *
+ * */
+void metricFamily(const char *name, const char *type, const char *help) {
+    outStr("# TYPE ");
+    outStr(name);
+    outStr(" ");
+    outStr(type);
+    outStr("\n# HELP ");
+    outStr(name);
+    outStr(" ");
+    outStr(help);
+    outStr("\n");
+}
+
+/* outLabelStr func appends a quoted label value, with backslash, double
+ * quote and newline escaped like OpenMetrics wants */
+void outLabelStr(const char *str) {
+    outBytes("\"", 1);
+
+    const char *start = str;
+    for (; *str != '\0'; str++) {
+        if (*str != '"' && *str != '\\' && *str != '\n') {
+            continue;
+        }
+        outBytes(start, str - start);
+        outStr(*str == '\n' ? "\\n" : *str == '"' ? "\\\"" : "\\\\");
+        start = str + 1;
+    }
+    outBytes(start, str - start);
+
+    outBytes("\"", 1);
+}
+
+/* outMetric func appends the value of a metric sample and ends its line
+ * Parameters:
+ * - the value, NaN if it is not a number
+ * - digits after the decimal point
+ *
+ * */
+void outMetric(double value, int decimals) {
+    outStr(" ");
+    if (isfinite(value)) {
+        outFixed(value, decimals, 0);
+    } else {
+        outStr("NaN");
+    }
+    outStr("\n");
+}
+
+/* systemInformation func renders the info about system
+ * Parameters:
+ * - the info, from readSystem()
+ *
+ * */
+void systemInformation(const struct system_info *info) {
+
+    long int uptime = info->uptime;
+
+    //now we need to convert seconds to years, days, mins and secs
+    long int year = uptime / (24*3600*365);
+    uptime = uptime % (24*3600*365);
+
+    long int day = uptime / (24 * 3600);
+    uptime = uptime % (24 * 3600);
+
+    long int hour = uptime / 3600;
+    uptime %= 3600;
+
+    long int minutes = uptime / 60 ;
+    uptime %= 60;
+
+    long int seconds = uptime;
+
+    outStr("System Information\n");
+    outStr("------------------\n");
+    outStr("Hostname: ");
+    outStr(info->hostname);
+    outStr("\nKernel Version: ");
+    outStr(info->version);
+    outStr("\nUptime: ");
+
+    // print years, days and hours ONLY if they are larger that 0
+    if (year > 0) {
+        outInt(year, 0);
+        outStr(" years, ");
+    }
+    if (day > 0) {
+        outInt(day, 0);
+        outStr(" days, ");
+    }
+    if (hour > 0) {
+        outInt(hour, 0);
+        outStr(" hours, ");
+    }
+
+    //print minutes and seconds even if they are equal to 0
+    outInt(minutes, 0);
+    outStr(" minutes, ");
+    outInt(seconds, 0);
+    outStr(" seconds\n\n");
+
+}
+
+/* systemJson func writes the info about system as one JSON object
+ * Parameters:
+ * - the info, from readSystem()
+ * - time of the sample
+ *
+ * */
+void systemJson(const struct system_info *info, double time) {
+    jsonBegin("system", time);
+    jsonKey("hostname");
+    outJsonStr(info->hostname);
+    jsonKey("kernel");
+    outJsonStr(info->version);
+    jsonKey("uptime");
+    outInt(info->uptime, 0);
+    jsonEnd();
+}
+
+/* systemMetrics func renders the system section as OpenMetrics
+ * Parameters:
+ * - the info, from readSystem()
+ *
+ * */
+void systemMetrics(const struct system_info *info) {
+    metricFamily("inspector_system", "info", "Hostname and kernel version.");
+    outStr("inspector_system_info{hostname=");
+    outLabelStr(info->hostname);
+    outStr(",kernel=");
+    outLabelStr(info->version);
+    outStr("} 1\n");
+    metricFamily("inspector_uptime_seconds", "gauge", "Time since boot.");
+    outStr("inspector_uptime_seconds");
+    outMetric(info->uptime, 0);
+}
+
+/* hardwareInformation func renders the info about hardware
+ * Parameters:
+ * - the info, from readHardware()
+ *
+ * */
+void hardwareInformation(const struct hardware_info *info) {
+
+    outStr("Hardware Information\n");
+    outStr("--------------------\n");
+    outStr("CPU Model: ");
+    outStr(info->cpuModel);
+    outStr("\nProcessing Units: ");
+    outInt(info->numCpus, 0);
+    outStr("\nLoad Average (1/5/15 min): ");
+    outStr(info->loadAvg);
+
+    outStr("\nCPU Usage: [");
+    outBar(info->cpuUsage);
+    outStr("] ");
+    outFixed(info->cpuUsage, 1, 0);
+    outStr("%\n");
+
+    memoryUsage(info->memTotal, info->memActive);
+    outStr("\n\n");
+
+}
+
+/* hardwareJson func writes the info about hardware as one JSON object
+ * Parameters:
+ * - the info, from readHardware()
+ * - time of the sample
+ *
+ * */
+void hardwareJson(const struct hardware_info *info, double time) {
+    jsonBegin("hardware", time);
+    jsonKey("cpu_model");
+    outJsonStr(info->cpuModel);
+    jsonKey("cpus");
+    outInt(info->numCpus, 0);
+    jsonKey("load_avg");
+    for (int i = 0; i < 3; i++) {
+        outStr(i == 0 ? "[" : ",");
+        outFixed(info->load[i], 2, 0);
+    }
+    outStr("]");
+    jsonKey("cpu_usage");
+    outFixed(info->cpuUsage, 1, 0);
+    jsonKey("mem_total_kb");
+    outUInt((unsigned long long) info->memTotal);
+    jsonKey("mem_active_kb");
+    outUInt((unsigned long long) info->memActive);
+    jsonEnd();
+}
+
+/* hardwareMetrics func renders the hardware section as OpenMetrics
+ * Parameters:
+ * - the info, from readHardware()
+ *
+ * */
+void hardwareMetrics(const struct hardware_info *info) {
+    static const char *periods[3] = { "1m", "5m", "15m" };
+
+    metricFamily("inspector_cpu", "info", "Model of the cpus.");
+    outStr("inspector_cpu_info{model=");
+    outLabelStr(info->cpuModel);
+    outStr("} 1\n");
+    metricFamily("inspector_cpus", "gauge", "Number of processing units.");
+    outStr("inspector_cpus");
+    outMetric(info->numCpus, 0);
+    metricFamily("inspector_load_average", "gauge", "Load averages.");
+    for (int i = 0; i < 3; i++) {
+        outStr("inspector_load_average{period=\"");
+        outStr(periods[i]);
+        outStr("\"}");
+        outMetric(info->load[i], 2);
+    }
+    metricFamily("inspector_cpu_usage_percent", "gauge", "Busy time of all the cpus between the last two samples.");
+    outStr("inspector_cpu_usage_percent");
+    outMetric(info->cpuUsage, 1);
+    metricFamily("inspector_memory_total_bytes", "gauge", "MemTotal of meminfo.");
+    outStr("inspector_memory_total_bytes");
+    outMetric(info->memTotal * 1024.0, 0);
+    metricFamily("inspector_memory_active_bytes", "gauge", "Active of meminfo.");
+    outStr("inspector_memory_active_bytes");
+    outMetric(info->memActive * 1024.0, 0);
+}
+
+/* perCpuUsage func renders how each cpu spent the time between two samples,
+ * one row per cpu with a bar of the busy (not idle) time
+ * Parameters:
+ * - matrix of percentages, from cpuBreakdown()
+ * - numbers of the cpus of the rows
+ * - number of cpus (rows)
+ *
+ * */
+void perCpuUsage(const float *matrix, const int *cpuIds, int numCpus) {
+
+    if (numCpus == 0) {
+        return;
+    }
+
+    // same columns as "%5d | %5.1f %5.1f %6.1f %6.1f %5.1f %7.1f %5.1f | "
+    static const struct {
+        enum cpu_field field;
+        int width;
+    } columns[] = {
+        { CPU_USER, 5 },
+        { CPU_NICE, 5 },
+        { CPU_SYSTEM, 6 },
+        { CPU_IOWAIT, 6 },
+        { CPU_IRQ, 5 },
+        { CPU_SOFTIRQ, 7 },
+        { CPU_STEAL, 5 },
+    };
+
+    outStr("Per-CPU Usage\n");
+    outStr("-------------\n");
+    outStr("  CPU |  user  nice system iowait   irq softirq steal | busy\n");
+    for (int cpu = 0; cpu < numCpus; cpu++) {
+        const float *row = matrix + (size_t) cpu * CPU_FIELDS;
+        float busy = 100 - row[CPU_IDLE];
+
+        outInt(cpuIds[cpu], 5);
+        outStr(" | ");
+        for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++) {
+            if (i > 0) {
+                outBytes(" ", 1);
+            }
+            outFixed(row[columns[i].field], 1, columns[i].width);
+        }
+        outStr(" | [");
+        outBar(busy);
+        outStr("] ");
+        outFixed(busy, 1, 0);
+        outStr("%\n");
+    }
+    outStr("\n");
 
 }
 
-/* memoryUsage func that grabs info from meminfo file in proc and writes it to char array in a nice format
+/* perCpuJson func writes the per-cpu usage as one JSON object with an array
+ * of cpus
  * Parameters:
- * - pointer to char array to which memory usage will be written
+ * - matrix of percentages, from cpuBreakdown()
+ * - numbers of the cpus of the rows
+ * - number of cpus (rows)
+ * - time of the sample
  *
  * */
-void memoryUsage(char *userPercentage) {
-    char memInfoFile[100000];
-    readFile("meminfo", memInfoFile);
-    char *next_tok = memInfoFile;
-    char *curr_tok;
-    float memTotal = 0;
-    float active = 0;
-
-    while ((curr_tok = next_token(&next_tok, " :\n\0,?!")) != NULL) {
+void perCpuJson(const float *matrix, const int *cpuIds, int numCpus, double time) {
+    static const struct {
+        const char *key;
+        enum cpu_field field;
+    } columns[] = {
+        { ",\"user\":", CPU_USER },
+        { ",\"nice\":", CPU_NICE },
+        { ",\"system\":", CPU_SYSTEM },
+        { ",\"iowait\":", CPU_IOWAIT },
+        { ",\"irq\":", CPU_IRQ },
+        { ",\"softirq\":", CPU_SOFTIRQ },
+        { ",\"steal\":", CPU_STEAL },
+    };
+
+    jsonBegin("cpu", time);
+    jsonKey("cpus");
+    outStr("[");
+    for (int cpu = 0; cpu < numCpus; cpu++) {
+        const float *row = matrix + (size_t) cpu * CPU_FIELDS;
+        outStr(cpu == 0 ? "{\"cpu\":" : ",{\"cpu\":");
+        outInt(cpuIds[cpu], 0);
+        for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++) {
+            outStr(columns[i].key);
+            outFixed(row[columns[i].field], 1, 0);
+        }
+        outStr(",\"busy\":");
+        outFixed(100 - row[CPU_IDLE], 1, 0);
+        outStr("}");
+    }
+    outStr("]");
+    jsonEnd();
+}
 
-        // get memtotal and active
-        if (strcmp(curr_tok, "MemTotal") == 0) {
-            memTotal = strtof(next_token(&next_tok, " ,?!"), NULL);
-        } else if (strcmp(curr_tok, "Active") == 0) {
-            active = strtof(next_token(&next_tok, " ,?!"), NULL);
+/* perCpuMetrics func renders how each cpu spent the time between two samples
+ * as OpenMetrics, one sample per cpu and state
+ * Parameters:
+ * - matrix of percentages, from cpuBreakdown()
+ * - numbers of the cpus of the rows
+ * - number of cpus (rows)
+ *
+ * */
+void perCpuMetrics(const float *matrix, const int *cpuIds, int numCpus) {
+    static const struct {
+        const char *label;
+        enum cpu_field field;
+    } columns[] = {
+        { "\",mode=\"user\"}", CPU_USER },
+        { "\",mode=\"nice\"}", CPU_NICE },
+        { "\",mode=\"system\"}", CPU_SYSTEM },
+        { "\",mode=\"idle\"}", CPU_IDLE },
+        { "\",mode=\"iowait\"}", CPU_IOWAIT },
+        { "\",mode=\"irq\"}", CPU_IRQ },
+        { "\",mode=\"softirq\"}", CPU_SOFTIRQ },
+        { "\",mode=\"steal\"}", CPU_STEAL },
+    };
+
+    metricFamily("inspector_cpu_percent", "gauge", "Time each cpu spent in each state between the last two samples.");
+    for (int cpu = 0; cpu < numCpus; cpu++) {
+        const float *row = matrix + (size_t) cpu * CPU_FIELDS;
+        for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++) {
+            outStr("inspector_cpu_percent{cpu=\"");
+            outInt(cpuIds[cpu], 0);
+            outStr(columns[i].label);
+            outMetric(row[columns[i].field], 1);
         }
     }
+}
+
+/* memoryUsage func that writes the memory usage line (without the newline)
+ * in a nice format
+ * Parameters:
+ * - MemTotal in kB
+ * - Active in kB
+ *
+ * */
+void memoryUsage(float memTotal, float active) {
 
     //count how much it is in GB
     float totalGB = memTotal/1048576;
@@ -536,293 +2548,1038 @@ void memoryUsage(char *userPercentage) {
     //count percentage of mem usage
     float percentage = active/memTotal * 100;
 
-    char castToChar[30];
+    outStr("Memory Usage: [");
+    outBar(percentage);
+    outStr("] ");
+    outFixed(percentage, 1, 0);
+    outStr("% (");
+    outFixed(activeGB, 1, 0);
+    outStr(" GB / ");
+    outFixed(totalGB, 1, 0);
+    outStr(" GB)");
 
-    strcpy(userPercentage, "Memory Usage: [");
+}
 
-    int hashtags = (int)percentage/5;
-    int dashes = 20 - hashtags;
+/**
+ * taskSummary renders the number of tasks, interrupts, context switches and forks
+ * Parameters:
+ * - the counts, from countTasks()
+ */
+void taskSummary(const struct task_counts *counts) {
+
+    outStr("Task Information\n");
+    outStr("----------------\n");
+    outStr("Tasks running: ");
+    outInt(counts->tasks, 0);
+    outStr("\nSince boot:\n");
+    outStr("\tInterrupts: ");
+    outUInt(counts->intr);
+    outStr("\n\tContext Switches: ");
+    outUInt(counts->ctxt);
+    outStr("\n\tForks: ");
+    outUInt(counts->forks);
+    outStr("\n\n");
 
-    for (int i = 0; i < hashtags; i++) {
-        strcat(userPercentage,"#");
-    }
-    for (int i = 0; i < dashes; i++) {
-        strcat(userPercentage,"-");
-    }
-    strcat(userPercentage, "] ");
-    sprintf(castToChar, "%0.1f", percentage);
-    strcat(userPercentage, castToChar);
-    strcat(userPercentage, "% (");
-    sprintf(castToChar, "%0.1f", activeGB);
-    strcat(userPercentage, castToChar);
-    strcat(userPercentage, " GB / ");
-    sprintf(castToChar, "%0.1f", totalGB);
-    strcat(userPercentage, castToChar);
-    strcat(userPercentage, " GB)");
+}
 
+/**
+ * taskSummaryJson writes the task summary as one JSON object
+ * Parameters:
+ * - the counts, from countTasks()
+ * - time of the sample
+ */
+void taskSummaryJson(const struct task_counts *counts, double time) {
+    jsonBegin("tasks", time);
+    jsonKey("tasks");
+    outInt(counts->tasks, 0);
+    jsonKey("interrupts");
+    outUInt(counts->intr);
+    jsonKey("context_switches");
+    outUInt(counts->ctxt);
+    jsonKey("forks");
+    outUInt(counts->forks);
+    jsonEnd();
 }
 
 /**
- * taskSummary counts the number of all digit folders in proc
- * gets info from stat file and prints all the info
+ * taskSummaryMetrics renders the task counts as OpenMetrics
+ * Parameters:
+ * - the counts, from countTasks()
  */
-void taskSummary() {
+void taskSummaryMetrics(const struct task_counts *counts) {
+    metricFamily("inspector_tasks", "gauge", "Number of processes.");
+    outStr("inspector_tasks");
+    outMetric(counts->tasks, 0);
+    // the counters are printed as integers, they can be too big for a double
+    metricFamily("inspector_interrupts", "counter", "Interrupts since boot.");
+    outStr("inspector_interrupts_total ");
+    outUInt(counts->intr);
+    outStr("\n");
+    metricFamily("inspector_context_switches", "counter", "Context switches since boot.");
+    outStr("inspector_context_switches_total ");
+    outUInt(counts->ctxt);
+    outStr("\n");
+    metricFamily("inspector_forks", "counter", "Processes created since boot.");
+    outStr("inspector_forks_total ");
+    outUInt(counts->forks);
+    outStr("\n");
+}
 
-    int numOfTasks = 0;
+/* historyOpen func maps a history file, a new one is created with empty
+ * tiers. The recorder takes an exclusive lock, there can only be one
+ * Parameters:
+ * - path of the file
+ * - true to record, false to only read it
+ * - pointer to history struct that will be filled
+ *
+ * Returns false (with a message) if it can not be used
+ * */
+bool historyOpen(const char *path, bool record, struct history *history) {
 
-    //open the directory
-    DIR *directory;
+    int fd = record ? open(path, O_RDWR | O_CREAT, 0644) : open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return false;
+    }
+    if (record && flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        fprintf(stderr, "%s: %s\n", path, errno == EWOULDBLOCK ? "already being recorded" : strerror(errno));
+        close(fd);
+        return false;
+    }
 
-    if ((directory = opendir(".")) == NULL) {
-        perror("opendir");
-        exit(EXIT_FAILURE);
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1) {
+        perror(path);
+        close(fd);
+        return false;
     }
 
-    struct dirent *entry;
-    while ((entry = readdir(directory)) != NULL) {
-        size_t len = strlen(entry->d_name);
-        int i;
-        // check if directory name is all digit
-        for (i = 0; i < len; i++) {
-            if (!isdigit(entry->d_name[i])) {
-                break;
-            }
+    size_t size = fileStat.st_size;
+    struct history_header fresh;
+    bool created = record && size == 0;
+    if (created) {
+        static const uint32_t slots[TIERS] = { HISTORY_RAW_SLOTS, HISTORY_MINUTE_SLOTS, HISTORY_HOUR_SLOTS };
+        static const int64_t spans[TIERS] = { 0, 60000, 3600000 };
+
+        memset(&fresh, 0, sizeof(fresh));
+        memcpy(fresh.magic, HISTORY_MAGIC, sizeof(fresh.magic));
+        fresh.version = HISTORY_VERSION;
+        fresh.metrics = HM_COUNT;
+        size = sizeof(fresh);
+        for (int i = 0; i < TIERS; i++) {
+            struct history_tier_info *tier = &fresh.tiers[i];
+            tier->offset = size;
+            tier->slots = slots[i];
+            tier->slotSize = i == TIER_RAW ? sizeof(struct history_sample) : sizeof(struct history_rollup);
+            tier->spanMs = spans[i];
+            size += (size_t) tier->slots * tier->slotSize;
+        }
+        if (ftruncate(fd, size) == -1) {
+            perror(path);
+            close(fd);
+            return false;
         }
+    }
+
+    if (size < sizeof(struct history_header)) {
+        fprintf(stderr, "%s: not a history file\n", path);
+        close(fd);
+        return false;
+    }
 
-        bool allInt = i ? true : false;
+    char *map = mmap(NULL, size, record ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    // the lock stays with the mapping's open file until exit
+    if (!record) {
+        close(fd);
+    }
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        if (record) {
+            close(fd);
+        }
+        return false;
+    }
+    if (created) {
+        memcpy(map, &fresh, sizeof(fresh));
+    }
 
-        //if directory name is all digit and it is a folder then increment num of tasks
-        if (allInt && entry->d_type == DT_DIR) {
-            numOfTasks++;
+    struct history_header *header = (struct history_header *) map;
+    bool valid = memcmp(header->magic, HISTORY_MAGIC, sizeof(header->magic)) == 0
+            && header->version == HISTORY_VERSION && header->metrics == HM_COUNT;
+    for (int i = 0; valid && i < TIERS; i++) {
+        const struct history_tier_info *tier = &header->tiers[i];
+        valid = tier->slots > 0 && tier->offset % 8 == 0
+                && tier->slotSize == (i == TIER_RAW ? sizeof(struct history_sample) : sizeof(struct history_rollup))
+                && tier->offset + (uint64_t) tier->slots * tier->slotSize <= size;
+    }
+    if (!valid) {
+        fprintf(stderr, "%s: not a history file of this version\n", path);
+        munmap(map, size);
+        if (record) {
+            close(fd);
         }
+        return false;
     }
-    //close dir
-    closedir(directory);
 
-    //get num of interrupts, contSwitches and forks from stat file
-    char buf[100000];
-    readFile("stat", buf);
-    char *next_tok = buf;
-    char *curr_tok;
-    long int interrupts;
-    long int contSwitches;
-    long int forks;
+    history->map = map;
+    history->size = size;
+    history->header = header;
 
-    while ((curr_tok = next_token(&next_tok, " \n\0,?!")) != NULL) {
+    return true;
+}
 
-        //tokens after intr, ctxt and processes are the info that we need
-        if (strcmp(curr_tok, "intr") == 0) {
-            interrupts = strtol(next_token(&next_tok, " ,?!"), NULL, 10);
-        } else if (strcmp(curr_tok, "ctxt") == 0) {
-            contSwitches = strtol(next_token(&next_tok, " ,?!"), NULL, 10);
-        } else if (strcmp(curr_tok, "processes") == 0) {
-            forks = strtol(next_token(&next_tok, " ,?!"), NULL, 10);
-        }
+/* historySlot func returns a slot of a tier by its number, the n-th slot
+ * ever started in the tier
+ * Parameters:
+ * - the history
+ * - the tier
+ * - number of the slot
+ *
+ * */
+void *historySlot(const struct history *history, enum history_tier tier, uint64_t n) {
+    const struct history_tier_info *info = &history->header->tiers[tier];
+    return history->map + info->offset + (size_t) (n % info->slots) * info->slotSize;
+}
+
+/* historyValues func calculates the values of one history sample
+ * Parameters:
+ * - array of HM_COUNT floats that will be filled
+ * - snapshot of /proc/stat taken for this sample
+ * - earlier snapshot the cpu usage and the rates are calculated against
+ *
+ * */
+void historyValues(float *values, const struct stat_snapshot *stat, const struct stat_snapshot *previous) {
+
+    // loadavg starts with the three numbers, nothing needs to be cut out
+    char *next_load = readFile(PF_LOADAVG);
+    for (int i = 0; i < 3; i++) {
+        values[HM_LOAD1 + i] = strtof(next_load, &next_load);
+    }
+
+    // the breakdown of all the cpus together is just one more row
+    float row[CPU_FIELDS];
+    cpuDeltas(stat->total.field, previous->total.field, row, CPU_FIELDS);
+    cpuPercentages(row, 1);
+    static const enum cpu_field fields[] = {
+        CPU_USER, CPU_NICE, CPU_SYSTEM, CPU_IOWAIT, CPU_IRQ, CPU_SOFTIRQ, CPU_STEAL
+    };
+    for (int i = 0; i < 7; i++) {
+        values[HM_USER + i] = row[fields[i]];
+    }
+    float total = 0;
+    for (int i = 0; i < CPU_GUEST; i++) {
+        total += row[i];
     }
+    values[HM_BUSY] = total > 0 ? 100 - row[CPU_IDLE] : 0;
 
-    //print everything
-    printf("Task Information\n");
-    printf("----------------\n");
-    printf("Tasks running: %d\n", numOfTasks);
-    printf("Since boot:\n" );
-    printf("\tInterrupts: %ld\n", interrupts);
-    printf("\tContext Switches: %ld\n", contSwitches);
-    printf("\tForks: %ld\n\n", forks);
+    float memTotal;
+    float active;
+    readMemory(&memTotal, &active);
+    values[HM_MEMORY] = memTotal > 0 ? active / memTotal * 100 : 0;
 
+    double age = (stat->time.tv_sec - previous->time.tv_sec)
+            + (stat->time.tv_nsec - previous->time.tv_nsec) / 1e9;
+    if (age <= 0) {
+        age = 1;
+    }
+    values[HM_CTXT_RATE] = counterRate(stat->ctxt, previous->ctxt, age);
+    values[HM_INTR_RATE] = counterRate(stat->intr, previous->intr, age);
+    values[HM_FORK_RATE] = counterRate(stat->processes, previous->processes, age);
 }
 
-/**
- * taskList prints the task list: pid, state, task name, user and num of tasks
+/* counterRate func turns two readings of a counter into a rate per second.
+ * An earlier reading of 0 means the counter was not there (a -d sample
+ * saved by an older version), and a counter that went down was reset; both
+ * give 0 instead of a rate of the whole counter
+ * Parameters:
+ * - the counter now and at the earlier sample
+ * - seconds between them
  *
- */
-void taskList() {
+ * */
+float counterRate(unsigned long long now, unsigned long long before, double age) {
+    if (before == 0 || now < before) {
+        return 0;
+    }
+    return (float) ((now - before) / age);
+}
+
+/* historyAppend func adds a sample to the history: one raw slot is written
+ * and the open rollup of each tier is updated (or the next one started), so
+ * it costs the same no matter how big the history is. Times in a tier never
+ * go backwards, a sample older than the last one (the clock was set back)
+ * counts as taken at the time of the last one
+ * Parameters:
+ * - the history
+ * - time of the sample, in ms since the epoch
+ * - the HM_COUNT values of the sample
+ *
+ * */
+void historyAppend(struct history *history, int64_t time, const float *values) {
 
-    //open /proc directory
-    DIR *directory;
+    struct history_tier_info *raw = &history->header->tiers[TIER_RAW];
+    if (raw->written > 0) {
+        const struct history_sample *last = historySlot(history, TIER_RAW, raw->written - 1);
+        if (time < last->time) {
+            time = last->time;
+        }
+    }
+    struct history_sample *sample = historySlot(history, TIER_RAW, raw->written);
+    sample->time = time;
+    memcpy(sample->value, values, sizeof(sample->value));
+    raw->written++;
+
+    for (int i = TIER_MINUTE; i < TIERS; i++) {
+        struct history_tier_info *tier = &history->header->tiers[i];
+        int64_t start = time - time % tier->spanMs;
+        struct history_rollup *rollup = NULL;
+        if (tier->written > 0) {
+            rollup = historySlot(history, i, tier->written - 1);
+            if (start > rollup->start) {
+                rollup = NULL;
+            }
+        }
 
-    if ((directory = opendir(".")) == NULL) {
-        perror("opendir");
-        exit(EXIT_FAILURE);
+        if (rollup == NULL) {
+            rollup = historySlot(history, i, tier->written);
+            rollup->start = start;
+            rollup->count = 1;
+            memcpy(rollup->min, values, sizeof(rollup->min));
+            memcpy(rollup->max, values, sizeof(rollup->max));
+            memcpy(rollup->sum, values, sizeof(rollup->sum));
+            tier->written++;
+            continue;
+        }
+
+        rollup->count++;
+        for (int m = 0; m < HM_COUNT; m++) {
+            rollup->min[m] = values[m] < rollup->min[m] ? values[m] : rollup->min[m];
+            rollup->max[m] = values[m] > rollup->max[m] ? values[m] : rollup->max[m];
+            rollup->sum[m] += values[m];
+        }
+    }
+}
+
+/* slotStart func returns the start of a slot, the time of a raw sample */
+int64_t slotStart(const struct history *history, enum history_tier tier, uint64_t n) {
+    if (tier == TIER_RAW) {
+        return ((const struct history_sample *) historySlot(history, tier, n))->time;
     }
+    return ((const struct history_rollup *) historySlot(history, tier, n))->start;
+}
 
-    printf("%5s | %12s | %25s | %15s | %s \n", "PID", "State", "Task Name", "User", "Tasks");
-    printf("------+--------------+---------------------------+-----------------+-------\n");
+/* historyFirst func finds the first slot of a tier that ends after a time,
+ * with a binary search over the slots that are kept
+ * Parameters:
+ * - the history
+ * - the tier
+ * - the time, in ms since the epoch
+ *
+ * Returns the number of the slot, 'written' of the tier if there is none
+ * */
+uint64_t historyFirst(const struct history *history, enum history_tier tier, int64_t time) {
+    const struct history_tier_info *info = &history->header->tiers[tier];
+    uint64_t low = info->written > info->slots ? info->written - info->slots : 0;
+    uint64_t high = info->written;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (slotStart(history, tier, middle) + info->spanMs <= time) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(directory)) != NULL) {
-        size_t len = strlen(entry->d_name);
-        int i;
-        for (i = 0; i < len; i++) {
-            if (!isdigit(entry->d_name[i])) {
+/* parseAgo func parses a time ago like "90", "10m", "2h" or "7d"
+ * Parameters:
+ * - the string and where it ends
+ * - pointer to int64_t to which the milliseconds will be written
+ *
+ * Returns false if it is not a valid time
+ * */
+bool parseAgo(const char *str, const char *end, int64_t *ms) {
+    char *unit;
+    double value = strtod(str, &unit);
+    if (unit == str || value < 0) {
+        return false;
+    }
+    double scale = 1000;
+    if (unit < end) {
+        switch (*unit++) {
+            case 's':
                 break;
-            }
+            case 'm':
+                scale = 60000;
+                break;
+            case 'h':
+                scale = 3600000;
+                break;
+            case 'd':
+                scale = 86400000;
+                break;
+            default:
+                return false;
         }
+    }
+    if (unit != end) {
+        return false;
+    }
+    *ms = (int64_t) (value * scale);
+    return true;
+}
+
+/* parseRange func parses the range of --query: "from[,to]", both times ago,
+ * to is now by default
+ * Parameters:
+ * - the range
+ * - pointers to int64_t to which the ms ago of from and to will be written
+ *
+ * Returns false if it is not a valid range
+ * */
+bool parseRange(const char *range, int64_t *fromAgo, int64_t *toAgo) {
+    const char *comma = strchr(range, ',');
+    *toAgo = 0;
+    if (comma == NULL) {
+        return parseAgo(range, range + strlen(range), fromAgo);
+    }
+    return parseAgo(range, comma, fromAgo) && parseAgo(comma + 1, comma + strlen(comma), toAgo)
+            && *toAgo <= *fromAgo;
+}
 
-        bool allInt = i ? true : false;
+/* outTime func appends a time as local "YYYY-MM-DD HH:MM:SS"
+ * Parameters:
+ * - the time, in ms since the epoch
+ *
+ * */
+void outTime(int64_t time) {
+    time_t seconds = (time_t) (time / 1000);
+    struct tm local;
+    char str[32];
+    localtime_r(&seconds, &local);
+    outBytes(str, strftime(str, sizeof(str), "%Y-%m-%d %H:%M:%S", &local));
+}
 
-        //if file in /proc has all digit name and is a folder
-        if (allInt && entry->d_type == DT_DIR) {
-            // open /tasks directory and count all the all digit folder inside to count num of tasks
-            int taskCount = 0;
-            char *taskPath = malloc(strlen(entry->d_name) + strlen("/task") + 1);
-            strcpy(taskPath, entry->d_name);
-            strcat(taskPath, "/task");
+/* historyQuery func prints the history between two times. The finest tier
+ * that still goes back to the start of the range is used, and the first
+ * slot is found with a binary search, so only the printed slots are read
+ * Parameters:
+ * - the history
+ * - ms ago the range starts and ends at
+ * - text or JSON
+ *
+ * */
+void historyQuery(const struct history *history, int64_t fromAgo, int64_t toAgo, enum output_format format) {
+
+    // text shows the main values, JSON all of them
+    static const struct {
+        enum history_metric metric;
+        const char *title;
+        int decimals;
+        int width;
+    } columns[] = {
+        { HM_LOAD1, "Load 1m", 2, 7 },
+        { HM_BUSY, "CPU %", 1, 6 },
+        { HM_IOWAIT, "IOwait %", 1, 8 },
+        { HM_MEMORY, "Mem %", 1, 6 },
+        { HM_CTXT_RATE, "Ctxt/s", 0, 9 },
+        { HM_INTR_RATE, "Intr/s", 0, 9 },
+        { HM_FORK_RATE, "Forks/s", 1, 8 },
+    };
+    const size_t numColumns = sizeof(columns) / sizeof(columns[0]);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t nowMs = (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    int64_t from = nowMs - fromAgo;
+    int64_t to = nowMs - toAgo;
+
+    enum history_tier tier = TIER_HOUR;
+    for (int i = TIER_RAW; i < TIER_HOUR; i++) {
+        const struct history_tier_info *info = &history->header->tiers[i];
+        if (info->written > info->slots && slotStart(history, i, info->written - info->slots) > from) {
+            continue;
+        }
+        tier = i;
+        break;
+    }
+    const struct history_tier_info *info = &history->header->tiers[tier];
+    bool json = format == OUT_JSON;
+
+    if (!json) {
+        outStr("History (");
+        outStr(tierNames[tier]);
+        outStr(")\n");
+        outStr("               Time");
+        if (tier != TIER_RAW) {
+            outStr(" |  Samples");
+        }
+        for (size_t c = 0; c < numColumns; c++) {
+            outStr(" | ");
+            if (tier == TIER_RAW) {
+                outPadded(columns[c].title, strlen(columns[c].title), columns[c].width);
+            } else {
+                char title[32];
+                int len = snprintf(title, sizeof(title), "%s avg/max", columns[c].title);
+                outPadded(title, len, columns[c].width * 2 + 1);
+            }
+        }
+        outStr("\n");
+    }
 
-            DIR *dir;
+    for (uint64_t n = historyFirst(history, tier, from); n < info->written; n++) {
+        if (slotStart(history, tier, n) > to) {
+            break;
+        }
 
-            if ((dir = opendir(taskPath)) != NULL) {
-                struct dirent *tasks;
-                while ((tasks = readdir(dir)) != NULL) {
-                    size_t len = strlen(tasks->d_name);
-                    int i;
-                    for (i = 0; i < len; i++) {
-                        if (!isdigit(tasks->d_name[i])) {
-                            break;
-                        }
-                    }
-                    bool allInteger = i ? true : false;
-                    // only if name is all digit and a folder
-                    if (allInteger && tasks->d_type == DT_DIR) {
-                        taskCount++;
-                    }
-                }
+        const float *min;
+        const float *max;
+        float avg[HM_COUNT];
+        uint32_t count = 1;
+        int64_t start;
+        if (tier == TIER_RAW) {
+            const struct history_sample *sample = historySlot(history, tier, n);
+            start = sample->time;
+            min = max = sample->value;
+            memcpy(avg, sample->value, sizeof(avg));
+        } else {
+            const struct history_rollup *rollup = historySlot(history, tier, n);
+            start = rollup->start;
+            count = rollup->count;
+            min = rollup->min;
+            max = rollup->max;
+            for (int m = 0; m < HM_COUNT; m++) {
+                avg[m] = rollup->sum[m] / (count ? count : 1);
             }
+        }
 
-            closedir(dir);
-
-            //get info about each task in /proc/[pid]/stat
-            char *pidPath = malloc(strlen(entry->d_name) + strlen("/stat") + 1);
-            strcpy(pidPath, entry->d_name);
-            strcat(pidPath, "/stat");
-            char statFile[100000];
-            readFile(pidPath, statFile);
-            char *next_tok = statFile;
-            char *curr_tok;
-            int count = 0;
-            char *sysCall = calloc(25, sizeof(char));
-            char *tempState = malloc(3 * sizeof(char));
-            while ((curr_tok = next_token(&next_tok, " ()")) != NULL) {
-                if (count < 1) {
-                    count++;
-                } else if (count < 3) {
-                    // task name
-                    if (count == 1) {
-                        //if larger than 25 bytes
-                        if (strlen(curr_tok) > 25) {
-                            strncpy(sysCall, curr_tok, 25);
-                        } else {
-                            strcpy(sysCall, curr_tok);
-                        }
-                    }
-                    // state
-                    if (count == 2) {
-                        strcpy(tempState, curr_tok);
-                    }
-                    if (count >= 3) {
-                        break;
-                    }
-                    count++;
+        if (json) {
+            jsonBegin("history", start / 1e3);
+            jsonKey("tier");
+            outJsonStr(tierNames[tier]);
+            jsonKey("samples");
+            outUInt(count);
+            for (int m = 0; m < HM_COUNT; m++) {
+                jsonKey(historyKeys[m]);
+                if (tier == TIER_RAW) {
+                    outFixed(avg[m], 2, 0);
+                    continue;
+                }
+                outStr("{\"min\":");
+                outFixed(min[m], 2, 0);
+                outStr(",\"max\":");
+                outFixed(max[m], 2, 0);
+                outStr(",\"avg\":");
+                outFixed(avg[m], 2, 0);
+                outStr("}");
+            }
+            jsonEnd();
+        } else {
+            outTime(start);
+            if (tier != TIER_RAW) {
+                outStr(" | ");
+                outInt(count, 8);
+            }
+            for (size_t c = 0; c < numColumns; c++) {
+                outStr(" | ");
+                outFixed(avg[columns[c].metric], columns[c].decimals, columns[c].width);
+                if (tier != TIER_RAW) {
+                    outStr("/");
+                    outFixed(max[columns[c].metric], columns[c].decimals, columns[c].width);
                 }
             }
+            outStr("\n");
+        }
+
+        if (out.len >= OUT_FLUSH_SZ) {
+            outFlush();
+        }
+    }
 
-            // get process name
-            struct stat *buf = malloc(100* sizeof(struct stat));
-            stat(entry->d_name, buf);
-            char *userName = calloc(15, sizeof(char));
-            struct passwd *pwd = getpwuid(buf->st_uid);
+    outFlush();
+}
 
-            // if larger than 15 bytes
-            if (strlen(pwd->pw_name) > 15) {
-                strncpy(userName, pwd->pw_name, 15);
-            } else {
-                strcpy(userName, pwd->pw_name);
-            }
+/* parsePidList func parses the pids of --pid, separated by commas
+ * Parameters:
+ * - the list
+ * - pointer to task_filter struct to which the sorted pids will be written
+ *
+ * Returns false if the list is not valid
+ * */
+bool parsePidList(const char *list, struct task_filter *filter) {
+
+    size_t capacity = 16;
+    int *pids = malloc(capacity * sizeof(int));
+    size_t count = 0;
+
+    const char *next = list;
+    while (true) {
+        char *end;
+        long pid = strtol(next, &end, 10);
+        if (end == next || pid < 1 || pid > INT_MAX || (*end != ',' && *end != '\0')) {
+            free(pids);
+            return false;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            pids = realloc(pids, capacity * sizeof(int));
+        }
+        pids[count++] = (int) pid;
+        if (*end == '\0') {
+            break;
+        }
+        next = end + 1;
+    }
 
+    qsort(pids, count, sizeof(int), compareInts);
 
-            char state[15];
-
-            // proper state name
-            if (strcmp(tempState, "S") == 0) {
-                strcpy(state, "sleeping");
-            } else if (strcmp(tempState, "R") == 0) {
-                strcpy(state, "running");
-            } else if (strcmp(tempState, "I") == 0) {
-                strcpy(state, "idle");
-            } else if (strcmp(tempState, "X") == 0) {
-                strcpy(state, "dead");
-            } else if (strcmp(tempState, "Z") == 0) {
-                strcpy(state, "zombie");
-            } else if (strcmp(tempState, "T") == 0) {
-                strcpy(state, "tracing stop");
-            } else if (strcmp(tempState, "D") == 0) {
-                strcpy(state, "disk sleep");
-            }
+    free(filter->pids);
+    filter->pids = pids;
+    filter->numPids = count;
+
+    return true;
+}
 
-            printf("%5s | %12s | %25s | %15s | %d \n", entry->d_name, state, sysCall, userName, taskCount);
+/* parseUser func parses the user of -u, a user name or a uid
+ * Parameters:
+ * - the user
+ * - pointer to task_filter struct to which the uid will be written
+ *
+ * Returns false if there is no such user
+ * */
+bool parseUser(const char *user, struct task_filter *filter) {
+
+    struct passwd pwd;
+    struct passwd *result = NULL;
+    char pwdBuf[1024];
+    if (getpwnam_r(user, &pwd, pwdBuf, sizeof(pwdBuf), &result) == 0 && result != NULL) {
+        filter->uid = result->pw_uid;
+        filter->byUser = true;
+        return true;
+    }
+
+    char *end;
+    long uid = strtol(user, &end, 10);
+    if (end == user || *end != '\0' || uid < 0) {
+        return false;
+    }
+    filter->uid = (uid_t) uid;
+    filter->byUser = true;
+
+    return true;
+}
 
-            //free allocated memory
-            free(buf);
-            free(sysCall);
-            free(tempState);
-            free(userName);
-            free(taskPath);
-            free(pidPath);
+/* parseColumns func parses the comma separated columns of -O. cmdline has
+ * no width, so it is moved to the end (once) where it can not push the
+ * columns after it out of line
+ * Parameters:
+ * - the list, like "pid,user,cmdline"
+ * - pointer to run_opts struct to which the columns will be written
+ *
+ * Returns false if a column is unknown or there are too many
+ * */
+bool parseColumns(const char *list, struct run_opts *run) {
+    run->numColumns = 0;
+    while (true) {
+        size_t len = strcspn(list, ",");
+        int found = COL_COUNT;
+        for (int i = 0; i < COL_COUNT; i++) {
+            if (strlen(columns[i].name) == len && memcmp(list, columns[i].name, len) == 0) {
+                found = i;
+            }
+        }
+        if (found == COL_COUNT || run->numColumns == MAX_COLUMNS) {
+            return false;
+        }
+        run->columns[run->numColumns++] = found;
+        if (list[len] == '\0') {
+            break;
+        }
+        list += len + 1;
+    }
 
+    // the other columns keep their order
+    size_t kept = 0;
+    for (size_t c = 0; c < run->numColumns; c++) {
+        if (run->columns[c] != COL_CMDLINE) {
+            run->columns[kept++] = run->columns[c];
         }
+    }
+    if (kept < run->numColumns) {
+        run->columns[kept++] = COL_CMDLINE;
+    }
+    run->numColumns = kept;
+
+    return true;
+}
+
+/* Column the task list is sorted by, for compareTasks() */
+static enum sort_key taskSortKey = SORT_PID;
 
+/* compares two task_info structs by the taskSortKey column, used to sort the
+ * task list. Numbers other than the pid go largest first, ties go by pid.
+ * Returns < 0 if a comes first */
+int compareTasks(const void *a, const void *b) {
+    const struct task_info *t1 = a;
+    const struct task_info *t2 = b;
+    int result = 0;
+
+    switch (taskSortKey) {
+        case SORT_STATE:
+            result = strcmp(t1->state, t2->state);
+            break;
+        case SORT_NAME:
+            result = strcmp(t1->name, t2->name);
+            break;
+        case SORT_USER:
+            result = strcmp(t1->user, t2->user);
+            break;
+        case SORT_TASKS:
+            result = (t1->tasks < t2->tasks) - (t1->tasks > t2->tasks);
+            break;
+        case SORT_CPU:
+            result = (t1->cpuPercent < t2->cpuPercent) - (t1->cpuPercent > t2->cpuPercent);
+            break;
+        case SORT_RSS:
+            result = (t1->rssKB < t2->rssKB) - (t1->rssKB > t2->rssKB);
+            break;
+        case SORT_VSZ:
+            result = (t1->vszKB < t2->vszKB) - (t1->vszKB > t2->vszKB);
+            break;
+        default:
+            break;
     }
 
-    closedir(directory);
+    if (result == 0) {
+        result = (t1->pid > t2->pid) - (t1->pid < t2->pid);
+    }
+    return result;
+}
 
+/* siftDown func restores the heap order below one node of a heap of task
+ * indexes. The root is the task that comes last in sort order, so it is the
+ * first one to be dropped when a better task comes
+ * Parameters:
+ * - the heap and the number of indexes in it
+ * - index in the heap of the node that may be out of place
+ * - the tasks the indexes point to
+ *
+ * */
+void siftDown(size_t *heap, size_t count, size_t i, const struct task_info *tasks) {
+    while (true) {
+        size_t worst = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < count && compareTasks(&tasks[heap[left]], &tasks[heap[worst]]) > 0) {
+            worst = left;
+        }
+        if (right < count && compareTasks(&tasks[heap[right]], &tasks[heap[worst]]) > 0) {
+            worst = right;
+        }
+        if (worst == i) {
+            return;
+        }
+        size_t swap = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = swap;
+        i = worst;
+    }
 }
 
 /**
- * Retrieves the next token from a string.
+ * sortTasks puts the tasks that are shown at the front of the pool in sort
+ * order and drops the rest (and the processes that were gone). With a top the
+ * first tasks are picked with a heap of 'top' indexes in one pass, only they
+ * are sorted and printed: the work is O(P log N) for P processes. The pool
+ * still holds all P tasks, the memory is O(P).
+ * Parameters:
+ * - the tasks, from collectTasks(); count becomes the number shown
+ * - column to sort by
+ * - number of tasks to keep, 0 for all
+ *
+ */
+void sortTasks(struct task_pool *pool, enum sort_key key, size_t top) {
+
+    taskSortKey = key;
+
+    // drop the processes that could not be read or are filtered out
+    size_t count = 0;
+    for (size_t i = 0; i < pool->count; i++) {
+        if (pool->tasks[i].valid && pool->tasks[i].shown) {
+            pool->tasks[count++] = pool->tasks[i];
+        }
+    }
+    pool->count = count;
+
+    if (top == 0 || top >= count) {
+        qsort(pool->tasks, count, sizeof(struct task_info), compareTasks);
+        return;
+    }
+
+    size_t *heap = malloc(top * sizeof(size_t));
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (used < top) {
+            // fill the heap, it is put in order once it is full
+            heap[used++] = i;
+            if (used == top) {
+                for (size_t j = top / 2; j-- > 0;) {
+                    siftDown(heap, top, j, pool->tasks);
+                }
+            }
+        } else if (compareTasks(&pool->tasks[i], &pool->tasks[heap[0]]) < 0) {
+            heap[0] = i;
+            siftDown(heap, top, 0, pool->tasks);
+        }
+    }
+
+    struct task_info *shown = malloc(top * sizeof(struct task_info));
+    for (size_t i = 0; i < top; i++) {
+        shown[i] = pool->tasks[heap[i]];
+    }
+    qsort(shown, top, sizeof(struct task_info), compareTasks);
+    memcpy(pool->tasks, shown, top * sizeof(struct task_info));
+    pool->count = top;
+
+    free(shown);
+    free(heap);
+}
+
+/* taskSources func works out what the task list has to read about every
+ * process: the union of what its columns and the sort column need
+ * Parameters:
+ * - pointer to the run settings
  *
+ * Returns task_source bits
+ * */
+unsigned taskSources(const struct run_opts *run) {
+    unsigned sources = TS_DIR | sortKeySources[run->sortKey];
+    for (size_t i = 0; i < run->numColumns; i++) {
+        sources |= columns[run->columns[i]].sources;
+    }
+    return sources;
+}
+
+/* taskValue func gets one column of a task, as a string or as a number
  * Parameters:
- * - str_ptr: maintains context in the string, i.e., where the next token in the
- *   string will be. If the function returns token N, then str_ptr will be
- *   updated to point to token N+1. To initialize, declare a char * that points
- *   to the string being tokenized. The pointer will be updated after each
- *   successive call to next_token.
+ * - the task
+ * - the column
+ * - pointer to which a string column is written, NULL for a number
+ * - pointer to which a number column is written
  *
- * - delim: the set of characters to use as delimiters
+ * Returns false if the value is not there, like the io of a process of
+ * another user
+ * */
+bool taskValue(const struct task_info *task, enum task_column column, const char **str, double *number) {
+    *str = NULL;
+    switch (column) {
+        case COL_PID:
+            *number = task->pid;
+            return true;
+        case COL_PPID:
+            *number = task->ppid;
+            return task->ppid >= 0;
+        case COL_COMM:
+            *str = task->name;
+            return true;
+        case COL_USER:
+            *str = task->user;
+            return task->user != NULL;
+        case COL_UID:
+            *number = task->uid;
+            return true;
+        case COL_STATE:
+            *str = task->state;
+            return true;
+        case COL_THREADS:
+            *number = task->tasks;
+            return true;
+        case COL_CPU:
+            *number = task->cpuPercent;
+            return task->cpuPercent >= 0;
+        case COL_RSS:
+            *number = (double) task->rssKB;
+            return true;
+        case COL_VSZ:
+            *number = (double) task->vszKB;
+            return true;
+        case COL_SWAP:
+            *number = (double) task->swapKB;
+            return task->swapKB >= 0;
+        case COL_PSS:
+            *number = (double) task->pssKB;
+            return task->pssKB >= 0;
+        case COL_READ:
+            *number = (double) task->readKB;
+            return task->readKB >= 0;
+        case COL_WRITE:
+            *number = (double) task->writeKB;
+            return task->writeKB >= 0;
+        case COL_FDS:
+            *number = task->fds;
+            return task->fds >= 0;
+        case COL_CMDLINE:
+            *str = task->cmdline;
+            return task->cmdline != NULL;
+        default:
+            return false;
+    }
+}
+
+/**
+ * taskList renders the task list with the columns of -O (by default pid,
+ * state, task name, user, num of tasks, %CPU, resident and virtual memory).
+ * Values that could not be read are shown as '-'
+ * Parameters:
+ * - the tasks, from collectTasks()
+ * - the run settings, with the columns
  *
- * Returns: char pointer to the next token in the string.
  */
-char *next_token(char **str_ptr, const char *delim)  {
-    if (*str_ptr == NULL) {
-        return NULL;
-    }
+void taskList(const struct task_pool *pool, const struct run_opts *run) {
+    static const char dashes[] = "--------------------------------";
 
-    size_t tok_start = strspn(*str_ptr, delim);
-    size_t tok_end = strcspn(*str_ptr + tok_start, delim);
+    for (size_t c = 0; c < run->numColumns; c++) {
+        const struct column_info *column = &columns[run->columns[c]];
+        outStr(c > 0 ? " | " : "");
+        outPadded(column->header, strlen(column->header), column->width);
+    }
+    outStr("\n");
+    for (size_t c = 0; c < run->numColumns; c++) {
+        const struct column_info *column = &columns[run->columns[c]];
+        size_t len = strlen(column->header);
+        size_t width = (size_t) column->width > len ? (size_t) column->width : len;
+        width += (c > 0) + (c + 1 < run->numColumns);
+        outStr(c > 0 ? "+" : "");
+        while (width > 0) {
+            size_t piece = width < sizeof(dashes) - 1 ? width : sizeof(dashes) - 1;
+            outBytes(dashes, piece);
+            width -= piece;
+        }
+    }
+    outStr("\n");
 
-    /* Zero length token. We must be finished. */
-    if (tok_end  <= 0) {
-        *str_ptr = NULL;
-        return NULL;
+    for (size_t i = 0; i < pool->count; i++) {
+        const struct task_info *task = &pool->tasks[i];
+        if (!task->valid) {
+            continue;
+        }
+        for (size_t c = 0; c < run->numColumns; c++) {
+            const struct column_info *column = &columns[run->columns[c]];
+            const char *str;
+            double number;
+            outStr(c > 0 ? " | " : "");
+            if (!taskValue(task, run->columns[c], &str, &number)) {
+                outPadded("-", 1, column->width);
+            } else if (str != NULL) {
+                // strings are cut to the width of their column (user names
+                // to 15 bytes), cmdline has none and is never cut
+                size_t len = column->width > 0 ? strnlen(str, column->width) : strlen(str);
+                outPrintable(str, len, column->width);
+            } else if (column->decimals > 0) {
+                outFixed(number, column->decimals, column->width);
+            } else {
+                outInt((long long) number, column->width);
+            }
+        }
+        outStr("\n");
     }
 
-    /* Take note of the start of the current token. We'll return it later. */
-    char *current_ptr = *str_ptr + tok_start;
+}
 
-    /* Shift pointer forward (to the end of the current token) */
-    *str_ptr += tok_start + tok_end;
+/**
+ * taskListJson writes one JSON object per task with the columns of -O,
+ * values that could not be read are null. The output is written out every
+ * OUT_FLUSH_SZ bytes, so memory does not grow with the number of tasks
+ * Parameters:
+ * - the tasks, from collectTasks()
+ * - the run settings, with the columns
+ * - time of the sample
+ *
+ */
+void taskListJson(const struct task_pool *pool, const struct run_opts *run, double time) {
 
-    if (**str_ptr == '\0') {
-        /* If the end of the current token is also the end of the string, we
-         * must be at the last token. */
-        *str_ptr = NULL;
-    } else {
-        /* Replace the matching delimiter with a NUL character to terminate the
-         * token string. */
-        **str_ptr = '\0';
+    for (size_t i = 0; i < pool->count; i++) {
+        const struct task_info *task = &pool->tasks[i];
+        if (!task->valid) {
+            continue;
+        }
+        jsonBegin("task", time);
+        for (size_t c = 0; c < run->numColumns; c++) {
+            const struct column_info *column = &columns[run->columns[c]];
+            const char *str;
+            double number;
+            jsonKey(column->jsonKey);
+            if (!taskValue(task, run->columns[c], &str, &number)) {
+                outStr("null");
+            } else if (str != NULL) {
+                outJsonStr(str);
+            } else if (column->decimals > 0) {
+                outFixed(number, column->decimals, 0);
+            } else {
+                outInt((long long) number, 0);
+            }
+        }
+        jsonEnd();
 
-        /* Shift forward one character over the newly-placed NUL so that
-         * next_pointer now points at the first character of the next token. */
-        (*str_ptr)++;
+        if (out.len >= OUT_FLUSH_SZ) {
+            outFlush();
+        }
+    }
+
+}
+
+/**
+ * taskListMetrics renders the task list as OpenMetrics: one family per
+ * number column of -O, with a sample for every task labelled by the other
+ * columns (pid, name, user and state by default). The pid label is there
+ * even when -O leaves it out, else two tasks could have the same label set.
+ * Tasks without the value have no sample
+ */
+void taskListMetrics(const struct task_pool *pool, const struct run_opts *run) {
+
+    bool shown[COL_COUNT] = { false };
+    for (size_t c = 0; c < run->numColumns; c++) {
+        shown[run->columns[c]] = true;
     }
 
-    return current_ptr;
+    for (int f = 0; f < COL_COUNT; f++) {
+        const struct column_info *family = &columns[f];
+        if (!shown[f] || family->metric == NULL) {
+            continue;
+        }
+        bool counter = strcmp(family->metricType, "counter") == 0;
+        metricFamily(family->metric, family->metricType, family->help);
+        for (size_t i = 0; i < pool->count; i++) {
+            const struct task_info *task = &pool->tasks[i];
+            const char *str;
+            double value;
+            if (!task->valid || !taskValue(task, f, &str, &value)) {
+                continue;
+            }
+            outStr(family->metric);
+            outStr(counter ? "_total{" : "{");
+            bool first = true;
+            for (int l = 0; l < COL_COUNT; l++) {
+                const char *label;
+                double number;
+                if ((!shown[l] && l != COL_PID) || columns[l].metric != NULL
+                        || !taskValue(task, l, &label, &number)) {
+                    continue;
+                }
+                outStr(first ? "" : ",");
+                outStr(columns[l].jsonKey);
+                outStr("=");
+                if (label != NULL) {
+                    outLabelStr(label);
+                } else {
+                    outStr("\"");
+                    outInt((long long) number, 0);
+                    outStr("\"");
+                }
+                first = false;
+            }
+            outStr("}");
+            outMetric(value * family->metricScale, family->decimals);
+        }
+    }
 }
@@ -0,0 +1,87 @@
+#ifndef INSPECTOR_H
+#define INSPECTOR_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * libinspector collects what the inspector program shows (system and
+ * hardware information, the list of processes) and returns it in structs,
+ * so another program can sample in process: no fork, exec or parsing of
+ * text. The inspector program prints these on top of the same collectors.
+ *
+ * Functions return 0 on success and -1 with errno set on error, ENOMEM when
+ * out of memory: the library does not exit or abort the program. The
+ * structs are only ever extended at the end, INSPECTOR_API_VERSION goes up
+ * when they are.
+ */
+
+#define INSPECTOR_API_VERSION 1
+
+/* An open proc file system. Only one can be open at a time, and it must
+ * not be used by two threads at once */
+struct inspector;
+
+/* An iteration over the processes, from inspector_procs_open() */
+struct inspector_procs;
+
+/* Host name, kernel version and uptime */
+struct inspector_system {
+    char hostname[256];
+    char kernel[256];
+    long uptime;
+};
+
+/* CPU, load and memory. cpuUsage is the busy percentage of all the cpus
+ * since the previous call of inspector_hardware(), NaN on the first call */
+struct inspector_hardware {
+    char cpuModel[100];
+    int numCpus;
+    double load[3];
+    double cpuUsage;
+    unsigned long long memTotalKB;
+    unsigned long long memActiveKB;
+};
+
+/* One process. cpuPercent is the share of one cpu it used since the
+ * previous iteration (or over its life, if it started since), -1 on the
+ * first iteration after inspector_open(). user points into the
+ * inspector and stays valid until inspector_close() */
+struct inspector_process {
+    int pid;
+    char state[15];
+    char name[26];
+    uid_t uid;
+    const char *user;
+    int threads;
+    double cpuPercent;
+    unsigned long long rssKB;
+    unsigned long long vszKB;
+    unsigned long long startTime;
+};
+
+/* inspector_open opens a proc file system, NULL for /proc. Returns NULL
+ * with errno set on error, EBUSY if one is already open */
+struct inspector *inspector_open(const char *procDir);
+
+/* inspector_close closes the proc file system and frees everything */
+void inspector_close(struct inspector *inspector);
+
+/* inspector_system fills in the system information */
+int inspector_system(struct inspector *inspector, struct inspector_system *system);
+
+/* inspector_hardware fills in the hardware information */
+int inspector_hardware(struct inspector *inspector, struct inspector_hardware *hardware);
+
+/* inspector_procs_open takes a snapshot of all the processes, read with
+ * inspector_procs_next() in the order proc lists them. Returns NULL with
+ * errno set on error */
+struct inspector_procs *inspector_procs_open(struct inspector *inspector);
+
+/* inspector_procs_next fills in the next process, returns false at the end */
+bool inspector_procs_next(struct inspector_procs *procs, struct inspector_process *process);
+
+/* inspector_procs_close frees the snapshot of the processes */
+void inspector_procs_close(struct inspector_procs *procs);
+
+#endif
@@ -0,0 +1,2738 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_BLOCK 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_BLOCK 16
+#endif
+
+#include "inspector.h"
+#include "libinspector.h"
+
+const char *procFileNames[PF_COUNT] = {
+    "sys/kernel/hostname",
+    "sys/kernel/osrelease",
+    "uptime",
+    "stat",
+    "cpuinfo",
+    "loadavg",
+    "meminfo",
+};
+
+/* Files of a [pid] directory behind the sources that are files */
+const struct pid_source_file pidSourceFiles[PID_SOURCE_FILES] = {
+    { TS_STATUS, "status" },
+    { TS_CMDLINE, "cmdline" },
+    { TS_IO, "io" },
+    { TS_SMAPS, "smaps_rollup" },
+};
+
+/* Descriptor of the proc directory itself */
+int procDirFd = -1;
+
+/* Descriptors of the files above, -1 until they are first needed */
+static int procFds[PF_COUNT] = { -1, -1, -1, -1, -1, -1, -1 };
+
+/* Where user names are looked up before falling back to getpwuid_r() */
+#define PASSWD_FILE "/etc/passwd"
+
+/* Size of each block of memory user names are interned into */
+#define NAME_POOL_SZ 4096
+
+/* Buffers the files above are read into */
+struct read_buf procBufs[PF_COUNT];
+
+/* Name of the file in the runtime directory the last cpu sample is kept in */
+#define CPU_STATE_FILE "inspector-cpu.state"
+
+/* Seconds an earlier cpu sample stays usable: newer ones are too noisy,
+ * older ones are not "current" anymore */
+#define CPU_SAMPLE_MIN_AGE 0.1
+#define CPU_SAMPLE_MAX_AGE 60
+
+/* Set in replay mode: everything is read from replayArchive instead of proc */
+bool replaying = false;
+
+_Thread_local struct io_stats ioStats;
+
+/* Counters of the threads that are done, see foldIoStats() */
+static struct io_stats foldedStats;
+static pthread_mutex_t foldedLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct archive_reader replayArchive;
+
+/* Number of pids a worker thread takes from the queue at once */
+#define TASK_BATCH 16
+
+/* One process of the process table. The table owns task.cmdline, it is
+ * handed on to the next table while the process lives */
+struct proc_entry {
+    bool used;
+    struct task_info task;
+};
+
+/* Every process seen by a scan of the task list, keyed by pid. The entry of
+ * a pid is only used for the next scan if the start time still matches, so a
+ * reused pid is a new process. Open addressing, the capacity is always a
+ * power of 2 and at least twice the count. 'time' is CLOCK_MONOTONIC when the
+ * scan started */
+struct proc_table {
+    struct proc_entry *entries;
+    size_t capacity;
+    size_t count;
+    struct timespec time;
+    bool valid;
+};
+
+/* One slot of the uid -> user name hash table */
+struct user_entry {
+    uid_t uid;
+    bool used;
+    const char *name;
+};
+
+/* Block of memory holding interned user names. Blocks are chained and never
+ * moved, so names handed out stay valid until freeUsers() */
+struct name_pool {
+    struct name_pool *next;
+    size_t used;
+    char names[NAME_POOL_SZ];
+};
+
+/* Cache of user names, filled from PASSWD_FILE once and then from
+ * getpwuid_r() for the uids that are not there. Unknown uids are cached as
+ * their number. Open addressing, the capacity is always a power of 2 */
+struct user_cache {
+    struct user_entry *entries;
+    size_t capacity;
+    size_t count;
+    struct name_pool *pool;
+    bool loaded;
+    pthread_rwlock_t lock;
+};
+
+/* Function prototypes */
+void cpuModel(char *cpuModel);
+bool findModelName(const char *chunk, size_t len, void *ctx);
+void loadAver(char *loadAverage);
+void cpuUsage(const struct cpu_times *times, long int *result);
+const char *parseCpuLine(const char *line, const char *end, struct cpu_times *times);
+void freeStat(struct stat_snapshot *stat);
+ssize_t readAll(int fd, struct read_buf *buf);
+int openProcFile(enum proc_file file);
+ssize_t readAt(int dirFd, const char *filepath, struct read_buf *buf);
+const struct archive_entry *archiveFind(const char *path);
+const char *archiveText(const char *path, size_t *len);
+bool pidOwner(const char *pidName, uid_t *uid);
+const char *readProcPath(const char *path, struct read_buf *buf, size_t *len);
+const char *userName(uid_t uid);
+struct proc_entry *procSlot(struct proc_table *table, int pid);
+const struct task_info *knownTask(int pid);
+void stateName(char state, char *name);
+void setTaskCounters(struct task_info *info, const struct pid_stat *stat);
+void updateProcTable(struct task_pool *pool);
+void readTaskFiles(struct pid_dir *dir, struct task_info *info, unsigned sources, struct read_buf *buf);
+bool collectTask(int pid, struct task_info *info, const struct task_info *known,
+        const struct task_filter *filter, unsigned sources, struct read_buf *buf);
+bool pidWanted(const struct task_filter *filter, int pid);
+bool taskWanted(const struct task_filter *filter, const struct task_info *info, char state);
+void collectBatches(struct task_pool *pool, struct read_buf *buf);
+void *taskWorker(void *arg);
+
+/* Where procFailed() jumps to while a function of inspector.h is running */
+static jmp_buf *apiFailure = NULL;
+
+/* procFailed func handles a system wide file in proc that can not be read.
+ * The program can not do without them, so it exits; inside a function of
+ * inspector.h the error is returned to the caller instead.
+ * Parameters:
+ * - what failed, for the error message
+ *
+ * */
+void procFailed(const char *what) {
+    if (apiFailure != NULL) {
+        longjmp(*apiFailure, errno != 0 ? errno : EIO);
+    }
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+/* openProcFile func returns the descriptor of one of the system wide files in
+ * proc. The file is opened the first time it is needed and then kept open, so
+ * the watch mode does not have to open it again on every refresh.
+ * Parameters:
+ * - which file to open
+ *
+ * */
+int openProcFile(enum proc_file file) {
+
+    if (procFds[file] == -1) {
+        procFds[file] = openat(procDirFd, procFileNames[file], O_RDONLY);
+        ioStats.opens++;
+        if (procFds[file] == -1) {
+            procFailed("open");
+        }
+    }
+
+    return procFds[file];
+}
+
+/* closeProcFiles func closes all the system wide files that were opened
+ *
+ * */
+void closeProcFiles() {
+    for (int i = 0; i < PF_COUNT; i++) {
+        if (procFds[i] != -1) {
+            close(procFds[i]);
+            procFds[i] = -1;
+        }
+        freeBuf(&procBufs[i]);
+    }
+}
+
+/* addIoStats func adds one set of counters to another
+ * Parameters:
+ * - the counters that are added to
+ * - the counters that are added
+ *
+ * */
+static void addIoStats(struct io_stats *total, const struct io_stats *stats) {
+    total->opens += stats->opens;
+    total->reads += stats->reads;
+    total->bytesRead += stats->bytesRead;
+    total->getdents += stats->getdents;
+    total->stats += stats->stats;
+    total->userLookups += stats->userLookups;
+    total->passwdLookups += stats->passwdLookups;
+}
+
+/* foldIoStats func hands the counters of the calling thread over to
+ * takeIoStats(), worker threads call it before they exit
+ *
+ * */
+void foldIoStats() {
+    pthread_mutex_lock(&foldedLock);
+    addIoStats(&foldedStats, &ioStats);
+    pthread_mutex_unlock(&foldedLock);
+    memset(&ioStats, 0, sizeof(ioStats));
+}
+
+/* takeIoStats func returns what the calling thread and the finished worker
+ * threads counted since the last call, and starts counting from 0 again
+ * Parameters:
+ * - pointer to io_stats struct that will be filled
+ *
+ * */
+void takeIoStats(struct io_stats *stats) {
+    pthread_mutex_lock(&foldedLock);
+    *stats = foldedStats;
+    memset(&foldedStats, 0, sizeof(foldedStats));
+    pthread_mutex_unlock(&foldedLock);
+    addIoStats(stats, &ioStats);
+    memset(&ioStats, 0, sizeof(ioStats));
+}
+
+/* growBuf func makes sure a read_buf has room for at least 'need' bytes
+ * Parameters:
+ * - pointer to the buffer
+ * - number of bytes needed
+ *
+ * */
+void growBuf(struct read_buf *buf, size_t need) {
+
+    if (need <= buf->cap) {
+        return;
+    }
+
+    size_t cap = buf->cap ? buf->cap : READ_CHUNK_SZ;
+    while (cap < need) {
+        cap *= 2;
+    }
+
+    char *data = realloc(buf->data, cap);
+    if (data == NULL) {
+        procFailed("realloc");
+    }
+    buf->data = data;
+    buf->cap = cap;
+
+}
+
+/* resizeArray func reallocs an array that grows with what proc has (cpus,
+ * pids). When there is no memory it fails like an unreadable proc file, see
+ * procFailed(); the array is then left as it was.
+ * Parameters:
+ * - the array, NULL for a new one
+ * - its new size in bytes
+ *
+ * Returns the resized array
+ * */
+void *resizeArray(void *array, size_t size) {
+    void *resized = realloc(array, size);
+    if (resized == NULL) {
+        procFailed("realloc");
+    }
+    return resized;
+}
+
+/* freeBuf func frees the memory of a read_buf, it can be used again after
+ * Parameters:
+ * - pointer to the buffer
+ *
+ * */
+void freeBuf(struct read_buf *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+/* readAll func reads a whole file from the beginning (with pread(), so the
+ * descriptor can be reused) into a read_buf, growing it as needed, and
+ * terminates it with NUL
+ * Parameters:
+ * - file descriptor
+ * - pointer to the buffer, its old content is replaced
+ *
+ * Returns number of bytes read, or -1 on error
+ * */
+ssize_t readAll(int fd, struct read_buf *buf) {
+
+    buf->len = 0;
+    growBuf(buf, READ_CHUNK_SZ);
+
+    while (true) {
+        // always keep one byte for the NUL
+        if (buf->len + 1 >= buf->cap) {
+            growBuf(buf, buf->cap * 2);
+        }
+        ssize_t read_sz = pread(fd, buf->data + buf->len,
+                buf->cap - 1 - buf->len, buf->len);
+        ioStats.reads++;
+        if (read_sz == -1) {
+            buf->data[0] = '\0';
+            buf->len = 0;
+            return -1;
+        }
+        if (read_sz == 0) {
+            break;
+        }
+        buf->len += read_sz;
+        ioStats.bytesRead += read_sz;
+    }
+
+    buf->data[buf->len] = '\0';
+
+    return buf->len;
+}
+
+/* readChunks func streams a file from the beginning in READ_CHUNK_SZ pieces,
+ * passing each one to a callback. Reading stops at the end of the file or as
+ * soon as the callback returns false.
+ * Parameters:
+ * - file descriptor
+ * - callback getting the chunk, its length and ctx
+ * - pointer passed to the callback
+ *
+ * Returns 0 on success, or -1 on error
+ * */
+int readChunks(int fd, chunk_fn callback, void *ctx) {
+
+    char chunk[READ_CHUNK_SZ];
+    off_t offset = 0;
+
+    while (true) {
+        ssize_t read_sz = pread(fd, chunk, sizeof(chunk), offset);
+        ioStats.reads++;
+        if (read_sz == -1) {
+            return -1;
+        }
+        ioStats.bytesRead += read_sz;
+        if (read_sz == 0 || !callback(chunk, read_sz, ctx)) {
+            break;
+        }
+        offset += read_sz;
+    }
+
+    return 0;
+}
+
+/* readFile func reads one of the system wide files in proc. Every file has its
+ * own buffer that is reused by the next read of the same file.
+ * Parameters:
+ * - which file to read
+ *
+ * Returns the NUL terminated content of the file
+ * */
+char *readFile(enum proc_file file) {
+
+    if (replaying) {
+        // the parsers cut the text up in place, so it gets a copy
+        size_t len;
+        const char *text = archiveText(procFileNames[file], &len);
+        if (text == NULL) {
+            char what[64];
+            snprintf(what, sizeof(what), "%s was not captured", procFileNames[file]);
+            errno = ENOENT;
+            procFailed(what);
+        }
+        growBuf(&procBufs[file], len + 1);
+        memcpy(procBufs[file].data, text, len + 1);
+        procBufs[file].len = len;
+        return procBufs[file].data;
+    }
+
+    if (readAll(openProcFile(file), &procBufs[file]) == -1) {
+        procFailed("read");
+    }
+
+    return procBufs[file].data;
+}
+
+/* readAt func reads a file that may disappear at any moment (like the
+ * files in /proc/[pid])
+ * Parameters:
+ * - descriptor of the directory the path is relative to, or AT_FDCWD
+ * - path to file
+ * - pointer to the buffer the file will be read into
+ *
+ * Returns number of bytes read, or -1 if the file could not be read
+ * */
+ssize_t readAt(int dirFd, const char *filepath, struct read_buf *buf) {
+
+    int fd = openat(dirFd, filepath, O_RDONLY);
+    ioStats.opens++;
+    if (fd == -1) {
+        return -1;
+    }
+
+    ssize_t read_sz = readAll(fd, buf);
+
+    close(fd);
+
+    return read_sz;
+}
+
+/* archiveTextFits func checks that a body or a path of an archive, with the
+ * NUL after it, lies inside the mapping
+ * Parameters:
+ * - the mapping and its size
+ * - offset and length of the text
+ *
+ * */
+static bool archiveTextFits(const char *map, size_t size, uint64_t offset, uint64_t len) {
+    return offset < size && len < size - offset && map[offset + len] == '\0';
+}
+
+/* archiveValid func checks every sample and entry of a mapped archive, so
+ * the replay never reads outside the mapping: the tables, and the path and
+ * body of every entry, must be inside it and the texts NUL terminated
+ * Parameters:
+ * - the mapping and its size
+ * - the trailer
+ *
+ * */
+static bool archiveValid(const char *map, size_t size, const struct archive_trailer *trailer) {
+
+    size_t tableEnd = size - sizeof(struct archive_trailer);
+    if (trailer->samples % 8 != 0 || trailer->numSamples == 0 || trailer->samples > tableEnd
+            || trailer->numSamples > (tableEnd - trailer->samples) / sizeof(struct archive_sample)) {
+        return false;
+    }
+
+    const struct archive_sample *samples = (const void *) (map + trailer->samples);
+    for (uint64_t s = 0; s < trailer->numSamples; s++) {
+        const struct archive_sample *sample = &samples[s];
+        if (sample->entries % 8 != 0 || sample->entries > tableEnd
+                || sample->numEntries > (tableEnd - sample->entries) / sizeof(struct archive_entry)) {
+            return false;
+        }
+        const struct archive_entry *entries = (const void *) (map + sample->entries);
+        for (uint64_t i = 0; i < sample->numEntries; i++) {
+            const struct archive_entry *entry = &entries[i];
+            if (!archiveTextFits(map, size, entry->path, entry->pathLen)) {
+                return false;
+            }
+            if (entry->kind != ENTRY_DIR && !archiveTextFits(map, size, entry->body, entry->bodyLen)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* archiveMap func maps an archive for replay and checks it
+ * Parameters:
+ * - path of the archive
+ * - pointer to archive_reader struct that will be filled
+ *
+ * Returns false (with a message) if it is not a complete archive, or any of
+ * its offsets points outside the file
+ * */
+bool archiveMap(const char *path, struct archive_reader *archive) {
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+
+    size_t size = fileStat.st_size;
+    const size_t headerSz = sizeof(ARCHIVE_MAGIC) - 1 + sizeof(uint32_t);
+    if (size < headerSz + sizeof(struct archive_trailer)) {
+        fprintf(stderr, "%s: not an archive\n", path);
+        close(fd);
+        return false;
+    }
+
+    const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    uint32_t version;
+    memcpy(&version, map + sizeof(ARCHIVE_MAGIC) - 1, sizeof(version));
+    const struct archive_trailer *trailer = (const void *) (map + size - sizeof(struct archive_trailer));
+    if (memcmp(map, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC) - 1) != 0 || version != ARCHIVE_VERSION
+            || memcmp(trailer->magic, ARCHIVE_MAGIC, sizeof(trailer->magic)) != 0
+            || !archiveValid(map, size, trailer)) {
+        fprintf(stderr, "%s: not an archive, damaged, or the capture did not finish a sample\n", path);
+        munmap((void *) map, size);
+        return false;
+    }
+
+    archive->map = map;
+    archive->size = size;
+    archive->samples = (const void *) (map + trailer->samples);
+    archive->numSamples = trailer->numSamples;
+    archive->current = 0;
+
+    return true;
+}
+
+/* archiveFind func looks a path up in the current sample of the replayed
+ * archive, with a binary search over its sorted entries
+ * Parameters:
+ * - path relative to the proc directory
+ *
+ * Returns the entry, or NULL if the path was not captured
+ * */
+const struct archive_entry *archiveFind(const char *path) {
+    const struct archive_sample *sample = &replayArchive.samples[replayArchive.current];
+    const struct archive_entry *entries = (const void *) (replayArchive.map + sample->entries);
+
+    size_t low = 0;
+    size_t high = sample->numEntries;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int result = strcmp(path, replayArchive.map + entries[middle].path);
+        if (result == 0) {
+            return &entries[middle];
+        }
+        if (result < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    return NULL;
+}
+
+/* archiveText func returns the NUL terminated body of a file of the replayed
+ * archive, straight from the mapping
+ * Parameters:
+ * - path relative to the proc directory
+ * - pointer to size_t to which the length will be written, or NULL
+ *
+ * Returns the body, or NULL if the file was not captured
+ * */
+const char *archiveText(const char *path, size_t *len) {
+    const struct archive_entry *entry = archiveFind(path);
+    if (entry == NULL || entry->kind != ENTRY_FILE) {
+        return NULL;
+    }
+    if (len != NULL) {
+        *len = entry->bodyLen;
+    }
+    return replayArchive.map + entry->body;
+}
+
+/* sampleClock func returns the time of a clock: now, or the time the current
+ * sample of the replayed archive was taken at (CLOCK_REALTIME, or
+ * CLOCK_BOOTTIME for the clocks used to measure intervals)
+ * Parameters:
+ * - the clock
+ * - pointer to timespec struct that will be filled
+ *
+ * */
+void sampleClock(clockid_t clock, struct timespec *time) {
+    if (!replaying) {
+        clock_gettime(clock, time);
+        return;
+    }
+    const struct archive_sample *sample = &replayArchive.samples[replayArchive.current];
+    int64_t ns = clock == CLOCK_REALTIME ? sample->realTime : sample->bootTime;
+    time->tv_sec = ns / 1000000000;
+    time->tv_nsec = ns % 1000000000;
+}
+
+/* readSystem func that grabs files from /proc and gets the needed info
+ * about system
+ * Parameters:
+ * - pointer to system_info struct that will be filled
+ *
+ * */
+void readSystem(struct system_info *info) {
+
+    // hostname
+    char *hostnameFile = readFile(PF_HOSTNAME);
+    char *next_tok_hostname = hostnameFile;
+    // take first word from file in /proc/sys/kernel/hostname
+    char *hostname = next_token(&next_tok_hostname, "\n");
+    snprintf(info->hostname, sizeof(info->hostname), "%s", hostname ? hostname : "");
+
+    //linux version
+    char *versionFile = readFile(PF_OSRELEASE);
+    char *next_tok_version = versionFile;
+    // take first word from file in /proc/sys/kernel/osrelease
+    char *version = next_token(&next_tok_version, "\n");
+    snprintf(info->version, sizeof(info->version), "%s", version ? version : "");
+
+    //uptime
+    char *uptimeFile = readFile(PF_UPTIME);
+    char *next_tok_uptime = uptimeFile;
+    // take first long int in /uptime file
+    char *uptime = next_token(&next_tok_uptime, " ");
+    info->uptime = uptime ? strtol(uptime, NULL, 10) : 0;
+
+}
+
+/* readHardware func that grabs files from /proc and gets the needed info
+ * about hardware
+ * Parameters:
+ * - pointer to hardware_info struct that will be filled
+ * - snapshot of /proc/stat taken for this sample
+ * - earlier snapshot to calculate the cpu usage against
+ *
+ * */
+void readHardware(struct hardware_info *info, const struct stat_snapshot *stat,
+        const struct stat_snapshot *previous) {
+
+    //cpu model info
+    memset(info->cpuModel, 0, sizeof(info->cpuModel));
+    cpuModel(info->cpuModel);
+
+    // get num of processing units
+    info->numCpus = stat->numCpus;
+
+    //load avg, also as numbers for the JSON output
+    memset(info->loadAvg, 0, sizeof(info->loadAvg));
+    loadAver(info->loadAvg);
+    char *next_load = info->loadAvg;
+    for (int i = 0; i < 3; i++) {
+        info->load[i] = strtod(next_load, &next_load);
+    }
+
+    readMemory(&info->memTotal, &info->memActive);
+
+    //get total and idle of the earlier sample and of this one
+    long int time1[2];
+    long int time2[2];
+    cpuUsage(&previous->total, time1);
+    cpuUsage(&stat->total, time2);
+    float usageCpu;
+
+    //if they are equal then 0
+    if (time1[0] == time2[0] && time1[1] == time2[1]) {
+
+        usageCpu = 0;
+
+    } else {
+
+        // calculate cpu usage by formula usage = 1 - ((idle2 - idle1) / (total2 - total1))
+        long int total = time2[0] - time1[0];
+        long int idle = time2[1] - time1[1];
+
+        float idlePercent = (float) idle / total;
+        usageCpu = (1 - idlePercent) * 100;
+
+    }
+
+    info->cpuUsage = usageCpu;
+
+}
+
+/* Lines of cpuinfo that have been streamed but not looked at yet */
+struct model_search {
+    struct read_buf line;
+    char *cpuModel;
+    bool found;
+};
+
+/* findModelName func is the readChunks() callback of cpuModel. It looks at
+ * every complete line and stops the reading at the first "model name" line,
+ * only the last incomplete line is kept between chunks.
+ * Parameters:
+ * - the chunk and its length
+ * - pointer to model_search struct
+ *
+ * */
+bool findModelName(const char *chunk, size_t len, void *ctx) {
+    struct model_search *search = ctx;
+    struct read_buf *line = &search->line;
+
+    growBuf(line, line->len + len + 1);
+    memcpy(line->data + line->len, chunk, len);
+    line->len += len;
+    line->data[line->len] = '\0';
+
+    char *start = line->data;
+    char *end;
+    while ((end = memchr(start, '\n', line->data + line->len - start)) != NULL) {
+        *end = '\0';
+        if (strncmp(start, "model name", 10) == 0) {
+            char *next_tok = strchr(start, ':');
+            char *curr_tok;
+            int countOfWords = 0;
+            while (next_tok != NULL
+                    && (curr_tok = next_token(&next_tok, " ,?!:\t")) != NULL) {
+                // cpuModel holds 100 bytes
+                if (strlen(search->cpuModel) + strlen(curr_tok) + 2 > 100) {
+                    break;
+                }
+                // count the words to put whitespaces
+                if (countOfWords++ > 0) {
+                    strcat(search->cpuModel, " ");
+                }
+                strcat(search->cpuModel, curr_tok);
+            }
+            search->found = true;
+            return false;
+        }
+        start = end + 1;
+    }
+
+    // keep the incomplete line for the next chunk
+    line->len -= start - line->data;
+    memmove(line->data, start, line->len + 1);
+
+    return true;
+}
+
+/* cpuModel func that grabs info from cpuinfo file in proc and writes it to char array
+ * Parameters:
+ * - pointer to char array to which cpu model will be written
+ *
+ * */
+void cpuModel(char *cpuModel) {
+    struct model_search search = { { NULL, 0, 0 }, cpuModel, false };
+
+    if (replaying) {
+        size_t len;
+        const char *text = archiveText(procFileNames[PF_CPUINFO], &len);
+        if (text != NULL) {
+            findModelName(text, len, &search);
+        }
+        freeBuf(&search.line);
+        return;
+    }
+
+    // cpuinfo can be huge on big machines, but the model is on one of the first lines
+    if (readChunks(openProcFile(PF_CPUINFO), findModelName, &search) == -1) {
+        freeBuf(&search.line);
+        procFailed("read");
+    }
+
+    freeBuf(&search.line);
+}
+
+/* loadAver func that grabs info from loadavg file in proc and writes it to char array
+ * Parameters:
+ * - pointer to char array to which load average will be written
+ *
+ * */
+void loadAver(char *loadAverage) {
+    char *loadAvgFile = readFile(PF_LOADAVG);
+    char *next_tok = loadAvgFile;
+    char *curr_tok;
+    int count = 0;
+
+    while ((curr_tok = next_token(&next_tok, " \0")) != NULL) {
+
+        // only first three tokens in loadavg file are needed
+        if (count >= 3) {
+            break;
+        } else {
+            if (count >= 1) {
+                strcat(loadAverage, " ");
+            }
+            strcat(loadAverage, curr_tok);
+            count++;
+        }
+
+    }
+}
+
+/* cpuUsage func that calculates total and idle time of a cpu and writes it to long int array
+ * Parameters:
+ * - time the cpu spent in each state
+ * - pointer to long int array to which total and idle will be written
+ *
+ * */
+void cpuUsage(const struct cpu_times *times, long int *result) {
+
+    // calculate total, guest time is already counted in user and nice
+    long int total = 0;
+    for (int i = 0; i < CPU_GUEST; i++) {
+        total += times->field[i];
+    }
+
+    //write total and idle as elements of array
+    result[0] = total;
+    result[1] = times->field[CPU_IDLE];
+
+}
+
+/* skipLine func returns the start of the next line, or the end of the text.
+ * memchr() is vectorised by the C library, so a long line (like the intr
+ * line of /proc/stat, with a counter for every interrupt) is skipped without
+ * looking at its numbers
+ * Parameters:
+ * - pointer into a line
+ * - end of the text
+ *
+ * */
+const char *skipLine(const char *pos, const char *end) {
+    const char *newline = memchr(pos, '\n', end - pos);
+    return newline != NULL ? newline + 1 : end;
+}
+
+#ifdef SCAN_BLOCK
+/* byteMask func compares a SCAN_BLOCK bytes block with one character
+ * Parameters:
+ * - start of the block, it does not have to be aligned
+ * - the character
+ *
+ * Returns a bit mask with bit i set if byte i is the character
+ * */
+static inline uint32_t byteMask(const char *block, char c) {
+#if defined(__AVX2__)
+    return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *) block), _mm256_set1_epi8(c)));
+#else
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *) block), _mm_set1_epi8(c)));
+#endif
+}
+#endif
+
+/* Powers of 10 that shift an 8 byte block of digits into place */
+static const uint64_t powersOf10[9] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+};
+
+/* parseUInt func parses a decimal number after optional spaces, 8 digits at
+ * a time (SWAR): a digit is a byte 0x30-0x39, so the first non digit of a
+ * block is found with two masks and a count of trailing zeros, and the
+ * digits are combined with three multiplications instead of one per digit
+ * Parameters:
+ * - pointer to the position, moved past the number
+ * - end of the text, nothing after it is read
+ *
+ * Returns the number, 0 if there is none
+ * */
+unsigned long long parseUInt(const char **pos, const char *end) {
+
+    const char *p = *pos;
+    while (p < end && *p == ' ') {
+        p++;
+    }
+
+    unsigned long long value = 0;
+    while (end - p >= 8) {
+        uint64_t chunk;
+        memcpy(&chunk, p, 8);
+
+        // bytes whose high nibble is not 3, or whose low nibble is above 9
+        uint64_t nonDigits = ((chunk & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL)
+                | (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL);
+        int digits = nonDigits == 0 ? 8 : __builtin_ctzll(nonDigits) / 8;
+        if (digits == 0) {
+            break;
+        }
+
+        // the first digit is the lowest byte, shift the digits up so the
+        // bytes that are not digits fall off and zeros lead
+        uint64_t block = (chunk - 0x3030303030303030ULL) << (8 * (8 - digits));
+        block = (block * 10) + (block >> 8);
+        block = (((block & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+                + (((block >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+
+        value = value * powersOf10[digits] + block;
+        p += digits;
+        if (digits < 8) {
+            *pos = p;
+            return value;
+        }
+    }
+
+    // the last few bytes of the text
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        p++;
+    }
+
+    *pos = p;
+    return value;
+}
+
+/* parseCpuLine func parses the numbers of one cpu line of /proc/stat.
+ * Older kernels have fewer columns, the missing ones stay 0
+ * Parameters:
+ * - pointer to the first character after the "cpu" / "cpuN" label
+ * - end of the text
+ * - pointer to cpu_times struct that will be filled
+ *
+ * Returns pointer to the end of the parsed numbers
+ * */
+const char *parseCpuLine(const char *line, const char *end, struct cpu_times *times) {
+
+    for (int i = 0; i < CPU_FIELDS; i++) {
+        const char *start = line;
+        times->field[i] = parseUInt(&line, end);
+        if (line == start || (line[-1] < '0' || line[-1] > '9')) {
+            // no more numbers on this line
+            for (; i < CPU_FIELDS; i++) {
+                times->field[i] = 0;
+            }
+            break;
+        }
+    }
+
+    return line;
+}
+
+/* parseStat func parses everything the sections need from the content of
+ * /proc/stat. The intr line is only read up to its first number (the
+ * total), the rest of it, the per-interrupt counters, is skipped with
+ * skipLine().
+ * Parameters:
+ * - content of the file and its length
+ * - pointer to stat_snapshot struct that will be filled, memory of its
+ *   previous content is reused
+ *
+ * */
+void parseStat(const char *text, size_t len, struct stat_snapshot *stat) {
+
+    const char *line = text;
+    const char *end = text + len;
+    // a line the kernel does not have must not keep the previous value
+    stat->numCpus = 0;
+    stat->intr = stat->ctxt = stat->processes = 0;
+    stat->procsRunning = stat->procsBlocked = 0;
+
+    while (line < end) {
+        const char *pos;
+
+        if (end - line > 3 && memcmp(line, "cpu", 3) == 0) {
+            pos = line + 3;
+            if (*pos == ' ') {
+                pos = parseCpuLine(pos, end, &stat->total);
+            } else {
+                // "cpuN" lines: cpus are kept in order, with their number
+                int id = (int) parseUInt(&pos, end);
+                if (stat->numCpus == stat->cpusCap) {
+                    int cap = stat->cpusCap ? stat->cpusCap * 2 : 16;
+                    stat->cpus = resizeArray(stat->cpus, cap * sizeof(struct cpu_times));
+                    stat->cpuIds = resizeArray(stat->cpuIds, cap * sizeof(int));
+                    stat->cpusCap = cap;
+                }
+                stat->cpuIds[stat->numCpus] = id;
+                pos = parseCpuLine(pos, end, &stat->cpus[stat->numCpus++]);
+            }
+        } else if (end - line > 5 && memcmp(line, "intr ", 5) == 0) {
+            pos = line + 5;
+            stat->intr = parseUInt(&pos, end);
+        } else if (end - line > 5 && memcmp(line, "ctxt ", 5) == 0) {
+            pos = line + 5;
+            stat->ctxt = parseUInt(&pos, end);
+        } else if (end - line > 10 && memcmp(line, "processes ", 10) == 0) {
+            pos = line + 10;
+            stat->processes = parseUInt(&pos, end);
+        } else if (end - line > 14 && memcmp(line, "procs_running ", 14) == 0) {
+            pos = line + 14;
+            stat->procsRunning = parseUInt(&pos, end);
+        } else if (end - line > 14 && memcmp(line, "procs_blocked ", 14) == 0) {
+            pos = line + 14;
+            stat->procsBlocked = parseUInt(&pos, end);
+        } else {
+            pos = line;
+        }
+
+        // go to the next line
+        line = skipLine(pos, end);
+    }
+
+}
+
+/* readStat func reads /proc/stat once and parses it
+ * Parameters:
+ * - pointer to stat_snapshot struct that will be filled
+ *
+ * */
+void readStat(struct stat_snapshot *stat) {
+    const struct archive_entry *entry;
+    if (replaying && (entry = archiveFind(procFileNames[PF_STAT])) != NULL) {
+        stat->time.tv_sec = entry->time / 1000000000;
+        stat->time.tv_nsec = entry->time % 1000000000;
+    } else {
+        clock_gettime(CLOCK_BOOTTIME, &stat->time);
+    }
+    char *text = readFile(PF_STAT);
+    parseStat(text, procBufs[PF_STAT].len, stat);
+}
+
+/* usableSample func checks if an earlier snapshot can be used to calculate
+ * the cpu usage: it must be between CPU_SAMPLE_MIN_AGE and CPU_SAMPLE_MAX_AGE
+ * seconds old and come from the same boot. The cpus may differ, cpuBreakdown()
+ * matches them by number
+ * Parameters:
+ * - the earlier snapshot
+ * - the current snapshot
+ *
+ * */
+bool usableSample(const struct stat_snapshot *previous, const struct stat_snapshot *stat) {
+
+    double age = (stat->time.tv_sec - previous->time.tv_sec)
+            + (stat->time.tv_nsec - previous->time.tv_nsec) / 1e9;
+    if (age < CPU_SAMPLE_MIN_AGE || age > CPU_SAMPLE_MAX_AGE) {
+        return false;
+    }
+
+    // counters only go down after a reboot, except iowait (see proc(5))
+    for (int i = 0; i < CPU_FIELDS; i++) {
+        if (i != CPU_IOWAIT && previous->total.field[i] > stat->total.field[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* cpuStatePath func builds the path of the file the last cpu sample is kept in
+ * Parameters:
+ * - runtime directory
+ * - pointer to char array of PATH_MAX bytes to which the path will be written
+ *
+ * */
+void cpuStatePath(const char *dir, char *path) {
+    snprintf(path, PATH_MAX, "%s/%s", dir, CPU_STATE_FILE);
+}
+
+/* loadCpuState func reads the cpu sample saved by an earlier run. The file
+ * is a "time <sec> <nsec>" line followed by the cpu, intr, ctxt and
+ * processes lines in the format of /proc/stat (files of older versions only
+ * have the cpu lines, their counters load as 0)
+ * Parameters:
+ * - runtime directory
+ * - pointer to stat_snapshot struct that will be filled
+ *
+ * Returns false if there is no saved sample
+ * */
+bool loadCpuState(const char *dir, struct stat_snapshot *stat) {
+
+    char path[PATH_MAX];
+    cpuStatePath(dir, path);
+
+    struct read_buf buf = { NULL, 0, 0 };
+    if (readAt(AT_FDCWD, path, &buf) <= 0) {
+        freeBuf(&buf);
+        return false;
+    }
+
+    long long sec;
+    long nsec;
+    bool loaded = false;
+    if (sscanf(buf.data, "time %lld %ld", &sec, &nsec) == 2) {
+        stat->time.tv_sec = (time_t) sec;
+        stat->time.tv_nsec = nsec;
+        char *cpuLines = strchr(buf.data, '\n');
+        if (cpuLines != NULL) {
+            cpuLines++;
+            parseStat(cpuLines, buf.len - (cpuLines - buf.data), stat);
+            loaded = true;
+        }
+    }
+
+    freeBuf(&buf);
+
+    return loaded;
+}
+
+/* saveCpuState func saves the cpu lines and the intr, ctxt and processes
+ * counters of a snapshot for the next run (the rates of --history need
+ * them too). The
+ * file is written next to the old one and renamed over it, so a run started
+ * at the same time never sees half of it.
+ * Parameters:
+ * - runtime directory
+ * - the snapshot
+ *
+ * */
+void saveCpuState(const char *dir, const struct stat_snapshot *stat) {
+
+    char path[PATH_MAX];
+    char tmpPath[PATH_MAX + 16];
+    cpuStatePath(dir, path);
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int) getpid());
+
+    FILE *file = fopen(tmpPath, "w");
+    if (file == NULL) {
+        LOG("Cannot save cpu sample to %s\n", tmpPath);
+        return;
+    }
+
+    fprintf(file, "time %lld %ld\n", (long long) stat->time.tv_sec, stat->time.tv_nsec);
+    for (int cpu = -1; cpu < stat->numCpus; cpu++) {
+        const struct cpu_times *times = cpu < 0 ? &stat->total : &stat->cpus[cpu];
+        if (cpu < 0) {
+            fprintf(file, "cpu ");
+        } else {
+            fprintf(file, "cpu%d", stat->cpuIds[cpu]);
+        }
+        for (int i = 0; i < CPU_FIELDS; i++) {
+            fprintf(file, " %llu", times->field[i]);
+        }
+        fprintf(file, "\n");
+    }
+    fprintf(file, "intr %llu\nctxt %llu\nprocesses %llu\n", stat->intr, stat->ctxt, stat->processes);
+
+    if (fclose(file) != 0 || rename(tmpPath, path) == -1) {
+        LOG("Cannot save cpu sample to %s\n", path);
+        unlink(tmpPath);
+    }
+}
+
+/* freeStat func frees the memory held by a stat_snapshot
+ * Parameters:
+ * - pointer to the snapshot
+ *
+ * */
+void freeStat(struct stat_snapshot *stat) {
+    free(stat->cpus);
+    free(stat->cpuIds);
+    stat->cpus = NULL;
+    stat->cpuIds = NULL;
+    stat->numCpus = 0;
+    stat->cpusCap = 0;
+}
+
+/* cpuDeltas func is the first step of the per-cpu breakdown: it subtracts two
+ * cpu x field counter matrices. The main loop handles 4 counters at a time
+ * with no branches (the comparison is a select), so the compiler turns it
+ * into SIMD code even at -O2. A counter that went down counts as 0: iowait
+ * can, and the counters of a cpu that came back online can start over.
+ * Parameters:
+ * - counters of the current sample, flattened
+ * - counters of the earlier sample, flattened
+ * - pointer to float array to which the deltas will be written
+ * - number of counters
+ *
+ * */
+void cpuDeltas(const unsigned long long *restrict current, const unsigned long long *restrict previous,
+        float *restrict deltas, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        deltas[i] = (float) (current[i] > previous[i] ? current[i] - previous[i] : 0);
+        deltas[i + 1] = (float) (current[i + 1] > previous[i + 1] ? current[i + 1] - previous[i + 1] : 0);
+        deltas[i + 2] = (float) (current[i + 2] > previous[i + 2] ? current[i + 2] - previous[i + 2] : 0);
+        deltas[i + 3] = (float) (current[i + 3] > previous[i + 3] ? current[i + 3] - previous[i + 3] : 0);
+    }
+    for (; i < count; i++) {
+        deltas[i] = (float) (current[i] > previous[i] ? current[i] - previous[i] : 0);
+    }
+}
+
+/* cpuPercentages func is the second step of the per-cpu breakdown: it turns
+ * each row of deltas into percentages of the time that passed on that cpu
+ * (guest time is already in user and nice, so it is not part of the total)
+ * Parameters:
+ * - cpu x field matrix of deltas, replaced with percentages
+ * - number of cpus (rows)
+ *
+ * */
+void cpuPercentages(float *restrict matrix, int numCpus) {
+    for (int cpu = 0; cpu < numCpus; cpu++) {
+        float *row = matrix + (size_t) cpu * CPU_FIELDS;
+
+        float total = 0;
+        for (int i = 0; i < CPU_GUEST; i++) {
+            total += row[i];
+        }
+        float scale = total > 0 ? 100 / total : 0;
+
+        for (int i = 0; i < CPU_FIELDS; i++) {
+            row[i] *= scale;
+        }
+        // no time passed on the cpu (its counters started over), not busy
+        if (total == 0) {
+            row[CPU_IDLE] = 100;
+        }
+    }
+}
+
+/* cpuBreakdown func calculates how each cpu spent the time between two
+ * samples, in percent. Only the cpus that are in both samples have a row
+ * Parameters:
+ * - snapshot of /proc/stat taken for this sample
+ * - earlier snapshot to calculate the usage against
+ * - pointer to int to which the number of cpus (rows) will be written
+ * - pointer to which the numbers of the cpus of the rows will be written
+ *
+ * Returns the cpu x field matrix of percentages, valid until the next call
+ * */
+const float *cpuBreakdown(const struct stat_snapshot *stat, const struct stat_snapshot *previous, int *numCpus,
+        const int **cpuIds) {
+
+    // the matrix is kept between refreshes, it only grows
+    static float *matrix = NULL;
+    static int *matrixIds = NULL;
+    static int matrixCpus = 0;
+    if (stat->numCpus > matrixCpus) {
+        matrix = resizeArray(matrix, (size_t) stat->numCpus * CPU_FIELDS * sizeof(float));
+        matrixIds = resizeArray(matrixIds, (size_t) stat->numCpus * sizeof(int));
+        matrixCpus = stat->numCpus;
+    }
+
+    // the same cpus in both samples: struct cpu_times is just the row of
+    // counters, so the cpus array is already a dense cpu x field matrix
+    *numCpus = stat->numCpus;
+    *cpuIds = stat->cpuIds;
+    if (stat->numCpus == previous->numCpus
+            && (stat->numCpus == 0 || memcmp(stat->cpuIds, previous->cpuIds, stat->numCpus * sizeof(int)) == 0)) {
+        if (*numCpus > 0) {
+            cpuDeltas(stat->cpus[0].field, previous->cpus[0].field, matrix, (size_t) *numCpus * CPU_FIELDS);
+            cpuPercentages(matrix, *numCpus);
+        }
+        return matrix;
+    }
+
+    // a cpu went offline or came online in between: the rows are matched on
+    // the cpu number, both lists are in increasing order like /proc/stat has
+    // them
+    int rows = 0;
+    int c = 0;
+    int p = 0;
+    while (c < stat->numCpus && p < previous->numCpus) {
+        if (stat->cpuIds[c] < previous->cpuIds[p]) {
+            c++;
+        } else if (stat->cpuIds[c] > previous->cpuIds[p]) {
+            p++;
+        } else {
+            cpuDeltas(stat->cpus[c].field, previous->cpus[p].field, matrix + (size_t) rows * CPU_FIELDS, CPU_FIELDS);
+            matrixIds[rows++] = stat->cpuIds[c];
+            c++;
+            p++;
+        }
+    }
+    cpuPercentages(matrix, rows);
+    *numCpus = rows;
+    *cpuIds = matrixIds;
+
+    return matrix;
+}
+
+/* readMemory func that grabs the total and active memory from meminfo file in proc
+ * Parameters:
+ * - pointer to float to which MemTotal (kB) will be written
+ * - pointer to float to which Active (kB) will be written
+ *
+ * */
+void readMemory(float *memTotal, float *active) {
+    const char *line = readFile(PF_MEMINFO);
+    const char *end = line + procBufs[PF_MEMINFO].len;
+    *memTotal = 0;
+    *active = 0;
+
+    // both are near the top, the rest of the file is not looked at
+    int found = 0;
+    while (line < end && found < 2) {
+        const char *pos = line;
+        if (end - line > 9 && memcmp(line, "MemTotal:", 9) == 0) {
+            pos = line + 9;
+            *memTotal = (float) parseUInt(&pos, end);
+            found++;
+        } else if (end - line > 7 && memcmp(line, "Active:", 7) == 0) {
+            pos = line + 7;
+            *active = (float) parseUInt(&pos, end);
+            found++;
+        }
+        line = skipLine(pos, end);
+    }
+}
+
+/**
+ * countTasks counts the number of all digit folders in proc
+ * and gets info from stat file
+ * Parameters:
+ * - pointer to task_counts struct that will be filled
+ * - snapshot of /proc/stat taken for this sample
+ */
+void countTasks(struct task_counts *counts, const struct stat_snapshot *stat) {
+
+    //get num of interrupts, contSwitches and forks from stat file
+    counts->tasks = samplePids()->count;
+    counts->intr = stat->intr;
+    counts->ctxt = stat->ctxt;
+    counts->forks = stat->processes;
+
+}
+
+static struct user_cache userCache = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+/* Process tables of the last scan of the task list and of the one running
+ * now, they swap places after every scan */
+static struct proc_table procTables[2];
+
+static int currentTable = 0;
+
+/* Size of a memory page in kB, for the rss field of the stat files. Set
+ * before the first scan */
+static unsigned long long pageKB = 0;
+
+/* internName func copies a user name into the name pool
+ * Parameters:
+ * - the name
+ *
+ * Returns pointer to the interned copy, NULL when out of memory
+ * */
+const char *internName(const char *name) {
+    size_t len = strlen(name) + 1;
+    if (len > NAME_POOL_SZ) {
+        len = NAME_POOL_SZ;
+    }
+
+    struct name_pool *pool = userCache.pool;
+    if (pool == NULL || pool->used + len > NAME_POOL_SZ) {
+        pool = malloc(sizeof(struct name_pool));
+        if (pool == NULL) {
+            return NULL;
+        }
+        pool->next = userCache.pool;
+        pool->used = 0;
+        userCache.pool = pool;
+    }
+
+    char *copy = pool->names + pool->used;
+    memcpy(copy, name, len - 1);
+    copy[len - 1] = '\0';
+    pool->used += len;
+
+    return copy;
+}
+
+/* uidSlot func finds the slot of a uid in the user cache: either the slot
+ * holding it or the empty slot where it should go
+ * Parameters:
+ * - the uid
+ *
+ * */
+struct user_entry *uidSlot(uid_t uid) {
+    // multiplicative hashing, uids are often sequential
+    size_t mask = userCache.capacity - 1;
+    size_t i = ((uint32_t) uid * 2654435761u) & mask;
+
+    while (userCache.entries[i].used && userCache.entries[i].uid != uid) {
+        i = (i + 1) & mask;
+    }
+
+    return &userCache.entries[i];
+}
+
+/* addUser func puts a uid and its name to the user cache, if the uid is
+ * not there yet. Caller must hold the write lock (or be the only thread)
+ * Parameters:
+ * - the uid
+ * - the name
+ *
+ * Returns the cached name, NULL when out of memory (the cache is left as it
+ * was)
+ * */
+const char *addUser(uid_t uid, const char *name) {
+
+    // keep the table at most half full
+    if ((userCache.count + 1) * 2 > userCache.capacity) {
+        struct user_entry *old = userCache.entries;
+        size_t oldCapacity = userCache.capacity;
+
+        size_t capacity = oldCapacity ? oldCapacity * 2 : 256;
+        struct user_entry *entries = calloc(capacity, sizeof(struct user_entry));
+        if (entries == NULL) {
+            return NULL;
+        }
+        userCache.entries = entries;
+        userCache.capacity = capacity;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i].used) {
+                *uidSlot(old[i].uid) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    struct user_entry *entry = uidSlot(uid);
+    if (!entry->used) {
+        const char *copy = internName(name);
+        if (copy == NULL) {
+            return NULL;
+        }
+        entry->used = true;
+        entry->uid = uid;
+        entry->name = copy;
+        userCache.count++;
+    }
+
+    return entry->name;
+}
+
+/* loadUsers func parses PASSWD_FILE into the user cache. Lines are
+ * name:password:uid:..., the first entry for a uid wins like in getpwuid()
+ *
+ * Returns false when out of memory, a missing file is not an error
+ * */
+bool loadUsers() {
+
+    FILE *passwd = fopen(PASSWD_FILE, "r");
+    ioStats.passwdLookups++;
+    if (passwd == NULL) {
+        LOG("Cannot open %s, using getpwuid_r() only\n", PASSWD_FILE);
+        return true;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), passwd) != NULL) {
+        // skip NIS compat entries, getpwuid_r() will resolve those
+        if (line[0] == '+' || line[0] == '-' || line[0] == '#') {
+            continue;
+        }
+        char *name = line;
+        char *password = strchr(name, ':');
+        if (password == NULL) {
+            continue;
+        }
+        *password++ = '\0';
+        char *uidField = strchr(password, ':');
+        if (uidField == NULL) {
+            continue;
+        }
+        uidField++;
+
+        char *end;
+        unsigned long uid = strtoul(uidField, &end, 10);
+        if (end == uidField || *end != ':' || *name == '\0') {
+            continue;
+        }
+        if (addUser((uid_t) uid, name) == NULL) {
+            fclose(passwd);
+            return false;
+        }
+    }
+
+    fclose(passwd);
+
+    LOG("Loaded %zu users from %s\n", userCache.count, PASSWD_FILE);
+    return true;
+}
+
+/* userName func returns the name of the user with the given uid. Most
+ * lookups are a single probe of the user cache, only uids missing from
+ * PASSWD_FILE go to getpwuid_r() (and only once). If the uid has no user
+ * the number itself is returned. Running out of memory fails like an
+ * unreadable proc file, after the lock is let go.
+ * Parameters:
+ * - the uid
+ *
+ * */
+const char *userName(uid_t uid) {
+
+    ioStats.userLookups++;
+
+    const char *name = NULL;
+    pthread_rwlock_rdlock(&userCache.lock);
+    if (!userCache.loaded) {
+        // the first lookup loads the passwd file, the others wait for it
+        pthread_rwlock_unlock(&userCache.lock);
+        pthread_rwlock_wrlock(&userCache.lock);
+        if (!userCache.loaded) {
+            userCache.loaded = loadUsers();
+        }
+        bool loaded = userCache.loaded;
+        pthread_rwlock_unlock(&userCache.lock);
+        if (!loaded) {
+            errno = ENOMEM;
+            procFailed("malloc");
+        }
+        pthread_rwlock_rdlock(&userCache.lock);
+    }
+    if (userCache.capacity > 0) {
+        struct user_entry *entry = uidSlot(uid);
+        if (entry->used) {
+            name = entry->name;
+        }
+    }
+    pthread_rwlock_unlock(&userCache.lock);
+
+    if (name != NULL) {
+        return name;
+    }
+
+    // not in the passwd file, ask NSS (LDAP, systemd, ...)
+    struct passwd pwd;
+    struct passwd *result = NULL;
+    char pwdBuf[1024];
+    char uidStr[16];
+    getpwuid_r(uid, &pwd, pwdBuf, sizeof(pwdBuf), &result);
+    ioStats.passwdLookups++;
+    if (result == NULL) {
+        snprintf(uidStr, sizeof(uidStr), "%u", (unsigned) uid);
+    }
+
+    pthread_rwlock_wrlock(&userCache.lock);
+    name = addUser(uid, result != NULL ? result->pw_name : uidStr);
+    pthread_rwlock_unlock(&userCache.lock);
+    if (name == NULL) {
+        errno = ENOMEM;
+        procFailed("malloc");
+    }
+
+    return name;
+}
+
+/* freeUsers func empties the user cache and frees the names it handed
+ * out, the next userName() loads the passwd file again
+ *
+ * */
+void freeUsers() {
+    pthread_rwlock_wrlock(&userCache.lock);
+    while (userCache.pool != NULL) {
+        struct name_pool *next = userCache.pool->next;
+        free(userCache.pool);
+        userCache.pool = next;
+    }
+    free(userCache.entries);
+    userCache.entries = NULL;
+    userCache.capacity = 0;
+    userCache.count = 0;
+    userCache.loaded = false;
+    pthread_rwlock_unlock(&userCache.lock);
+}
+
+/* markField func handles one space or ')' found by parsePidStat(). Every
+ * ')' could be the end of the name, so it starts the fields after the name
+ * again; a space after one starts the next field
+ * Parameters:
+ * - the stat being filled, numFields is 2 until a ')' is seen
+ * - offset of the character in the line
+ * - true for a ')', false for a space
+ *
+ * */
+static inline void markField(struct pid_stat *stat, size_t offset, bool paren) {
+    if (paren) {
+        stat->commLen = stat->text + offset - stat->comm;
+        stat->numFields = 2;
+    } else if (stat->commLen != SIZE_MAX && stat->numFields < PS_FIELDS) {
+        stat->field[++stat->numFields] = (uint16_t) (offset + 1);
+    }
+}
+
+/**
+ * parsePidStat finds the name and the start of every field of a stat file
+ * in one pass over the line, without copying or converting anything.
+ * The name (comm) can contain spaces and brackets, like "(sd-pam)" or
+ * "tmux: server", so it ends at the last ')' of the line: the pass restarts
+ * the fields at every ')' and only the fields after the last one are kept.
+ * Parameters:
+ * - content of /proc/[pid]/stat and its length
+ * - pointer to pid_stat struct that will be filled
+ *
+ * Returns false if the line is not a stat file, is cut short or is longer
+ * than the 64K the offsets of pid_stat can hold
+ */
+bool parsePidStat(const char *text, size_t len, struct pid_stat *stat) {
+
+    // the name starts right after the pid
+    const char *open = memchr(text, '(', len < 32 ? len : 32);
+    if (open == NULL || len > UINT16_MAX) {
+        return false;
+    }
+
+    stat->text = text;
+    stat->end = text + len;
+    stat->comm = open + 1;
+    stat->commLen = SIZE_MAX;
+    stat->numFields = 2;
+    stat->field[PS_PID] = 0;
+    stat->field[PS_COMM] = (uint16_t) (stat->comm - text);
+
+    size_t i = stat->comm - text;
+#ifdef SCAN_BLOCK
+    for (; len - i >= SCAN_BLOCK; i += SCAN_BLOCK) {
+        uint32_t parens = byteMask(text + i, ')');
+        uint32_t marks = parens | byteMask(text + i, ' ');
+        while (marks != 0) {
+            int bit = __builtin_ctz(marks);
+            markField(stat, i + bit, (parens >> bit) & 1);
+            marks &= marks - 1;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (text[i] == ')' || text[i] == ' ') {
+            markField(stat, i, text[i] == ')');
+        }
+    }
+
+    if (stat->commLen == SIZE_MAX || stat->numFields < PS_RSS) {
+        return false;
+    }
+    stat->state = text[stat->field[PS_STATE]];
+
+    return true;
+}
+
+/* pidStatField func parses one number of a stat file found by parsePidStat()
+ * Parameters:
+ * - the stat
+ * - the field
+ *
+ * Returns the number, 0 if the kernel does not have the field
+ * */
+unsigned long long pidStatField(const struct pid_stat *stat, enum pid_stat_field field) {
+    if (field == PS_COMM || (int) field > stat->numFields) {
+        return 0;
+    }
+    const char *pos = stat->text + stat->field[field];
+    return parseUInt(&pos, stat->end);
+}
+
+/* keyValue func finds the number of a "Key: value" line, the format of
+ * [pid]/status, io and smaps_rollup. Lines are skipped with skipLine(), only
+ * the start of each one is compared
+ * Parameters:
+ * - the text and its end
+ * - the key with its colon, like "VmSwap:"
+ *
+ * Returns the number, -1 if the key is not there
+ * */
+long long keyValue(const char *text, const char *end, const char *key) {
+    size_t keyLen = strlen(key);
+    for (const char *line = text; line < end; line = skipLine(line, end)) {
+        if ((size_t) (end - line) > keyLen && memcmp(line, key, keyLen) == 0) {
+            const char *pos = line + keyLen;
+            while (pos < end && *pos == '\t') {
+                pos++;
+            }
+            return (long long) parseUInt(&pos, end);
+        }
+    }
+    return -1;
+}
+
+/* pidWanted func checks a pid against the --pid list, the first filter, used
+ * on the directory entries of proc
+ * Parameters:
+ * - the filter
+ * - the pid
+ *
+ * */
+bool pidWanted(const struct task_filter *filter, int pid) {
+    if (filter->pids == NULL) {
+        return true;
+    }
+    return bsearch(&pid, filter->pids, filter->numPids, sizeof(int), compareInts) != NULL;
+}
+
+/* taskWanted func checks a process against the filters on the stat file:
+ * the name pattern and the states
+ * Parameters:
+ * - the filter
+ * - the process
+ * - state letter of the process
+ *
+ * */
+bool taskWanted(const struct task_filter *filter, const struct task_info *info, char state) {
+    if (filter->states != NULL && (state == '\0' || strchr(filter->states, state) == NULL)) {
+        return false;
+    }
+    if (filter->namePattern != NULL && fnmatch(filter->namePattern, info->name, 0) != 0) {
+        return false;
+    }
+    return true;
+}
+
+/* compares two ints, used to sort and search the --pid list */
+int compareInts(const void *a, const void *b) {
+    int i1 = *(const int *) a;
+    int i2 = *(const int *) b;
+    return (i1 > i2) - (i1 < i2);
+}
+
+/* Directory entry as getdents64() returns it */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* scanNumericDir func lists the entries of a directory that have numbers as
+ * names: the pids in proc, the threads in [pid]/task or the open files in
+ * [pid]/fd. getdents64() fills a DENTS_BUF_SZ buffer with thousands of
+ * entries per call, and the numbers are parsed while the names are checked
+ * Parameters:
+ * - descriptor of the directory, read from its current offset
+ * - list the numbers are added to, or NULL to only count them
+ * - true to only take directories
+ *
+ * Returns the number of entries, -1 if the directory could not be read
+ * */
+ssize_t scanNumericDir(int fd, struct pid_list *list, bool dirsOnly) {
+
+    char dents[DENTS_BUF_SZ] __attribute__((aligned(8)));
+    ssize_t count = 0;
+
+    while (true) {
+        long len = syscall(SYS_getdents64, fd, dents, sizeof(dents));
+        ioStats.getdents++;
+        if (len == -1) {
+            return -1;
+        }
+        if (len == 0) {
+            return count;
+        }
+        for (long offset = 0; offset < len; ) {
+            const struct linux_dirent64 *entry = (const void *) (dents + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (*name < '0' || *name > '9' || (dirsOnly && entry->d_type != DT_DIR)) {
+                continue;
+            }
+            int number = 0;
+            while (*name >= '0' && *name <= '9') {
+                number = number * 10 + (*name++ - '0');
+            }
+            if (*name != '\0') {
+                continue;
+            }
+            count++;
+            if (list != NULL) {
+                if (list->count == list->capacity) {
+                    size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+                    list->pids = resizeArray(list->pids, capacity * sizeof(int));
+                    list->capacity = capacity;
+                }
+                list->pids[list->count++] = number;
+            }
+        }
+    }
+}
+
+/* Pids of the current sample, listed on first use and shared by all the
+ * sections until forgetPids() */
+static struct pid_list pidList;
+static bool pidsListed = false;
+
+/* forgetPids func makes the next samplePids() list proc again, it is called
+ * when a new sample starts
+ *
+ * */
+void forgetPids() {
+    pidsListed = false;
+}
+
+/* freePids func frees the pid list of the samples
+ *
+ * */
+void freePids() {
+    free(pidList.pids);
+    memset(&pidList, 0, sizeof(pidList));
+    pidsListed = false;
+}
+
+/* samplePids func returns the pids of the [pid] directories of proc (or of
+ * the current sample in replay mode). proc is only listed once per sample,
+ * in the order of its entries; the list is reused between samples
+ *
+ * */
+const struct pid_list *samplePids() {
+
+    if (pidsListed) {
+        return &pidList;
+    }
+    pidList.count = 0;
+
+    if (replaying) {
+        const struct archive_sample *sample = &replayArchive.samples[replayArchive.current];
+        const struct archive_entry *entries = (const void *) (replayArchive.map + sample->entries);
+        for (size_t i = 0; i < sample->numEntries; i++) {
+            if (entries[i].kind != ENTRY_DIR) {
+                continue;
+            }
+            if (pidList.count == pidList.capacity) {
+                size_t capacity = pidList.capacity ? pidList.capacity * 2 : 1024;
+                pidList.pids = resizeArray(pidList.pids, capacity * sizeof(int));
+                pidList.capacity = capacity;
+            }
+            pidList.pids[pidList.count++] = (int) strtol(replayArchive.map + entries[i].path, NULL, 10);
+        }
+    } else {
+        // the proc directory descriptor is only used with openat(), so it is
+        // simply listed again from the start
+        if (lseek(procDirFd, 0, SEEK_SET) == -1 || scanNumericDir(procDirFd, &pidList, true) == -1) {
+            procFailed("getdents64");
+        }
+    }
+
+    pidsListed = true;
+    return &pidList;
+}
+
+/* countPidDir func counts the numeric entries of a directory of a process,
+ * like its threads (task) or its open files (fd)
+ * Parameters:
+ * - the [pid] directory
+ * - the directory in it
+ *
+ * Returns the number of entries, -1 if the directory could not be read (or
+ * was not captured, in replay mode)
+ * */
+int countPidDir(struct pid_dir *dir, const char *path) {
+
+    if (replaying) {
+        char entryPath[64];
+        snprintf(entryPath, sizeof(entryPath), "%s/%s", dir->name, path);
+        const struct archive_entry *entry = archiveFind(entryPath);
+        if (entry == NULL || entry->kind != ENTRY_COUNT) {
+            return -1;
+        }
+        return (int) strtol(replayArchive.map + entry->body, NULL, 10);
+    }
+    if (dir->fd == -1) {
+        return -1;
+    }
+    int fd = openat(dir->fd, path, O_RDONLY | O_DIRECTORY);
+    ioStats.opens++;
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t count = scanNumericDir(fd, NULL, false);
+    close(fd);
+
+    return (int) count;
+}
+
+/* listPids func copies the pids of the sample that pass a filter
+ * Parameters:
+ * - pointer to int array pointer, the array is allocated and must be freed
+ * - pids to leave out, or NULL to list all
+ *
+ * Returns the number of pids
+ * */
+size_t listPids(int **pids, const struct task_filter *filter) {
+
+    const struct pid_list *all = samplePids();
+    size_t count = 0;
+    *pids = resizeArray(NULL, (all->count ? all->count : 1) * sizeof(int));
+
+    for (size_t i = 0; i < all->count; i++) {
+        if (filter == NULL || pidWanted(filter, all->pids[i])) {
+            (*pids)[count++] = all->pids[i];
+        }
+    }
+
+    return count;
+}
+
+/* openPidDir func opens the [pid] directory of a process
+ * Parameters:
+ * - the pid
+ * - pointer to pid_dir struct that will be filled
+ *
+ * Returns false if the process is gone
+ * */
+bool openPidDir(int pid, struct pid_dir *dir) {
+    snprintf(dir->name, sizeof(dir->name), "%d", pid);
+    if (replaying) {
+        const struct archive_entry *entry = archiveFind(dir->name);
+        dir->fd = -1;
+        return entry != NULL && entry->kind == ENTRY_DIR;
+    }
+    dir->fd = openat(procDirFd, dir->name, O_RDONLY | O_DIRECTORY);
+    ioStats.opens++;
+    return dir->fd != -1;
+}
+
+/* pidDirOwner func gets the owner of a process from its open [pid] directory
+ * Parameters:
+ * - the directory
+ * - pointer to uid_t to which the owner will be written
+ *
+ * Returns false if the process is gone
+ * */
+bool pidDirOwner(struct pid_dir *dir, uid_t *uid) {
+    if (replaying) {
+        return pidOwner(dir->name, uid);
+    }
+    struct stat pidStat;
+    ioStats.stats++;
+    if (fstat(dir->fd, &pidStat) == -1) {
+        return false;
+    }
+    *uid = pidStat.st_uid;
+    return true;
+}
+
+/* readPidFile func reads a file of an open [pid] directory
+ * Parameters:
+ * - the directory
+ * - name of the file
+ * - buffer the file is read into
+ *
+ * Returns the NUL terminated content, or NULL if it could not be read. In
+ * replay mode it points into the archive and must not be changed
+ * */
+const char *readPidFile(struct pid_dir *dir, const char *file, struct read_buf *buf, size_t *len) {
+    if (replaying) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/%s", dir->name, file);
+        return archiveText(path, len);
+    }
+    if (readAt(dir->fd, file, buf) <= 0) {
+        return NULL;
+    }
+    *len = buf->len;
+    return buf->data;
+}
+
+/* closePidDir func closes a [pid] directory opened by openPidDir() */
+void closePidDir(struct pid_dir *dir) {
+    if (dir->fd != -1) {
+        close(dir->fd);
+        dir->fd = -1;
+    }
+}
+
+/* pidOwner func gets the owner of a process without opening anything
+ * Parameters:
+ * - name of the [pid] directory
+ * - pointer to uid_t to which the owner will be written
+ *
+ * Returns false if the process is gone
+ * */
+bool pidOwner(const char *pidName, uid_t *uid) {
+    if (replaying) {
+        const struct archive_entry *entry = archiveFind(pidName);
+        if (entry == NULL || entry->kind != ENTRY_DIR) {
+            return false;
+        }
+        *uid = entry->uid;
+        return true;
+    }
+    struct stat pidStat;
+    ioStats.stats++;
+    if (fstatat(procDirFd, pidName, &pidStat, 0) == -1) {
+        return false;
+    }
+    *uid = pidStat.st_uid;
+    return true;
+}
+
+/* readProcPath func reads a file of a process by its path in proc, like
+ * "123/stat"
+ * Parameters:
+ * - the path
+ * - buffer the file is read into
+ *
+ * Returns the NUL terminated content, or NULL if it could not be read. In
+ * replay mode it points into the archive and must not be changed
+ * */
+const char *readProcPath(const char *path, struct read_buf *buf, size_t *len) {
+    if (replaying) {
+        return archiveText(path, len);
+    }
+    if (readAt(procDirFd, path, buf) <= 0) {
+        return NULL;
+    }
+    *len = buf->len;
+    return buf->data;
+}
+
+/* stateName func turns the state letter of a stat file into its name
+ * Parameters:
+ * - the letter
+ * - pointer to char array (15 bytes) to which the name will be written
+ *
+ * */
+void stateName(char state, char *name) {
+    switch (state) {
+        case 'S':
+            strcpy(name, "sleeping");
+            break;
+        case 'R':
+            strcpy(name, "running");
+            break;
+        case 'I':
+            strcpy(name, "idle");
+            break;
+        case 'X':
+            strcpy(name, "dead");
+            break;
+        case 'Z':
+            strcpy(name, "zombie");
+            break;
+        case 'T':
+            strcpy(name, "tracing stop");
+            break;
+        case 'D':
+            strcpy(name, "disk sleep");
+            break;
+        default:
+            name[0] = state;
+            name[1] = '\0';
+            break;
+    }
+}
+
+/* setTaskCounters func copies the parts of a stat file that can change (state,
+ * parent, num of tasks, cpu time and memory) to a task_info
+ * Parameters:
+ * - pointer to the task_info
+ * - the parsed stat file
+ *
+ * */
+void setTaskCounters(struct task_info *info, const struct pid_stat *stat) {
+    stateName(stat->state, info->state);
+    info->ppid = (int) pidStatField(stat, PS_PPID);
+    info->tasks = (int) pidStatField(stat, PS_THREADS);
+    info->cpuTime = pidStatField(stat, PS_UTIME) + pidStatField(stat, PS_STIME);
+    info->vszKB = pidStatField(stat, PS_VSIZE) / 1024;
+    info->rssKB = pidStatField(stat, PS_RSS) * pageKB;
+}
+
+/* readTaskFiles func reads the sources of a process that come after the
+ * stat file: status, cmdline, io, smaps_rollup and the fd directory. Each one
+ * is only read if it was asked for; one that can not be read leaves its
+ * values at -1, the process is still shown
+ * Parameters:
+ * - the [pid] directory
+ * - pointer to the task_info
+ * - the sources to read
+ * - buffer the files are read into
+ *
+ * */
+void readTaskFiles(struct pid_dir *dir, struct task_info *info, unsigned sources, struct read_buf *buf) {
+
+    const char *text;
+    size_t len;
+
+    if ((sources & TS_STATUS) && (text = readPidFile(dir, "status", buf, &len)) != NULL) {
+        info->swapKB = keyValue(text, text + len, "VmSwap:");
+    }
+    if ((sources & TS_IO) && (text = readPidFile(dir, "io", buf, &len)) != NULL) {
+        long long readBytes = keyValue(text, text + len, "read_bytes:");
+        long long writeBytes = keyValue(text, text + len, "write_bytes:");
+        info->readKB = readBytes < 0 ? -1 : readBytes / 1024;
+        info->writeKB = writeBytes < 0 ? -1 : writeBytes / 1024;
+    }
+    if ((sources & TS_SMAPS) && (text = readPidFile(dir, "smaps_rollup", buf, &len)) != NULL) {
+        info->pssKB = keyValue(text, text + len, "Pss:");
+    }
+    if ((sources & TS_CMDLINE) && (text = readPidFile(dir, "cmdline", buf, &len)) != NULL) {
+        // the arguments are separated by NULs, they are shown with spaces
+        while (len > 0 && text[len - 1] == '\0') {
+            len--;
+        }
+        // without the memory it is left out like a cmdline that can not be read
+        char *cmdline = malloc(len + 1);
+        if (cmdline != NULL) {
+            for (size_t i = 0; i < len; i++) {
+                cmdline[i] = text[i] != '\0' ? text[i] : ' ';
+            }
+            cmdline[len] = '\0';
+        }
+        info->cmdline = cmdline;
+    }
+    if (sources & TS_FD) {
+        info->fds = countPidDir(dir, "fd");
+    }
+}
+
+/**
+ * collectTask reads what the columns need to know about one process: only
+ * the sources it is asked for are read, so a narrow task list is cheap and
+ * cmdline, io or smaps_rollup cost nothing unless they are shown.
+ * A process that was already there at the last scan (same pid and start time)
+ * only has its stat file read again; the name, the user and the cmdline are
+ * kept from the process table, they are read once in the life of the process.
+ * For a new process the [pid] directory is opened once and everything else
+ * is read relative to it, so if the pid is reused while we are reading, the
+ * reads fail instead of mixing two processes. With only the pid and the user
+ * wanted nothing is opened, the owner comes from an fstatat()
+ * Parameters:
+ * - the pid
+ * - pointer to task_info struct that will be filled
+ * - the process with this pid at the last scan, or NULL
+ * - which processes are shown; 'shown' is set by the filters on the name
+ *   and the state, a process of another user is not read at all
+ * - the sources to read, task_source bits
+ * - buffer the files are read into
+ *
+ * Returns true if the process could be read, false if it is gone
+ * (processes can exit at any point while we are scanning /proc) or left
+ * out by the user filter
+ */
+bool collectTask(int pid, struct task_info *info, const struct task_info *known,
+        const struct task_filter *filter, unsigned sources, struct read_buf *buf) {
+
+    info->pid = pid;
+    info->shown = false;
+    info->ppid = -1;
+    info->swapKB = -1;
+    info->pssKB = -1;
+    info->readKB = -1;
+    info->writeKB = -1;
+    info->fds = -1;
+    info->cmdline = NULL;
+
+    char pidName[16];
+    snprintf(pidName, sizeof(pidName), "%d", pid);
+
+    // the owner is the cheapest thing to check after the pid: a stat of the
+    // [pid] directory, nothing is opened
+    uid_t uid;
+    bool haveOwner = false;
+    if (filter->byUser) {
+        if (!pidOwner(pidName, &uid) || uid != filter->uid) {
+            return false;
+        }
+        haveOwner = true;
+    }
+
+    struct pid_stat stat;
+    const char *statLine;
+    size_t statLen;
+    char state = '\0';
+    bool reused = false;
+
+    if (known != NULL && (sources & TS_STAT)) {
+        char statPath[32];
+        snprintf(statPath, sizeof(statPath), "%d/stat", pid);
+        if ((statLine = readProcPath(statPath, buf, &statLen)) == NULL) {
+            return false;
+        }
+        if (parsePidStat(statLine, statLen, &stat)
+                && pidStatField(&stat, PS_START_TIME) == known->startTime) {
+            strcpy(info->name, known->name);
+            info->uid = known->uid;
+            info->user = known->user;
+            info->startTime = known->startTime;
+            setTaskCounters(info, &stat);
+            state = stat.state;
+            reused = true;
+        }
+        // otherwise the pid belongs to a new process now
+    }
+
+    struct pid_dir dir = { -1, "" };
+    bool dirOpen = false;
+
+    if (!reused && (sources & TS_STAT)) {
+        if (!openPidDir(pid, &dir)) {
+            return false;
+        }
+        dirOpen = true;
+
+        // get process owner
+        if ((sources & TS_OWNER) && !pidDirOwner(&dir, &uid)) {
+            closePidDir(&dir);
+            return false;
+        }
+
+        //get info about each task in /proc/[pid]/stat
+        if ((statLine = readPidFile(&dir, "stat", buf, &statLen)) == NULL) {
+            closePidDir(&dir);
+            return false;
+        }
+
+        // name, state, num of tasks (num_threads), cpu time, start time and
+        // memory all come from the same read of the stat file. It is not
+        // changed, so a line in the replayed archive is used where it is
+        if (!parsePidStat(statLine, statLen, &stat)) {
+            closePidDir(&dir);
+            return false;
+        }
+        info->startTime = pidStatField(&stat, PS_START_TIME);
+        setTaskCounters(info, &stat);
+        state = stat.state;
+
+        // task name, cut to 25 bytes
+        size_t nameLen = stat.commLen < 25 ? stat.commLen : 25;
+        memcpy(info->name, stat.comm, nameLen);
+        info->name[nameLen] = '\0';
+
+        if (sources & TS_OWNER) {
+            info->uid = uid;
+            info->user = userName(uid);
+        }
+    } else if (!reused && (sources & TS_OWNER)) {
+        if (!haveOwner && !pidOwner(pidName, &uid)) {
+            return false;
+        }
+        info->uid = uid;
+        info->user = userName(uid);
+    }
+
+    // the name and state filters make collectTasks() read the stat file
+    info->shown = taskWanted(filter, info, state);
+
+    // the cmdline of a reused process is borrowed from the process table,
+    // updateProcTable() moves it to the new table
+    if (info->shown && reused && (sources & TS_CMDLINE) && known->cmdline != NULL) {
+        info->cmdline = known->cmdline;
+        sources &= ~TS_CMDLINE;
+    }
+
+    if (info->shown && (sources & TS_FILES)) {
+        if (!dirOpen && !openPidDir(pid, &dir)) {
+            return false;
+        }
+        readTaskFiles(&dir, info, sources, buf);
+    }
+    closePidDir(&dir);
+
+    return true;
+}
+
+/* collectBatches func is the work of a collection thread: it grabs small
+ * batches of pids from the shared counter until there is nothing left, so one
+ * slow process only holds up the thread that is reading it
+ * Parameters:
+ * - the pool
+ * - buffer of the thread, reused for all the files it reads
+ *
+ * */
+void collectBatches(struct task_pool *pool, struct read_buf *buf) {
+    while (true) {
+        size_t start = atomic_fetch_add(&pool->next, TASK_BATCH);
+        if (start >= pool->count) {
+            break;
+        }
+        size_t end = start + TASK_BATCH;
+        if (end > pool->count) {
+            end = pool->count;
+        }
+        for (size_t i = start; i < end; i++) {
+            pool->tasks[i].valid = collectTask(pool->pids[i], &pool->tasks[i],
+                    knownTask(pool->pids[i]), pool->filter, pool->sources, buf);
+        }
+    }
+}
+
+/**
+ * taskWorker is the body of each collection thread started by collectTasks()
+ */
+void *taskWorker(void *arg) {
+    struct task_pool *pool = arg;
+
+    struct read_buf buf = { NULL, 0, 0 };
+    collectBatches(pool, &buf);
+    freeBuf(&buf);
+    foldIoStats();
+
+    return NULL;
+}
+
+/* procSlot func finds the slot of a pid in a process table: either the
+ * slot holding it or the empty slot where it should go
+ * Parameters:
+ * - the table, it must have at least one empty slot
+ * - the pid
+ *
+ * */
+struct proc_entry *procSlot(struct proc_table *table, int pid) {
+    size_t mask = table->capacity - 1;
+    size_t i = ((size_t) pid * 2654435761u) & mask;
+    while (table->entries[i].used && table->entries[i].task.pid != pid) {
+        i = (i + 1) & mask;
+    }
+    return &table->entries[i];
+}
+
+/* knownTask func looks a pid up in the process table of the last scan. The
+ * table does not change while the workers are scanning, so no lock is needed
+ * Parameters:
+ * - the pid
+ *
+ * Returns the process the pid had at the last scan, or NULL
+ * */
+const struct task_info *knownTask(int pid) {
+    struct proc_table *last = &procTables[!currentTable];
+    if (!last->valid || last->count == 0) {
+        return NULL;
+    }
+    struct proc_entry *entry = procSlot(last, pid);
+    return entry->used ? &entry->task : NULL;
+}
+
+/**
+ * updateProcTable compares this scan with the last one: it calculates the
+ * %CPU of every task, the share of one cpu it used since the last scan (ticks
+ * used / ticks that passed), and puts the tasks into the process table for
+ * the next scan. Processes that exited are left out of the new table. A
+ * process that started since the last scan used its cpu time in less than
+ * the time between the scans, so its %CPU is over its life. Without an
+ * earlier scan there is nothing to compare with and %CPU is -1 (shown as
+ * '-'): the average over the life of the process is a different number.
+ * The cmdlines go with the tasks into the new table; the ones of the last
+ * table that no task took (the process exited) are freed.
+ * Parameters:
+ * - the tasks of this scan, scanned at procTables[currentTable].time
+ *
+ */
+void updateProcTable(struct task_pool *pool) {
+
+    static long ticksPerSec = 0;
+    if (ticksPerSec == 0) {
+        ticksPerSec = sysconf(_SC_CLK_TCK);
+        if (ticksPerSec <= 0) {
+            ticksPerSec = 100;
+        }
+    }
+
+    struct proc_table *current = &procTables[currentTable];
+    struct proc_table *last = &procTables[!currentTable];
+
+    double elapsed = 0;
+    if (last->valid) {
+        elapsed = (current->time.tv_sec - last->time.tv_sec)
+                + (current->time.tv_nsec - last->time.tv_nsec) / 1e9;
+    }
+
+    double uptime = 0;
+    char *next_tok = readFile(PF_UPTIME);
+    char *uptimeStr = next_token(&next_tok, " ");
+    if (uptimeStr != NULL) {
+        uptime = strtod(uptimeStr, NULL);
+    }
+
+    // the table of this scan, at most half full
+    size_t capacity = 16;
+    while (capacity < pool->count * 2) {
+        capacity *= 2;
+    }
+    // the cmdlines of this table were moved on or freed by the last update
+    if (capacity > current->capacity) {
+        current->entries = resizeArray(current->entries, capacity * sizeof(struct proc_entry));
+        current->capacity = capacity;
+    }
+    memset(current->entries, 0, current->capacity * sizeof(struct proc_entry));
+    current->count = 0;
+
+    size_t started = 0;
+    for (size_t i = 0; i < pool->count; i++) {
+        struct task_info *task = &pool->tasks[i];
+        if (!task->valid) {
+            continue;
+        }
+
+        struct proc_entry *known = NULL;
+        if (last->valid && last->count > 0) {
+            known = procSlot(last, task->pid);
+        }
+        const struct task_info *before = known != NULL && known->used ? &known->task : NULL;
+        if (before != NULL && before->startTime != task->startTime) {
+            before = NULL;
+        }
+        if (before != NULL && before->cmdline == task->cmdline) {
+            known->task.cmdline = NULL;
+        }
+        if (before == NULL) {
+            started++;
+        }
+        double lifetime = uptime - (double) task->startTime / ticksPerSec;
+        if (before != NULL && elapsed > 0 && task->cpuTime >= before->cpuTime) {
+            task->cpuPercent = (float) ((task->cpuTime - before->cpuTime) * 100.0 / ticksPerSec / elapsed);
+        } else if (before == NULL && elapsed > 0 && lifetime <= elapsed) {
+            task->cpuPercent = lifetime > 0 ? (float) (task->cpuTime * 100.0 / ticksPerSec / lifetime) : 0;
+        } else {
+            task->cpuPercent = -1;
+        }
+
+        struct proc_entry *entry = procSlot(current, task->pid);
+        if (!entry->used) {
+            current->count++;
+        }
+        entry->used = true;
+        entry->task = *task;
+    }
+
+    // what is left in the last table belongs to processes that are gone
+    for (size_t i = 0; last->valid && i < last->capacity; i++) {
+        free(last->entries[i].task.cmdline);
+        last->entries[i].task.cmdline = NULL;
+    }
+
+    LOG("%zu processes, %zu new, %zu exited\n", current->count, started,
+            last->valid ? last->count + started - current->count : 0);
+
+    current->valid = true;
+    currentTable = !currentTable;
+}
+
+/* freeProcTables func frees both process tables, the next scan starts
+ * without an earlier one (%CPU is then not known)
+ *
+ * */
+void freeProcTables() {
+    for (int i = 0; i < 2; i++) {
+        for (size_t e = 0; e < procTables[i].capacity; e++) {
+            free(procTables[i].entries[e].task.cmdline);
+        }
+        free(procTables[i].entries);
+    }
+    memset(procTables, 0, sizeof(procTables));
+    currentTable = 0;
+}
+
+/**
+ * collectTasks collects everything the task list shows about every process
+ * Parameters:
+ * - pointer to task_pool struct that will be filled, in the order of proc
+ * - number of threads used to collect the info about processes
+ * - which processes are shown
+ * - what is read about them, task_source bits. The filters on the name and
+ *   the state add the stat file
+ *
+ */
+void collectTasks(struct task_pool *pool, int numThreads, const struct task_filter *filter, unsigned sources) {
+
+    if (pageKB == 0) {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        pageKB = pageSize >= 1024 ? pageSize / 1024 : 4;
+    }
+
+    pool->pids = NULL;
+    pool->tasks = NULL;
+    pool->buf = (struct read_buf) { NULL, 0, 0 };
+
+    // first collect all the [pid] folders
+    pool->count = listPids(&pool->pids, filter);
+
+    // then read them, either here or spread across worker threads
+    pool->tasks = calloc(pool->count ? pool->count : 1, sizeof(struct task_info));
+    if (pool->tasks == NULL) {
+        procFailed("calloc");
+    }
+    sampleClock(CLOCK_MONOTONIC, &procTables[currentTable].time);
+    atomic_init(&pool->next, 0);
+    pool->filter = filter;
+    pool->sources = sources;
+    if (filter->namePattern != NULL || filter->states != NULL) {
+        pool->sources |= TS_STAT;
+    }
+
+    if (numThreads > (int) pool->count) {
+        numThreads = (int) pool->count;
+    }
+
+    // the calling thread reads into the buffer of the pool, so a failure
+    // that jumps out of collectTask() (see procFailed()) does not lose it
+    if (numThreads <= 1) {
+        collectBatches(pool, &pool->buf);
+        foldIoStats();
+    } else {
+        pthread_t *threads = malloc(numThreads * sizeof(pthread_t));
+        int started = 0;
+        for (int i = 0; threads != NULL && i < numThreads; i++) {
+            if (pthread_create(&threads[started], NULL, taskWorker, pool) != 0) {
+                LOG("Could not start worker %d, continuing with %d\n", i, started);
+                break;
+            }
+            started++;
+        }
+        // if no worker could be started do the work ourselves
+        if (started == 0) {
+            collectBatches(pool, &pool->buf);
+            foldIoStats();
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+    }
+
+    updateProcTable(pool);
+
+}
+
+/* frees the memory held by a task_pool, the cmdlines belong to the process
+ * table */
+void freeTasks(struct task_pool *pool) {
+    freeBuf(&pool->buf);
+    free(pool->pids);
+    free(pool->tasks);
+}
+
+/**
+ * Retrieves the next token from a string.
+ *
+ * Parameters:
+ * - str_ptr: maintains context in the string, i.e., where the next token in the
+ *   string will be. If the function returns token N, then str_ptr will be
+ *   updated to point to token N+1. To initialize, declare a char * that points
+ *   to the string being tokenized. The pointer will be updated after each
+ *   successive call to next_token.
+ *
+ * - delim: the set of characters to use as delimiters
+ *
+ * Returns: char pointer to the next token in the string.
+ */
+char *next_token(char **str_ptr, const char *delim)  {
+    if (*str_ptr == NULL) {
+        return NULL;
+    }
+
+    size_t tok_start = strspn(*str_ptr, delim);
+    size_t tok_end = strcspn(*str_ptr + tok_start, delim);
+
+    /* Zero length token. We must be finished. */
+    if (tok_end  <= 0) {
+        *str_ptr = NULL;
+        return NULL;
+    }
+
+    /* Take note of the start of the current token. We'll return it later. */
+    char *current_ptr = *str_ptr + tok_start;
+
+    /* Shift pointer forward (to the end of the current token) */
+    *str_ptr += tok_start + tok_end;
+
+    if (**str_ptr == '\0') {
+        /* If the end of the current token is also the end of the string, we
+         * must be at the last token. */
+        *str_ptr = NULL;
+    } else {
+        /* Replace the matching delimiter with a NUL character to terminate the
+         * token string. */
+        **str_ptr = '\0';
+
+        /* Shift forward one character over the newly-placed NUL so that
+         * next_pointer now points at the first character of the next token. */
+        (*str_ptr)++;
+    }
+
+    return current_ptr;
+}
+
+/* An open proc file system: the stat snapshots the cpu usage is calculated
+ * from. Everything else lives in the globals above, that is why only one
+ * inspector can be open at a time */
+struct inspector {
+    struct stat_snapshot stats[2];
+    int current;
+    bool sampled;
+};
+
+/* Snapshot of the processes, handed out one by one */
+struct inspector_procs {
+    struct task_pool pool;
+    size_t next;
+};
+
+/* The inspector that is open, if any */
+static struct inspector *openInspector = NULL;
+
+struct inspector *inspector_open(const char *procDir) {
+
+    if (openInspector != NULL || replaying) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    struct inspector *inspector = calloc(1, sizeof(struct inspector));
+    if (inspector == NULL) {
+        return NULL;
+    }
+
+    procDirFd = open(procDir != NULL ? procDir : "/proc", O_RDONLY | O_DIRECTORY);
+    if (procDirFd == -1) {
+        free(inspector);
+        return NULL;
+    }
+
+    openInspector = inspector;
+    return inspector;
+}
+
+void inspector_close(struct inspector *inspector) {
+    if (inspector == NULL) {
+        return;
+    }
+
+    closeProcFiles();
+    freePids();
+    freeProcTables();
+    freeUsers();
+    close(procDirFd);
+    procDirFd = -1;
+    freeStat(&inspector->stats[0]);
+    freeStat(&inspector->stats[1]);
+    free(inspector);
+    openInspector = NULL;
+}
+
+int inspector_system(struct inspector *inspector, struct inspector_system *system) {
+    (void) inspector;
+
+    jmp_buf failure;
+    int error = setjmp(failure);
+    if (error != 0) {
+        apiFailure = NULL;
+        errno = error;
+        return -1;
+    }
+    apiFailure = &failure;
+
+    struct system_info info;
+    readSystem(&info);
+    apiFailure = NULL;
+
+    memcpy(system->hostname, info.hostname, sizeof(system->hostname));
+    memcpy(system->kernel, info.version, sizeof(system->kernel));
+    system->uptime = info.uptime;
+    return 0;
+}
+
+int inspector_hardware(struct inspector *inspector, struct inspector_hardware *hardware) {
+
+    jmp_buf failure;
+    int error = setjmp(failure);
+    if (error != 0) {
+        apiFailure = NULL;
+        errno = error;
+        return -1;
+    }
+    apiFailure = &failure;
+
+    // the two snapshots take turns, the other one is the previous call
+    struct stat_snapshot *stat = &inspector->stats[inspector->current];
+    struct stat_snapshot *previous = &inspector->stats[!inspector->current];
+    struct hardware_info info;
+    readStat(stat);
+    readHardware(&info, stat, inspector->sampled ? previous : stat);
+    apiFailure = NULL;
+
+    memcpy(hardware->cpuModel, info.cpuModel, sizeof(hardware->cpuModel));
+    hardware->numCpus = info.numCpus;
+    memcpy(hardware->load, info.load, sizeof(hardware->load));
+    hardware->cpuUsage = inspector->sampled ? info.cpuUsage : NAN;
+    hardware->memTotalKB = (unsigned long long) info.memTotal;
+    hardware->memActiveKB = (unsigned long long) info.memActive;
+
+    inspector->current = !inspector->current;
+    inspector->sampled = true;
+    return 0;
+}
+
+struct inspector_procs *inspector_procs_open(struct inspector *inspector) {
+    (void) inspector;
+
+    struct inspector_procs *volatile procs = calloc(1, sizeof(struct inspector_procs));
+    if (procs == NULL) {
+        return NULL;
+    }
+
+    jmp_buf failure;
+    int error = setjmp(failure);
+    if (error != 0) {
+        apiFailure = NULL;
+        inspector_procs_close(procs);
+        errno = error;
+        return NULL;
+    }
+    apiFailure = &failure;
+
+    static const struct task_filter everything = { NULL, 0, false, 0, NULL, NULL };
+    forgetPids();
+    collectTasks(&procs->pool, 1, &everything, TS_DEFAULT);
+    apiFailure = NULL;
+
+    return procs;
+}
+
+bool inspector_procs_next(struct inspector_procs *procs, struct inspector_process *process) {
+
+    // processes that exited while they were read are skipped
+    while (procs->next < procs->pool.count && !procs->pool.tasks[procs->next].valid) {
+        procs->next++;
+    }
+    if (procs->next == procs->pool.count) {
+        return false;
+    }
+
+    const struct task_info *task = &procs->pool.tasks[procs->next++];
+    process->pid = task->pid;
+    memcpy(process->state, task->state, sizeof(process->state));
+    memcpy(process->name, task->name, sizeof(process->name));
+    process->uid = task->uid;
+    process->user = task->user;
+    process->threads = task->tasks;
+    process->cpuPercent = task->cpuPercent;
+    process->rssKB = task->rssKB;
+    process->vszKB = task->vszKB;
+    process->startTime = task->startTime;
+    return true;
+}
+
+void inspector_procs_close(struct inspector_procs *procs) {
+    if (procs == NULL) {
+        return;
+    }
+
+    freeTasks(&procs->pool);
+    free(procs);
+}
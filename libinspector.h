@@ -0,0 +1,398 @@
+#ifndef LIBINSPECTOR_H
+#define LIBINSPECTOR_H
+
+#include <dirent.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * Internal interface of libinspector: the collectors and the structs they
+ * fill, shared by libinspector.c and the inspector program. Unlike
+ * inspector.h it changes whenever the program needs it to.
+ */
+
+/* Preprocessor Directives */
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+/**
+ * Logging functionality. Set DEBUG to 1 to enable logging, 0 to disable.
+ */
+#define LOG(fmt, ...) \
+    do { if (DEBUG) fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, \
+            __LINE__, __func__, __VA_ARGS__); } while (0)
+
+/* How much of a file is read by a single call */
+#define READ_CHUNK_SZ 4096
+
+/* How much of a directory is read by a single getdents64() call, a few
+ * thousand entries of proc */
+#define DENTS_BUF_SZ (64 * 1024)
+
+/* Growable buffer files are read into. It is reused between reads and only
+ * grows when a file does not fit, so nothing is ever cut off */
+struct read_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/* Syscalls and lookups made by the collectors. Every thread counts into its
+ * own copy, so counting is a plain increment; takeIoStats() adds them up */
+struct io_stats {
+    unsigned long long opens;
+    unsigned long long reads;
+    unsigned long long bytesRead;
+    unsigned long long getdents;
+    unsigned long long stats;
+    /* userName() calls, and the ones that read the passwd file or asked NSS */
+    unsigned long long userLookups;
+    unsigned long long passwdLookups;
+};
+
+/* Callback used by readChunks(), returns false to stop reading */
+typedef bool (*chunk_fn)(const char *chunk, size_t len, void *ctx);
+
+/* Columns of the cpu lines in /proc/stat */
+enum cpu_field {
+    CPU_USER,
+    CPU_NICE,
+    CPU_SYSTEM,
+    CPU_IDLE,
+    CPU_IOWAIT,
+    CPU_IRQ,
+    CPU_SOFTIRQ,
+    CPU_STEAL,
+    CPU_GUEST,
+    CPU_GUEST_NICE,
+    CPU_FIELDS
+};
+
+/* Time a cpu spent in each state since boot, in USER_HZ */
+struct cpu_times {
+    unsigned long long field[CPU_FIELDS];
+};
+
+/* Everything the sections need from /proc/stat, parsed in one pass. One
+ * snapshot is taken per sample and shared by all the sections. 'time' is
+ * CLOCK_BOOTTIME when the file was read. cpuIds has the N of the "cpuN" line
+ * of every row of cpus: offline cpus are not listed, so the rows of two
+ * snapshots are not always the same cpus */
+struct stat_snapshot {
+    struct timespec time;
+    struct cpu_times total;
+    struct cpu_times *cpus;
+    int *cpuIds;
+    int numCpus;
+    int cpusCap;
+    unsigned long long intr;
+    unsigned long long ctxt;
+    unsigned long long processes;
+    unsigned long long procsRunning;
+    unsigned long long procsBlocked;
+};
+
+/* System wide files in proc used by the sections. They are opened once and
+ * kept open for the whole run */
+enum proc_file {
+    PF_HOSTNAME,
+    PF_OSRELEASE,
+    PF_UPTIME,
+    PF_STAT,
+    PF_CPUINFO,
+    PF_LOADAVG,
+    PF_MEMINFO,
+    PF_COUNT
+};
+
+/* What the system section shows */
+struct system_info {
+    char hostname[256];
+    char version[256];
+    long int uptime;
+};
+
+/* What the hardware section shows. Memory is in kB */
+struct hardware_info {
+    char cpuModel[100];
+    int numCpus;
+    char loadAvg[100];
+    double load[3];
+    float cpuUsage;
+    float memTotal;
+    float memActive;
+};
+
+/* What the task summary shows */
+struct task_counts {
+    int tasks;
+    unsigned long long intr;
+    unsigned long long ctxt;
+    unsigned long long forks;
+};
+
+/* Archive of procfs samples written by --capture and read by --replay. It
+ * starts with ARCHIVE_MAGIC and ARCHIVE_VERSION (uint32_t), then come the
+ * file bodies, each stored once and followed by a NUL, and the entries of
+ * every sample sorted by path. The sample table and the archive_trailer are
+ * at the end, they are rewritten after every sample. Numbers are in the byte
+ * order of the machine that captured */
+#define ARCHIVE_MAGIC "INSPARC1"
+
+#define ARCHIVE_VERSION 1
+
+/* Kinds of entries of a sample */
+enum entry_kind {
+    ENTRY_FILE,
+    ENTRY_DIR,
+    /* A directory that is only counted, like [pid]/fd: the body is the
+     * number of entries */
+    ENTRY_COUNT
+};
+
+/* One file or directory of a sample, offsets are from the start of the
+ * archive and times are CLOCK_BOOTTIME in ns */
+struct archive_entry {
+    uint64_t path;
+    uint64_t body;
+    uint64_t bodyLen;
+    int64_t time;
+    uint32_t pathLen;
+    uint32_t kind;
+    uint32_t uid;
+    uint32_t pad;
+};
+
+/* One sample: when it was taken and where its entries are */
+struct archive_sample {
+    int64_t realTime;
+    int64_t bootTime;
+    uint64_t entries;
+    uint64_t numEntries;
+};
+
+/* Last bytes of an archive */
+struct archive_trailer {
+    uint64_t samples;
+    uint64_t numSamples;
+    char magic[8];
+};
+
+/* Archive mapped by --replay and the sample the sections are reading */
+struct archive_reader {
+    const char *map;
+    size_t size;
+    const struct archive_sample *samples;
+    size_t numSamples;
+    size_t current;
+};
+
+/* A [pid] directory that is being read: its descriptor, or in replay mode
+ * just its name in the archive */
+struct pid_dir {
+    int fd;
+    char name[16];
+};
+
+/* Growable list of pids (or other numbers from directory names) */
+struct pid_list {
+    int *pids;
+    size_t count;
+    size_t capacity;
+};
+
+/* Which processes the task list shows. Every filter is checked as soon as
+ * the data it needs has been read, so the processes it leaves out are not
+ * read any further: pids on the directory entry, the user with fstatat(),
+ * the name and the state on the stat file */
+struct task_filter {
+    /* Sorted pids to show, or NULL for all */
+    int *pids;
+    size_t numPids;
+
+    /* Owner to show, if byUser is set */
+    bool byUser;
+    uid_t uid;
+
+    /* fnmatch() pattern the task name has to match, or NULL */
+    const char *namePattern;
+
+    /* State letters to show (like "RD"), or NULL for all */
+    const char *states;
+};
+
+/* What can be read about a process, as bits of a mask. Every column of the
+ * task list needs some of them, collectTasks() only reads the ones it is
+ * asked for */
+enum task_source {
+    TS_DIR = 1 << 0,        /* the entry of the [pid] directory: the pid */
+    TS_OWNER = 1 << 1,      /* owner of the [pid] directory, a stat */
+    TS_STAT = 1 << 2,       /* [pid]/stat */
+    TS_STATUS = 1 << 3,     /* [pid]/status */
+    TS_CMDLINE = 1 << 4,    /* [pid]/cmdline */
+    TS_IO = 1 << 5,         /* [pid]/io */
+    TS_SMAPS = 1 << 6,      /* [pid]/smaps_rollup */
+    TS_FD = 1 << 7          /* the entries of [pid]/fd, counted */
+};
+
+/* Sources read through the [pid] directory after the stat file */
+#define TS_FILES (TS_STATUS | TS_CMDLINE | TS_IO | TS_SMAPS | TS_FD)
+
+/* What the task list (and inspector.h) always had: pid, owner and stat */
+#define TS_DEFAULT (TS_DIR | TS_OWNER | TS_STAT)
+
+/* A file of the [pid] directory and the source it is */
+struct pid_source_file {
+    enum task_source source;
+    const char *file;
+};
+
+#define PID_SOURCE_FILES 4
+
+/* Everything the task list prints about a single process. The values of
+ * sources that were not read, or could not be (io and smaps_rollup of the
+ * processes of other users), are -1 and cmdline is NULL. cmdline is owned
+ * by the process table (see updateProcTable()) and stays valid until the
+ * next scan */
+struct task_info {
+    int pid;
+    bool valid;
+    char state[15];
+    char name[26];
+    uid_t uid;
+    const char *user;
+    bool shown;
+    int tasks;
+    unsigned long long startTime;
+    unsigned long long cpuTime;
+    float cpuPercent;
+    unsigned long long rssKB;
+    unsigned long long vszKB;
+    int ppid;
+    long long swapKB;
+    long long pssKB;
+    long long readKB;
+    long long writeKB;
+    int fds;
+    char *cmdline;
+};
+
+/* Fields of /proc/[pid]/stat the task list uses, numbered like in proc(5).
+ * Times are in clock ticks */
+enum pid_stat_field {
+    PS_PID = 1,
+    PS_COMM = 2,
+    PS_STATE = 3,
+    PS_PPID = 4,
+    PS_UTIME = 14,
+    PS_STIME = 15,
+    PS_THREADS = 20,
+    PS_START_TIME = 22,
+    PS_VSIZE = 23,
+    PS_RSS = 24,
+    PS_FIELDS = 52
+};
+
+/* A /proc/[pid]/stat line with the start of every field, found by
+ * parsePidStat(). Nothing is copied or converted: comm points into the line
+ * and pidStatField() parses a number only when it is asked for. The offsets
+ * are 16 bit, so the line can be at most 64K (a real one is well under 1K,
+ * even with a 15 byte comm and every field at its widest) */
+struct pid_stat {
+    const char *text;
+    const char *end;
+    const char *comm;
+    size_t commLen;
+    char state;
+    int numFields;
+    uint16_t field[PS_FIELDS + 1];
+};
+
+/* Work queue shared by the threads collecting the task list. Each thread
+ * takes the next batch of pids by bumping 'next', results go to the slot with
+ * the same index in 'tasks'. 'buf' is the read buffer of the thread that
+ * called collectTasks() when it collects too */
+struct task_pool {
+    int *pids;
+    struct task_info *tasks;
+    size_t count;
+    atomic_size_t next;
+    const struct task_filter *filter;
+    unsigned sources;
+    struct read_buf buf;
+};
+
+/* Paths of the system wide files in proc, relative to the proc directory */
+extern const char *procFileNames[PF_COUNT];
+
+/* Descriptor of the proc directory itself */
+extern int procDirFd;
+
+/* Buffers the system wide files are read into */
+extern struct read_buf procBufs[PF_COUNT];
+
+/* Files of a [pid] directory behind the sources that are files */
+extern const struct pid_source_file pidSourceFiles[PID_SOURCE_FILES];
+
+/* Set in replay mode: everything is read from replayArchive instead of proc */
+extern bool replaying;
+extern struct archive_reader replayArchive;
+
+/* Counters of the calling thread */
+extern _Thread_local struct io_stats ioStats;
+
+/* Function prototypes */
+void readSystem(struct system_info *info);
+void readHardware(struct hardware_info *info, const struct stat_snapshot *stat,
+        const struct stat_snapshot *previous);
+void readStat(struct stat_snapshot *stat);
+const char *skipLine(const char *pos, const char *end);
+unsigned long long parseUInt(const char **pos, const char *end);
+void parseStat(const char *text, size_t len, struct stat_snapshot *stat);
+bool parsePidStat(const char *text, size_t len, struct pid_stat *stat);
+long long keyValue(const char *text, const char *end, const char *key);
+unsigned long long pidStatField(const struct pid_stat *stat, enum pid_stat_field field);
+char *next_token(char **str_ptr, const char *delim);
+bool usableSample(const struct stat_snapshot *previous, const struct stat_snapshot *stat);
+bool loadCpuState(const char *dir, struct stat_snapshot *stat);
+void saveCpuState(const char *dir, const struct stat_snapshot *stat);
+void readMemory(float *memTotal, float *active);
+void cpuDeltas(const unsigned long long *restrict current, const unsigned long long *restrict previous,
+        float *restrict deltas, size_t count);
+void cpuPercentages(float *restrict matrix, int numCpus);
+const float *cpuBreakdown(const struct stat_snapshot *stat, const struct stat_snapshot *previous, int *numCpus,
+        const int **cpuIds);
+void countTasks(struct task_counts *counts, const struct stat_snapshot *stat);
+void foldIoStats();
+void takeIoStats(struct io_stats *stats);
+void growBuf(struct read_buf *buf, size_t need);
+void *resizeArray(void *array, size_t size);
+void freeBuf(struct read_buf *buf);
+int readChunks(int fd, chunk_fn callback, void *ctx);
+char *readFile(enum proc_file file);
+void procFailed(const char *what);
+void closeProcFiles();
+bool archiveMap(const char *path, struct archive_reader *archive);
+void sampleClock(clockid_t clock, struct timespec *time);
+bool openPidDir(int pid, struct pid_dir *dir);
+bool pidDirOwner(struct pid_dir *dir, uid_t *uid);
+const char *readPidFile(struct pid_dir *dir, const char *file, struct read_buf *buf, size_t *len);
+void closePidDir(struct pid_dir *dir);
+int compareInts(const void *a, const void *b);
+ssize_t scanNumericDir(int fd, struct pid_list *list, bool dirsOnly);
+void forgetPids();
+void freePids();
+const struct pid_list *samplePids();
+int countPidDir(struct pid_dir *dir, const char *path);
+size_t listPids(int **pids, const struct task_filter *filter);
+void collectTasks(struct task_pool *pool, int numThreads, const struct task_filter *filter, unsigned sources);
+void freeTasks(struct task_pool *pool);
+void freeProcTables();
+void freeUsers();
+
+#endif
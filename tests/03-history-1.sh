@@ -0,0 +1,21 @@
+#!/usr/bin/env bash
+# -d together with --history: the first recorded sample uses the cpu sample
+# saved by -d as the earlier one, so the rates need its ctxt, intr and
+# processes counters. The fake tree does not change, every rate must be 0
+
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "${dir}"' EXIT
+
+make -s bench/genprocfs
+./bench/genprocfs -n 10 "${dir}/tree" > /dev/null
+mkdir "${dir}/run"
+
+./inspector -p "${dir}/tree" -d "${dir}/run" -r > /dev/null
+# the saved sample is only used when it is at least 0.1 seconds old
+sleep 0.3
+./inspector -p "${dir}/tree" -d "${dir}/run" --history "${dir}/history" -r > /dev/null
+
+./inspector --history "${dir}/history" --query 1m -o json \
+    | grep -q '"ctxt_rate":0.00,"intr_rate":0.00,"fork_rate":0.00}'
@@ -0,0 +1,48 @@
+#!/usr/bin/env bash
+# inspector_open() after inspector_close() starts from scratch: the first
+# scan of the processes has no %CPU (-1) like the first scan of the first
+# open, nothing is kept from the one before
+
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "${dir}"' EXIT
+
+make -s bench/genprocfs libinspector.a
+./bench/genprocfs -n 20 "${dir}/tree" > /dev/null
+
+cat > "${dir}/reopen.c" <<'END'
+#include <stdio.h>
+#include "inspector.h"
+
+/* prints pid, user and %CPU of every process of a new inspector */
+static int scan(const char *procDir) {
+    struct inspector *inspector = inspector_open(procDir);
+    if (inspector == NULL) {
+        perror("inspector_open");
+        return 1;
+    }
+    struct inspector_procs *procs = inspector_procs_open(inspector);
+    if (procs == NULL) {
+        perror("inspector_procs_open");
+        return 1;
+    }
+    struct inspector_process process;
+    while (inspector_procs_next(procs, &process)) {
+        printf("%d %s %.1f\n", process.pid, process.user, process.cpuPercent);
+    }
+    inspector_procs_close(procs);
+    inspector_close(inspector);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    return argc != 2 || scan(argv[1]) || scan(argv[1]);
+}
+END
+gcc -pthread -I. "${dir}/reopen.c" libinspector.a -o "${dir}/reopen"
+
+"${dir}/reopen" "${dir}/tree" > "${dir}/out"
+lines=$(wc -l < "${dir}/out")
+(( lines == 40 ))
+diff <(head -20 "${dir}/out") <(tail -20 "${dir}/out")
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+# --sort and --top: the heap that picks the top N gives the first N rows of
+# the fully sorted list, numbers go largest first (the reverse of the text
+# columns) and ties go by pid. The expected order is made with sort(1) from
+# the list in pid order
+
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "${dir}"' EXIT
+
+make -s bench/genprocfs
+./bench/genprocfs -n 60 "${dir}/tree" > /dev/null
+
+# the rows of the task list, without the header and the padding
+rows() {
+    ./inspector -p "${dir}/tree" -l "$@" | tail -n +3 | sed 's/^ *//; s/ *| */|/g'
+}
+
+# pid order is the default
+[[ "$(rows -O pid)" == "$(seq 1 60)" ]]
+
+# numbers: largest first
+all=$(rows -O pid,rss)
+expected=$(sort -t '|' -k2,2nr -k1,1n <<< "${all}")
+[[ "$(rows -O pid,rss --sort rss)" == "${expected}" ]]
+[[ "$(rows -O pid,rss --sort rss --top 7)" == "$(head -n 7 <<< "${expected}")" ]]
+[[ "$(rows -O pid,rss --sort rss --top 1)" == "$(head -n 1 <<< "${expected}")" ]]
+[[ "$(rows -O pid,rss --sort rss --top 1000)" == "${expected}" ]]
+
+# text: smallest first, the many ties in pid order
+all=$(rows -O pid,state)
+expected=$(LC_ALL=C sort -t '|' -k2,2 -k1,1n <<< "${all}")
+[[ "$(rows -O pid,state --sort state)" == "${expected}" ]]
+[[ "$(rows -O pid,state --sort state --top 10)" == "$(head -n 10 <<< "${expected}")" ]]
+
+# every process has 1 task, so the top is the lowest pids
+[[ "$(rows -O pid,threads --sort tasks --top 5)" == "$(printf '%s|1\n' 1 2 3 4 5)" ]]
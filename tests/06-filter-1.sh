@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+# The task filters (--pid, -u, -n and --state) alone and together: the pids
+# that are left must be the ones the stat files and the owners of the [pid]
+# directories of the tree say, every filter narrowing the others down
+
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "${dir}"' EXIT
+
+make -s bench/genprocfs
+# with -u the [pid] directories get 3 owners, when run as root
+./bench/genprocfs -n 60 -u 3 "${dir}/tree" > /dev/null
+
+# pid, owner, state letter and name (cut to 25 bytes like the task list) of
+# every process, the name is between the first '(' and the last ')'
+for pidDir in "${dir}"/tree/[0-9]*; do
+    line=$(< "${pidDir}/stat")
+    name=${line#*(}
+    name=${name%)*}
+    rest=${line##*) }
+    printf '%s\t%s\t%s\t%s\n' "${pidDir##*/}" "$(stat -c %u "${pidDir}")" "${rest%% *}" "${name:0:25}"
+done | sort -n > "${dir}/table"
+
+# pids of the rows of the table for which the test in $1 is true
+pidsWhere() {
+    local pid uid state name
+    while IFS=$'\t' read -r pid uid state name; do
+        if eval "$1"; then
+            echo "${pid}"
+        fi
+    done < "${dir}/table"
+}
+
+shown() {
+    ./inspector -p "${dir}/tree" -l -O pid "$@" | tail -n +3 | tr -d ' '
+}
+
+uid=$(awk -F '\t' 'NR == 2 { print $2 }' "${dir}/table")
+
+# nothing left out without filters
+[[ "$(shown)" == "$(pidsWhere true)" ]]
+
+# --pid: pids that are not there are ignored
+[[ "$(shown --pid 3,7,11,50,999)" == "$(printf '%s\n' 3 7 11 50)" ]]
+
+# -u by uid
+[[ "$(shown -u "${uid}")" == "$(pidsWhere '[[ ${uid} == '"${uid}"' ]]')" ]]
+
+# --state with two letters
+[[ "$(shown --state RD)" == "$(pidsWhere '[[ ${state} == [RD] ]]')" ]]
+
+# -n with a shell pattern, and one for a name with brackets
+[[ "$(shown -n '*s*')" == "$(pidsWhere '[[ ${name} == *s* ]]')" ]]
+[[ "$(shown -n '(*')" == "$(pidsWhere '[[ ${name} == \(* ]]')" ]]
+
+# all of them together
+expected=$(pidsWhere '(( pid <= 40 )) && [[ ${uid} == '"${uid}"' && ${state} == [SD] && ${name} == *[a-m]* ]]')
+[[ -n "${expected}" ]]
+[[ "$(shown --pid "$(seq -s , 1 40)" -u "${uid}" --state SD -n '*[a-m]*')" == "${expected}" ]]
+
+# a filter nothing matches leaves an empty list
+[[ -z "$(shown -n 'no such task')" ]]
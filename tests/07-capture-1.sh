@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+# --capture then --replay gives what a live run prints (twice, the capture
+# has two samples of a tree that does not change), and archives that are
+# cut short or have an offset out of the file are rejected with an error
+# instead of being read
+
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "${dir}"' EXIT
+
+make -s bench/genprocfs
+./bench/genprocfs -n 30 "${dir}/tree" > /dev/null
+
+# every column but cpu, which needs two samples
+columns=pid,ppid,comm,user,uid,state,threads,rss,vsz,swap,pss,read,write,fds,cmdline
+
+./inspector -p "${dir}/tree" --capture "${dir}/archive" -s -t -l -O "${columns}"
+./inspector -p "${dir}/tree" -s -t -l -O "${columns}" > "${dir}/live"
+./inspector --replay "${dir}/archive" -s -t -l -O "${columns}" > "${dir}/replay"
+diff <(cat "${dir}/live" "${dir}/live") "${dir}/replay"
+
+# the replay must fail with the archive error, not crash or print anything
+rejected() {
+    local status=0
+    ./inspector --replay "$1" -s -t -l > "${dir}/out" 2> "${dir}/err" || status=$?
+    (( status == 1 )) && [[ ! -s "${dir}/out" ]] && grep -q "not an archive" "${dir}/err"
+}
+
+size=$(stat -c %s "${dir}/archive")
+
+head -c $(( size - 5 )) "${dir}/archive" > "${dir}/cut"
+rejected "${dir}/cut"
+
+head -c 100 "${dir}/archive" > "${dir}/short"
+rejected "${dir}/short"
+
+: > "${dir}/empty"
+rejected "${dir}/empty"
+
+# the trailer ends the file: offset of the sample table, number of samples
+# and the magic. Point the table past the end of the file
+cp "${dir}/archive" "${dir}/offset"
+printf '\377\377\377\377\377\377\377\177' \
+    | dd of="${dir}/offset" bs=1 seek=$(( size - 24 )) conv=notrunc status=none
+rejected "${dir}/offset"
+
+# and claim far more samples than there are
+cp "${dir}/archive" "${dir}/count"
+printf '\377\377\377\377\377\377\377\017' \
+    | dd of="${dir}/count" bs=1 seek=$(( size - 16 )) conv=notrunc status=none
+rejected "${dir}/count"
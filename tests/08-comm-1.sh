@@ -0,0 +1,75 @@
+#!/usr/bin/env bash
+# A comm with brackets and spaces, like "a) b (c", ends at the last ')' of
+# the stat line: the name is shown whole, and the state, ppid and times are
+# the fields after it and not the ones after the first ')'
+
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "${dir}"' EXIT
+
+make -s bench/genprocfs libinspector.a
+./bench/genprocfs -n 100 "${dir}/tree" > /dev/null
+
+# the fields of every stat line split in bash: the name between the first
+# '(' and the last ')', then state, ppid, utime, stime and start time
+for pidDir in "${dir}"/tree/[0-9]*; do
+    line=$(< "${pidDir}/stat")
+    name=${line#*(}
+    name=${name%)*}
+    read -r -a rest <<< "${line##*) }"
+    printf '%s|%s|%s|%s|%s|%s|%s\n' "${pidDir##*/}" "${name}" "${rest[0]}" "${rest[1]}" \
+        "${rest[11]}" "${rest[12]}" "${rest[19]}"
+done | sort -n > "${dir}/expected"
+
+odd=$(grep -c '^[0-9]*|a) b (c|' "${dir}/expected")
+(( odd > 0 ))
+
+cat > "${dir}/fields.c" <<'END'
+#include <stdio.h>
+#include <string.h>
+#include "libinspector.h"
+
+/* prints the same fields as the bash loop for each stat file given */
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        static char text[4096];
+        FILE *file = fopen(argv[i], "r");
+        if (file == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        size_t len = fread(text, 1, sizeof(text), file);
+        fclose(file);
+        struct pid_stat stat;
+        if (!parsePidStat(text, len, &stat)) {
+            fprintf(stderr, "%s: not parsed\n", argv[i]);
+            return 1;
+        }
+        printf("%llu|%.*s|%c|%llu|%llu|%llu|%llu\n", pidStatField(&stat, PS_PID),
+                (int) stat.commLen, stat.comm, stat.state, pidStatField(&stat, PS_PPID),
+                pidStatField(&stat, PS_UTIME), pidStatField(&stat, PS_STIME),
+                pidStatField(&stat, PS_START_TIME));
+    }
+    return 0;
+}
+END
+gcc -pthread -I. "${dir}/fields.c" libinspector.a -o "${dir}/fields"
+
+"${dir}/fields" "${dir}"/tree/[0-9]*/stat | sort -n > "${dir}/parsed"
+diff "${dir}/expected" "${dir}/parsed"
+
+# and what the task list shows, the name cut to 25 bytes and the state
+# letter spelled out
+./inspector -p "${dir}/tree" -l -O pid,comm,state,ppid | tail -n +3 \
+    | sed 's/^ *//; s/ *| */|/g; s/ *$//' > "${dir}/shown"
+awk -F '|' -v OFS='|' '
+    BEGIN {
+        split("S sleeping R running I idle Z zombie T tracing_stop D disk_sleep", words, " ")
+        for (i = 1; i < 12; i += 2) {
+            names[words[i]] = words[i + 1]
+            gsub("_", " ", names[words[i]])
+        }
+    }
+    { print $1, substr($2, 1, 25), names[$3], $4 }' "${dir}/expected" | diff - "${dir}/shown"
+grep -q '^[0-9]*|a) b (c|' "${dir}/shown"
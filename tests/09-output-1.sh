@@ -0,0 +1,62 @@
+#!/usr/bin/env bash
+# The shape of -o json and -o openmetrics: one JSON object per line with the
+# strings escaped, and an OpenMetrics exposition that ends with one "# EOF",
+# has a pid label on every task sample (even when the pid column is not
+# selected), no series twice and escaped label values
+
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "${dir}"' EXIT
+
+make -s bench/genprocfs
+./bench/genprocfs -n 5 "${dir}/tree" > /dev/null
+
+# process 3 gets a name with a quote and a backslash, and a cmdline with
+# quotes, a backslash, a newline, a tab and another control character
+line=$(< "${dir}/tree/3/stat")
+printf '%s\n' "3 (x\"y\\z) ${line##*) }" > "${dir}/tree/3/stat"
+printf '/bin/x\0a "q" b\\c\nnl\ttab\001\0' > "${dir}/tree/3/cmdline"
+
+# JSON: 2 sections and 5 tasks, each a whole object on its own line
+./inspector -p "${dir}/tree" -s -t -l -o json -O pid,comm,cmdline > "${dir}/json"
+(( $(wc -l < "${dir}/json") == 7 ))
+[[ -z "$(grep -v '^{"section":"[a-z]*","time":[0-9.]*,.*}$' "${dir}/json")" ]]
+[[ -z "$(LC_ALL=C grep '[[:cntrl:]]' "${dir}/json")" ]]
+grep -Fqx '"pid":3,"name":"x\"y\\z","cmdline":"/bin/x a \"q\" b\\c\u000anl\u0009tab\u0001"}' \
+    <(sed 's/^.*"time":[0-9.]*,//' "${dir}/json")
+
+# OpenMetrics: the task samples, labels and all, without their values
+taskSeries() {
+    grep '^inspector_task_' "$1" | sed 's/ [^ ]*$//'
+}
+
+checkMetrics() {
+    [[ "$(tail -n 1 "$1")" == "# EOF" ]]
+    (( $(grep -c '^# EOF$' "$1") == 1 ))
+    [[ -n "$(taskSeries "$1")" ]]
+    [[ -z "$(taskSeries "$1" | grep -v '^inspector_task_[a-z_]*{pid="[0-9]*"[,}]')" ]]
+    [[ -z "$(grep -v '^#' "$1" | sed 's/ [^ ]*$//' | sort | uniq -d)" ]]
+}
+
+# only '\', '"' and the newline are escaped in label values
+./inspector -p "${dir}/tree" -s -t -l -o openmetrics -O pid,comm,rss,cmdline > "${dir}/metrics"
+checkMetrics "${dir}/metrics"
+grep -Fqx 'inspector_task_resident_bytes{pid="3",name="x\"y\\z",cmdline="/bin/x a \"q\" b\\c\nnl'$'\t''tab'$'\001''"}' \
+    <(taskSeries "${dir}/metrics")
+
+# the pid label is there without the pid column, so the series stay apart
+# for processes with the same name
+./inspector -p "${dir}/tree" -l -o openmetrics -O comm,rss > "${dir}/metrics"
+checkMetrics "${dir}/metrics"
+(( $(taskSeries "${dir}/metrics" | wc -l) == 5 ))
+
+# a replayed capture prints every sample as an exposition of its own
+./inspector -p "${dir}/tree" --capture "${dir}/archive" -s -t -l -O comm,rss
+./inspector --replay "${dir}/archive" -s -t -l -o openmetrics -O comm,rss > "${dir}/replay"
+csplit -s -z -f "${dir}/sample" "${dir}/replay" '/^# EOF$/+1' '{*}'
+samples=("${dir}"/sample*)
+(( ${#samples[@]} == 2 ))
+for sample in "${samples[@]}"; do
+    checkMetrics "${sample}"
+done